@@ -0,0 +1,111 @@
+/* arena.h - Mini POSIX Shell
+ *
+ * Per-command memory arena. Everything allocated while a command line is
+ * processed is bump-allocated from a list of chunks and released at once by
+ * arena_reset(). The chunks are kept for the next command, so once the
+ * largest command seen so far fits, processing a command does not call
+ * malloc() or free() at all.
+ *
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#define ARENA_CHUNK 16384
+#define ARENA_ALIGN (sizeof(void *))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;        /* usable bytes in data */
+	size_t used;
+	char data[];
+};
+
+struct arena {
+	struct arena_chunk *first;
+	struct arena_chunk *cur;   /* chunk allocations are served from */
+};
+
+
+/* Initializes an empty arena, no memory is allocated until first use. */
+void arena_init(struct arena *a)
+{
+	a->first = NULL;
+	a->cur = NULL;
+}
+
+/* Releases all allocations at once, the chunks are kept for reuse. */
+void arena_reset(struct arena *a)
+{
+	struct arena_chunk *c;
+
+	for (c = a->first; c != NULL; c = c->next)
+		c->used = 0;
+	a->cur = a->first;
+}
+
+/* Frees the memory occupied by the arena. */
+void arena_free(struct arena *a)
+{
+	struct arena_chunk *c, *next;
+
+	for (c = a->first; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->first = NULL;
+	a->cur = NULL;
+}
+
+/* Returns size bytes of memory (aligned for any pointer) valid until the
+ * next arena_reset(), or NULL if there is not enough memory. */
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *c, **pc;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	/* chunks behind the current one are free since the last reset */
+	for (c = a->cur; c != NULL; c = c->next)
+		if (c->size - c->used >= size)
+			break;
+
+	if (c == NULL) {
+		c = malloc(sizeof(struct arena_chunk) +
+		           (size > ARENA_CHUNK ? size : ARENA_CHUNK));
+		if (c == NULL)
+			return NULL;
+		c->size = (size > ARENA_CHUNK) ? size : ARENA_CHUNK;
+		c->used = 0;
+		c->next = NULL;
+		for (pc = &a->first; *pc != NULL; pc = &(*pc)->next)
+			;
+		*pc = c;
+	}
+
+	a->cur = c;
+	p = c->data + c->used;
+	c->used += size;
+
+	return p;
+}
+
+/* Copies n bytes of s into the arena and terminates them with '\0'. */
+char *arena_strndup(struct arena *a, const char *s, size_t n)
+{
+	char *p = arena_alloc(a, n + 1);
+
+	if (p != NULL) {
+		memcpy(p, s, n);
+		p[n] = '\0';
+	}
+
+	return p;
+}
+
+#endif /* ARENA_H */
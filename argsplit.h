@@ -0,0 +1,100 @@
+/* argsplit.h - Mini POSIX Shell
+ *
+ * Splitting of argument lists too long for exec (the split built-in
+ * command). A command line may be as long as ARG_MAX, but exec also
+ * counts a pointer for every argument and the environment, so a line of
+ * many short arguments fails with E2BIG. With split on, a foreground
+ * command outside a pipeline is run the way xargs would run it: the
+ * leading arguments (the command name and its options by default, or the
+ * first KEEP words) are repeated in every invocation, the trailing ones
+ * are distributed over as few invocations as fit, run one after another
+ * or N at once. The exit status is the highest one of the invocations.
+ *
+ * The limit exec applies is computed as the kernel does: the strings and
+ * pointers of the arguments and of the environment (the shell never
+ * changes it, it is measured once) within ARG_MAX, at most 3/4 of the
+ * default stack limit. Should an invocation still fail with E2BIG, the
+ * limit is halved and the invocation split again.
+ *
+ */
+
+#ifndef ARGSPLIT_H
+#define ARGSPLIT_H
+
+#include <string.h>
+#include <unistd.h>
+
+/* highest limit of exec, 3/4 of the default 8 MB stack limit (_STK_LIM) */
+#define SPLIT_STK_LIMIT (8 * 1024 * 1024 / 4 * 3)
+/* room left for the path of the file and the auxiliary vector */
+#define SPLIT_HEADROOM 8192
+
+extern char **environ;
+
+/* invocations run at once, 0 if argument lists are not split */
+static int split_jobs;
+/* leading arguments repeated in every invocation, -1 for the command
+ * name and its options */
+static int split_keep = -1;
+/* bytes the environment takes of the exec limit, -1 if not measured */
+static long split_env = -1;
+
+
+/* Returns the bytes exec accepts for the strings and pointers of the
+ * arguments. */
+long split_limit(void)
+{
+	long limit;
+	char **e;
+
+	if (split_env == -1) {
+		split_env = 0;
+		for (e = environ; *e != NULL; e++)
+			split_env += strlen(*e) + 1 + sizeof(char *);
+	}
+	limit = sysconf(_SC_ARG_MAX);
+	if (limit <= 0 || limit > SPLIT_STK_LIMIT)
+		limit = SPLIT_STK_LIMIT;
+
+	return limit - split_env - SPLIT_HEADROOM;
+}
+
+/* Returns the bytes argument s takes of the exec limit. */
+static inline long split_cost(const char *s)
+{
+	return strlen(s) + 1 + sizeof(char *);
+}
+
+/* Returns the number of the leading arguments of argv (argc of them) which
+ * are repeated in every invocation: KEEP if set, otherwise the command
+ * name and the options which follow it (up to and including "--"). */
+int split_prefix(char **argv, int argc)
+{
+	int i;
+
+	if (split_keep >= 0)
+		return (split_keep < argc) ? split_keep : argc;
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+		if (strcmp(argv[i], "--") == 0)
+			return i + 1;
+
+	return i;
+}
+
+/* Returns the end (exclusive) of the invocation taking the trailing
+ * arguments of argv from start on: as many as fit in limit with the
+ * prefix costing used bytes, at least one. */
+int split_next(char **argv, int argc, int start, long used, long limit)
+{
+	int i;
+
+	for (i = start; i < argc; i++) {
+		used += split_cost(argv[i]);
+		if (used > limit && i > start)
+			break;
+	}
+
+	return i;
+}
+
+#endif /* ARGSPLIT_H */
@@ -0,0 +1,286 @@
+/* alloc.c - Mini POSIX Shell steady-state allocation check
+ *
+ * Runs a script of N commands (spawned ones with arguments and
+ * redirections, a pipeline, built-ins with and without redirections,
+ * background jobs and wait) through the shell twice, with WARM and with N
+ * commands, under a preload library which counts the calls of the
+ * allocator (built from this file as bench/alloc.so). Startup and exit cost the same in both runs, so the
+ * difference is what the extra commands cost: the check fails if running
+ * a command calls malloc() or free() once the shell is warm.
+ *
+ * Usage: bench/alloc [-n N] [-w WARM] [-s BACKEND] [-e LOOP] [SHELL]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#ifdef ALLOC_PRELOAD
+
+/* Preload library: the allocator of glibc is called through its __libc_
+ * names, the calls are counted and written to $ALLOC_OUT at exit. */
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *p);
+
+static unsigned long alloc_calls, free_calls;
+static char alloc_out[PATH_MAX];
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	__atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	__atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+	__atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+	return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+	*p = memalign(align, size);
+	return (*p == NULL) ? ENOMEM : 0;
+}
+
+void free(void *p)
+{
+	if (p != NULL)
+		__atomic_fetch_add(&free_calls, 1, __ATOMIC_RELAXED);
+	__libc_free(p);
+}
+
+/* Takes the output file and keeps the processes spawned by the shell from
+ * loading the library. */
+__attribute__((constructor)) static void alloc_start(void)
+{
+	const char *out = getenv("ALLOC_OUT");
+
+	if (out != NULL && strlen(out) < sizeof(alloc_out))
+		strcpy(alloc_out, out);
+	unsetenv("LD_PRELOAD");
+	unsetenv("ALLOC_OUT");
+}
+
+__attribute__((destructor)) static void alloc_end(void)
+{
+	char buf[64];
+	int fd, len;
+
+	if (alloc_out[0] == '\0')
+		return;
+	fd = open(alloc_out, O_WRONLY|O_TRUNC|O_CLOEXEC);
+	if (fd == -1)
+		return;
+	len = snprintf(buf, sizeof(buf), "%lu %lu\n",
+	               __atomic_load_n(&alloc_calls, __ATOMIC_RELAXED),
+	               __atomic_load_n(&free_calls, __ATOMIC_RELAXED));
+	if (write(fd, buf, len) != len)
+		len = -1;
+	close(fd);
+}
+
+#else /* ALLOC_PRELOAD */
+
+/* the script, repeated: every line is one command */
+static const char *alloc_lines[] = {
+	"/bin/true a b c >%s",
+	"/bin/true <%s",
+	"/bin/true x | /bin/true y",
+	"echo a 'b c' \"d\" >%s",
+	"test -n a",
+	"printf '%%s\\n' x >%s",
+	"/bin/true a &",
+	"/bin/true x | /bin/true y >%s &",
+	"wait",
+	NULL
+};
+
+struct alloc_count {
+	unsigned long alloc, free;
+};
+
+/* Writes the script of n commands redirected to file into path. Returns
+ * 0, -1 on error. */
+static int script(const char *path, const char *file, int n)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		fprintf(f, alloc_lines[i % (sizeof(alloc_lines) /
+		                            sizeof(alloc_lines[0]) - 1)], file);
+		fputc('\n', f);
+	}
+	if (fclose(f) == EOF) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Runs script path through shell under the preload library lib, the
+ * counts are read from file out into c. Returns 0, -1 on error. */
+static int run(const char *shell, const char *backend, const char *loop,
+               const char *lib, const char *path, const char *out,
+               struct alloc_count *c)
+{
+	char *argv[8];
+	FILE *f;
+	pid_t pid;
+	int i = 0, st;
+
+	argv[i++] = (char *)shell;
+	if (backend != NULL) {
+		argv[i++] = "-s";
+		argv[i++] = (char *)backend;
+	}
+	if (loop != NULL) {
+		argv[i++] = "-e";
+		argv[i++] = (char *)loop;
+	}
+	argv[i++] = (char *)path;
+	argv[i] = NULL;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		setenv("LD_PRELOAD", lib, 1);
+		setenv("ALLOC_OUT", out, 1);
+		execv(shell, argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &st, 0) == -1) {
+		perror("waitpid");
+		return -1;
+	}
+	if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+		fprintf(stderr, "%s: failed\n", shell);
+		return -1;
+	}
+
+	f = fopen(out, "r");
+	if (f == NULL || fscanf(f, "%lu %lu", &c->alloc, &c->free) != 2) {
+		fprintf(stderr, "%s: no allocation counts\n", lib);
+		if (f != NULL)
+			fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[] = "/tmp/alloc.XXXXXX", out[] = "/tmp/alloc.XXXXXX";
+	char file[] = "/tmp/alloc.XXXXXX", lib[PATH_MAX];
+	const char *shell = "./shell", *backend = NULL, *loop = NULL;
+	struct alloc_count warm, all;
+	long grown;
+	int n = 100000, w = 1000, opt, fd, rv = 1;
+
+	while ((opt = getopt(argc, argv, "n:w:s:e:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 'w':
+				w = atoi(optarg);
+				break;
+			case 's':
+				backend = optarg;
+				break;
+			case 'e':
+				loop = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n N] [-w WARM] "
+				        "[-s BACKEND] [-e LOOP] [SHELL]\n",
+				        argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc)
+		shell = argv[optind];
+	if (w <= 0)
+		w = 1;
+	if (n <= w)
+		n = w + 1;
+	if (realpath("bench/alloc.so", lib) == NULL) {
+		perror("bench/alloc.so");
+		return 1;
+	}
+
+	if ((fd = mkstemp(path)) == -1 || close(fd) == -1 ||
+	    (fd = mkstemp(out)) == -1 || close(fd) == -1 ||
+	    (fd = mkstemp(file)) == -1 || close(fd) == -1) {
+		perror("mkstemp");
+		goto out;
+	}
+
+	if (script(path, file, w) == -1 ||
+	    run(shell, backend, loop, lib, path, out, &warm) == -1)
+		goto out;
+	if (script(path, file, n) == -1 ||
+	    run(shell, backend, loop, lib, path, out, &all) == -1)
+		goto out;
+
+	printf("%9s %10s %10s\n", "commands", "malloc", "free");
+	printf("%9d %10lu %10lu\n", w, warm.alloc, warm.free);
+	printf("%9d %10lu %10lu\n", n, all.alloc, all.free);
+	grown = (long)(all.alloc - warm.alloc) + (long)(all.free - warm.free);
+	printf("%ld allocator calls for %d more commands\n", grown, n - w);
+	if (grown > 0)
+		fprintf(stderr, "FAIL: commands allocate memory\n");
+	else
+		rv = 0;
+
+out:
+	unlink(path);
+	unlink(out);
+	unlink(file);
+
+	return rv;
+}
+
+#endif /* ALLOC_PRELOAD */
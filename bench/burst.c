@@ -0,0 +1,193 @@
+/* burst.c - Mini POSIX Shell background job burst benchmark
+ *
+ * Runs a script of JOBS "/bin/true &" lines followed by wait through the
+ * shell with 0 (the exec thread spawns every job) up to MAX spawner threads
+ * (shell -j N, by default up to the number of CPUs) and prints the
+ * throughput of every pool size: the median wall time of ROUNDS runs of
+ * the script, jobs spawned per second and the speedup over no spawners.
+ * The scaling curve flattens at the number of CPUs, the spawners then
+ * compete with the jobs they start and with the signal thread reaping
+ * them.
+ *
+ * Usage: bench/burst [-n JOBS] [-r ROUNDS] [-j MAX] [-s BACKEND] [SHELL]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* most spawner threads of the shell (SPAWNER_MAX) */
+#define BURST_MAX 64
+
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Writes the script of n background jobs into path. Returns 0, -1 on
+ * error. */
+static int script(const char *path, int n)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		fputs("/bin/true &\n", f);
+	fputs("wait\n", f);
+	if (fclose(f) == EOF) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Runs the script path through shell with n spawners. Returns the wall
+ * time in milliseconds, -1 on error. */
+static double run(const char *shell, const char *backend, const char *path,
+                  int n)
+{
+	char spawners[16];
+	char *argv[8];
+	double t0;
+	pid_t pid;
+	int i = 0, st;
+
+	snprintf(spawners, sizeof(spawners), "%d", n);
+	argv[i++] = (char *)shell;
+	argv[i++] = "-j";
+	argv[i++] = spawners;
+	if (backend != NULL) {
+		argv[i++] = "-s";
+		argv[i++] = (char *)backend;
+	}
+	argv[i++] = (char *)path;
+	argv[i] = NULL;
+
+	t0 = now_ms();
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		execv(shell, argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &st, 0) == -1) {
+		perror("waitpid");
+		return -1;
+	}
+	if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+		fprintf(stderr, "%s: failed with %d spawners\n", shell, n);
+		return -1;
+	}
+
+	return now_ms() - t0;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[] = "/tmp/burst.XXXXXX";
+	const char *shell = "./shell", *backend = NULL;
+	double *wall, base = 0, med;
+	int jobs = 2000, rounds = 5, max = 0, opt, fd, n, r, rv = 1;
+	cpu_set_t set;
+
+	while ((opt = getopt(argc, argv, "n:r:j:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				jobs = atoi(optarg);
+				break;
+			case 'r':
+				rounds = atoi(optarg);
+				break;
+			case 'j':
+				max = atoi(optarg);
+				break;
+			case 's':
+				backend = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n JOBS] [-r ROUNDS] "
+				        "[-j MAX] [-s BACKEND] [SHELL]\n",
+				        argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc)
+		shell = argv[optind];
+	if (jobs <= 0)
+		jobs = 1;
+	if (rounds <= 0)
+		rounds = 1;
+	if (max <= 0) {
+		max = 1;
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+			max = CPU_COUNT(&set);
+	}
+	if (max > BURST_MAX)
+		max = BURST_MAX;
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	wall = malloc(rounds * sizeof(double));
+	if (wall == NULL) {
+		fprintf(stderr, "Not enough memory!\n");
+		goto out;
+	}
+	if (script(path, jobs) == -1)
+		goto out;
+
+	printf("%9s %7s %9s %9s %10s %8s\n", "spawners", "jobs", "p50_ms",
+	       "max_ms", "jobs_per_s", "speedup");
+	for (n = 0; n <= max; n++) {
+		for (r = 0; r < rounds; r++) {
+			wall[r] = run(shell, backend, path, n);
+			if (wall[r] == -1)
+				goto out;
+		}
+		qsort(wall, rounds, sizeof(double), cmp_double);
+		med = wall[rounds / 2];
+		if (n == 0)
+			base = med;
+		printf("%9d %7d %9.1f %9.1f %10.0f %8.2f\n", n, jobs, med,
+		       wall[rounds - 1], jobs / (med / 1e3), base / med);
+		fflush(stdout);
+	}
+	rv = 0;
+
+out:
+	free(wall);
+	unlink(path);
+
+	return rv;
+}
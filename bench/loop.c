@@ -0,0 +1,266 @@
+/* loop.c - Mini POSIX Shell event loop benchmark
+ *
+ * Compares the main loops of the shell (-e threads|epoll|uring), every one
+ * runs three workloads over a pipe,
+ *   builtin - one "pipesize" line at a time, waiting for its output
+ *             (round trip latency of a command which does not fork),
+ *   spawn   - one "/bin/echo x" line at a time (round trip with a spawn,
+ *             a tenth of the commands),
+ *   batch   - all "pipesize" lines written at once (throughput).
+ * For every workload the latency percentiles, commands per second and the
+ * CPU time used by the shell process itself (all of its threads, not the
+ * commands) are printed.
+ *
+ * Usage: bench/loop [-n COMMANDS] [-s SHELL]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct sh {
+	pid_t pid;
+	int in;    /* stdin of the shell */
+	int out;   /* stdout of the shell */
+	char buf[4096];
+	size_t len;
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Starts shell with event loop mode, returns -1 on error. */
+static int sh_start(struct sh *sh, const char *shell, const char *mode)
+{
+	int in[2], out[2];
+
+	if (pipe(in) == -1 || pipe(out) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	sh->pid = fork();
+	if (sh->pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (sh->pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execl(shell, shell, "-e", mode, (char *)NULL);
+		perror(shell);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	sh->in = in[1];
+	sh->out = out[0];
+	sh->len = 0;
+
+	return 0;
+}
+
+/* Ends the input of the shell and waits for it. */
+static void sh_stop(struct sh *sh)
+{
+	close(sh->in);
+	waitpid(sh->pid, NULL, 0);
+	close(sh->out);
+}
+
+/* Reads one line of the shell output. Returns 0, -1 on EOF or error. */
+static int sh_line(struct sh *sh)
+{
+	char *nl;
+	ssize_t r;
+
+	while ((nl = memchr(sh->buf, '\n', sh->len)) == NULL) {
+		if (sh->len == sizeof(sh->buf))
+			sh->len = 0;
+		r = read(sh->out, sh->buf + sh->len, sizeof(sh->buf) - sh->len);
+		if (r <= 0)
+			return -1;
+		sh->len += r;
+	}
+	sh->len -= nl + 1 - sh->buf;
+	memmove(sh->buf, nl + 1, sh->len);
+
+	return 0;
+}
+
+/* Returns the CPU time (user + system) used by process pid in ms, the
+ * waited for children are not counted. */
+static double cpu_ms(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long ut, st;
+	FILE *f;
+	double ms = 0.0;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0.0;
+	if (fgets(buf, sizeof(buf), f) != NULL) {
+		p = strrchr(buf, ')');   /* comm may contain spaces */
+		if (p != NULL && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u "
+		                        "%*u %*u %*u %*u %lu %lu", &ut, &st) == 2)
+			ms = (ut + st) * 1000.0 / sysconf(_SC_CLK_TCK);
+	}
+	fclose(f);
+
+	return ms;
+}
+
+struct feed {
+	int fd;
+	int n;
+};
+
+/* Writes the batch workload into the shell's stdin. */
+static void *feeder(void *arg)
+{
+	struct feed *fe = arg;
+	static const char cmd[] = "pipesize\n";
+	int i;
+
+	for (i = 0; i < fe->n; i++)
+		if (write(fe->fd, cmd, sizeof(cmd) - 1) == -1)
+			break;
+
+	return NULL;
+}
+
+/* Runs one workload in shell mode, prints the result row. Returns 0 on
+ * success, -1 on error. */
+static int run(const char *shell, const char *mode, const char *work, int n)
+{
+	static const char builtin[] = "pipesize\n", spawn[] = "/bin/echo x\n";
+	const char *cmd = (strcmp(work, "spawn") == 0) ? spawn : builtin;
+	size_t len = strlen(cmd);
+	struct feed fe;
+	struct sh sh;
+	pthread_t th;
+	double *lat, t0, t, c0, cpu;
+	int i, rv = 0;
+
+	lat = malloc(n * sizeof(double));
+	if (lat == NULL || sh_start(&sh, shell, mode) == -1) {
+		free(lat);
+		return -1;
+	}
+	/* the shell is up once it answers */
+	if (write(sh.in, builtin, sizeof(builtin) - 1) == -1 ||
+	    sh_line(&sh) == -1) {
+		fprintf(stderr, "%s -e %s: no output\n", shell, mode);
+		sh_stop(&sh);
+		free(lat);
+		return -1;
+	}
+
+	c0 = cpu_ms(sh.pid);
+	t0 = now_us();
+	if (strcmp(work, "batch") == 0) {
+		fe.fd = sh.in;
+		fe.n = n;
+		pthread_create(&th, NULL, feeder, &fe);
+		for (i = 0; i < n && rv == 0; i++)
+			rv = sh_line(&sh);
+		pthread_join(th, NULL);
+	} else {
+		for (i = 0; i < n && rv == 0; i++) {
+			t = now_us();
+			if (write(sh.in, cmd, len) == -1)
+				rv = -1;
+			else
+				rv = sh_line(&sh);
+			lat[i] = now_us() - t;
+		}
+	}
+	t = now_us() - t0;
+	cpu = cpu_ms(sh.pid) - c0;
+	sh_stop(&sh);
+
+	if (rv == -1) {
+		fprintf(stderr, "%s -e %s: lost output in %s\n", shell, mode,
+		        work);
+		free(lat);
+		return -1;
+	}
+	if (strcmp(work, "batch") == 0)
+		printf("%-8s %-8s %8d %10s %10s %10.0f %10.0f %10.2f\n", mode,
+		       work, n, "-", "-", n / (t / 1e6), cpu, cpu * 1e3 / n);
+	else {
+		qsort(lat, n, sizeof(double), cmp_double);
+		printf("%-8s %-8s %8d %10.1f %10.1f %10.0f %10.0f %10.2f\n",
+		       mode, work, n, lat[n / 2], lat[(size_t)(n * 0.99)],
+		       n / (t / 1e6), cpu, cpu * 1e3 / n);
+	}
+	fflush(stdout);
+	free(lat);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *modes[] = { "threads", "epoll", "uring", NULL };
+	static const char *works[] = { "builtin", "spawn", "batch", NULL };
+	char *shell = "./shell";
+	int n = 20000, opt, i, j, rv = 0;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 's':
+				shell = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n COMMANDS] "
+				        "[-s SHELL]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (n <= 0) {
+		fprintf(stderr, "%s: invalid number of commands\n", argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-8s %-8s %8s %10s %10s %10s %10s %10s\n", "loop", "work",
+	       "cmds", "p50_us", "p99_us", "cmds/s", "cpu_ms", "cpu_us/cmd");
+	for (j = 0; works[j] != NULL; j++)
+		for (i = 0; modes[i] != NULL; i++)
+			if (run(shell, modes[i], works[j],
+			        strcmp(works[j], "spawn") == 0 ? n / 10 : n)
+			    == -1)
+				rv = 1;
+
+	return rv;
+}
@@ -0,0 +1,542 @@
+/* parse.c - Mini POSIX Shell tokenizer benchmark
+ *
+ * Measures parse_line() from parse.h in bytes per CPU cycle (TSC cycles on
+ * x86, nanoseconds elsewhere) on a few synthetic command lines. The line
+ * is tokenized in place, so it is copied into a work buffer before every
+ * run; the cost of that copy is measured separately and subtracted.
+ *
+ * Every line is parsed with the byte by byte table walk ("table") and with
+ * each delimiter scanner from scan.h supported by the CPU, the scanners
+ * alone are measured too ("scan only").
+ *
+ * Then a corpus is parsed as the shell does (the scanner picked by
+ * scan_init()) and reported in nanoseconds per line and bytes per
+ * nanosecond: lines typed at a prompt or found in scripts, and adversarial
+ * ones (a huge argument vector, many redirections, a long pipeline, dense
+ * whitespace, heavy quoting). Lines of FILE (-c) are added as a set of
+ * their own.
+ *
+ * Last the input is split by the reader from reader.h as it arrives in
+ * chunks of 64 bytes to 32 KB: into lines (memchr() only) and into shell
+ * commands (quotes and line continuations carried over between chunks),
+ * on a script of typical lines and on one of commands spanning lines.
+ *
+ * Usage: bench/parse [-n ITERATIONS] [-c FILE]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#endif
+#include "../parse.h"
+#include "../reader.h"
+
+
+static unsigned long long ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Builds a line of n copies of word separated by a space. */
+static char *repeat(const char *head, const char *word, int n)
+{
+	size_t hl = strlen(head), wl = strlen(word);
+	char *line = malloc(hl + n * (wl + 1) + 1), *p;
+	int i;
+
+	if (line == NULL)
+		exit(1);
+	memcpy(line, head, hl);
+	for (p = line + hl, i = 0; i < n; i++, p += wl + 1) {
+		p[0] = ' ';
+		memcpy(p + 1, word, wl);
+	}
+	*p = '\0';
+
+	return line;
+}
+
+/* Returns the number of ticks one parse of line takes. */
+static double measure(const char *line, int iter, struct arena *a)
+{
+	size_t len = strlen(line) + 1;
+	char *buf = malloc(len);
+	struct command cmd;
+	unsigned long long t0, t_copy, t_parse;
+	const char *err;
+	volatile int sink = 0;
+	int i;
+
+	if (buf == NULL)
+		exit(1);
+
+	t0 = ticks();
+	for (i = 0; i < iter; i++) {
+		memcpy(buf, line, len);
+		sink += buf[i % len];
+	}
+	t_copy = ticks() - t0;
+
+	t0 = ticks();
+	for (i = 0; i < iter; i++) {
+		memcpy(buf, line, len);
+		if (parse_line(buf, len - 1, a, &cmd, &err) != 0) {
+			fprintf(stderr, "parse error: %s\n", err);
+			exit(1);
+		}
+		sink += cmd.argc;
+		arena_reset(a);
+	}
+	t_parse = ticks() - t0;
+
+	free(buf);
+	return (t_parse > t_copy ? t_parse - t_copy : 1) / (double)iter;
+}
+
+/* Returns the number of ticks scan_mask() takes for line. */
+static double measure_scan(const char *line, int iter)
+{
+	size_t len = strlen(line) + 1;
+	uint64_t *mask = malloc((len + 63) / 64 * sizeof(uint64_t));
+	unsigned long long t0;
+	volatile uint64_t sink = 0;
+	int i;
+
+	if (mask == NULL)
+		exit(1);
+	t0 = ticks();
+	for (i = 0; i < iter; i++) {
+		scan_mask(line, len, mask);
+		sink += mask[0];
+	}
+	t0 = ticks() - t0;
+	free(mask);
+
+	return t0 / (double)iter;
+}
+
+/* a set of lines of the corpus */
+struct corpus {
+	const char *name;
+	char **lines;
+	int n;
+	size_t bytes;   /* without the '\0's */
+};
+
+/* lines typed at a prompt or found in scripts */
+static const char *const typical[] = {
+	"ls -la",
+	"cd /usr/src/linux",
+	"make -j8 >build.log",
+	"git log --oneline -n 20",
+	"grep -rn 'struct command' . | sort | uniq -c",
+	"cat <input.txt | tr a-z A-Z >output.txt",
+	"ps aux | grep -v grep | grep sshd",
+	"find . -name '*.o' -newer Makefile",
+	"echo \"build of $PROJECT done\" >>/var/log/builds",
+	"tar czf /tmp/backup.tar.gz /etc/ssh /etc/hosts",
+	"sleep 10 &",
+	"kill %1",
+	"test -f /etc/passwd",
+	"[ -d /tmp ]",
+	"printf '%s: %d\\n' count 42",
+	"cc -O2 -Wall -pedantic -o shell shell.c",
+	"dmesg | tail -n 50 | less",
+	"/bin/true",
+	"wait",
+	"   ",
+	NULL
+};
+
+/* commands spanning lines, a quote or a continuation across a newline */
+static const char *const multiline[] = {
+	"echo \"first line\nsecond line\" done",
+	"cc -O2 -Wall \\\n   -o shell \\\n   shell.c",
+	"printf '%s\n%s\n' \\\n  'a b' \"c \\\"d\\\"\"",
+	"git commit -m 'Subject\n\nBody of the message,\nwrapped.'",
+	"ls -la",
+	NULL
+};
+
+/* Fills set c with the lines of the NULL terminated array lines (copied). */
+static void corpus_add(struct corpus *c, const char *name,
+                       const char *const *lines)
+{
+	int i;
+
+	c->name = name;
+	for (c->n = 0; lines[c->n] != NULL; c->n++)
+		;
+	c->lines = malloc(c->n * sizeof(char *));
+	if (c->lines == NULL)
+		exit(1);
+	c->bytes = 0;
+	for (i = 0; i < c->n; i++) {
+		c->lines[i] = strdup(lines[i]);
+		if (c->lines[i] == NULL)
+			exit(1);
+		c->bytes += strlen(lines[i]);
+	}
+}
+
+/* Fills set c with line alone, taking it over. */
+static void corpus_one(struct corpus *c, const char *name, char *line)
+{
+	c->name = name;
+	c->n = 1;
+	c->lines = malloc(sizeof(char *));
+	if (c->lines == NULL)
+		exit(1);
+	c->lines[0] = line;
+	c->bytes = strlen(line);
+}
+
+/* Fills set c with the lines of file path. Returns 0 on success, -1 on
+ * error (reported). */
+static int corpus_file(struct corpus *c, const char *path)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int max = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	c->name = "file";
+	c->n = 0;
+	c->lines = NULL;
+	c->bytes = 0;
+	while ((len = getline(&line, &cap, f)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (c->n == max) {
+			max = max ? 2 * max : 64;
+			c->lines = realloc(c->lines, max * sizeof(char *));
+			if (c->lines == NULL)
+				exit(1);
+		}
+		c->lines[c->n] = strdup(line);
+		if (c->lines[c->n++] == NULL)
+			exit(1);
+		c->bytes += len;
+	}
+	free(line);
+	fclose(f);
+	if (c->n == 0) {
+		fprintf(stderr, "%s: no lines\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns the nanoseconds one pass of parsing every line of set c takes,
+ * the copies of the lines into the work buffer subtracted. */
+static double measure_set(const struct corpus *c, int iter, struct arena *a)
+{
+	size_t *len, max = 0;
+	char *buf;
+	struct command cmd;
+	unsigned long long t0, t_copy, t_parse;
+	const char *err;
+	volatile int sink = 0;
+	int i, j;
+
+	len = malloc(c->n * sizeof(size_t));
+	if (len == NULL)
+		exit(1);
+	for (j = 0; j < c->n; j++) {
+		len[j] = strlen(c->lines[j]) + 1;
+		if (len[j] > max)
+			max = len[j];
+	}
+	buf = malloc(max);
+	if (buf == NULL)
+		exit(1);
+
+	t0 = now_ns();
+	for (i = 0; i < iter; i++) {
+		for (j = 0; j < c->n; j++) {
+			memcpy(buf, c->lines[j], len[j]);
+			sink += buf[i % len[j]];
+		}
+	}
+	t_copy = now_ns() - t0;
+
+	t0 = now_ns();
+	for (i = 0; i < iter; i++) {
+		for (j = 0; j < c->n; j++) {
+			memcpy(buf, c->lines[j], len[j]);
+			/* syntax errors are part of an adversarial corpus */
+			if (parse_line(buf, len[j] - 1, a, &cmd, &err) == -1) {
+				fprintf(stderr, "Not enough memory!\n");
+				exit(1);
+			}
+			sink += cmd.argc;
+			arena_reset(a);
+		}
+	}
+	t_parse = now_ns() - t0;
+
+	free(buf);
+	free(len);
+	return (t_parse > t_copy ? t_parse - t_copy : 1) / (double)iter;
+}
+
+/* Returns a script of the NULL terminated lines repeated up to size
+ * bytes, its length is stored in len. */
+static char *script(const char *const *lines, size_t size, size_t *len)
+{
+	char *s = malloc(size + 4096), *p = s;
+	size_t n;
+	int i = 0;
+
+	if (s == NULL)
+		exit(1);
+	while (p - s < (ptrdiff_t)size) {
+		n = strlen(lines[i]);
+		memcpy(p, lines[i], n);
+		p += n;
+		*p++ = '\n';
+		if (lines[++i] == NULL)
+			i = 0;
+	}
+	*len = p - s;
+
+	return s;
+}
+
+/* Returns the nanoseconds one pass of the reader takes to split script
+ * (len bytes) into lines, or into commands if cmds is set, while it
+ * arrives in chunks of chunk bytes. The pieces are counted in count. */
+static double measure_stream(const char *script, size_t len, size_t chunk,
+                             int cmds, int iter, long *count)
+{
+	struct reader rd;
+	unsigned long long t0;
+	size_t off, k;
+	ssize_t n, room;
+	char *p, *line;
+	int i;
+
+	t0 = now_ns();
+	for (i = 0; i < iter; i++) {
+		if (reader_init(&rd, -1, 1 << 20) == -1)
+			exit(1);
+		if (cmds)
+			reader_commands(&rd, NULL);
+		*count = 0;
+		off = 0;
+		while ((n = reader_next(&rd, &line, 0)) != READER_EOF) {
+			if (n != READER_AGAIN) {
+				(*count)++;
+				continue;
+			}
+			/* the next chunk, none left marks the end */
+			room = reader_space(&rd, &p);
+			if (room == -1)
+				exit(1);
+			k = len - off;
+			if (k > chunk)
+				k = chunk;
+			if (k > (size_t)room)
+				k = room;
+			memcpy(p, script + off, k);
+			off += k;
+			reader_commit(&rd, k);
+		}
+		reader_free(&rd);
+	}
+
+	return (now_ns() - t0) / (double)iter;
+}
+
+/* Builds a pipeline of n stages cmd. */
+static char *stages(const char *cmd, int n)
+{
+	size_t cl = strlen(cmd);
+	char *line = malloc(n * (cl + 3) + 1), *p = line;
+	int i;
+
+	if (line == NULL)
+		exit(1);
+	for (i = 0; i < n; i++) {
+		if (i > 0) {
+			memcpy(p, " | ", 3);
+			p += 3;
+		}
+		memcpy(p, cmd, cl);
+		p += cl;
+	}
+	*p = '\0';
+
+	return line;
+}
+
+int main(int argc, char *argv[])
+{
+	struct corpus set[8];
+	struct arena a;
+	struct {
+		const char *name;
+		char *line;
+	} lines[5];
+	struct {
+		const char *name;
+		char *s;
+		size_t len;
+	} streams[2];
+	const char *file = NULL;
+	int iter = 20000, opt, i, j, n, nset;
+	size_t k;
+	long count;
+	double t;
+
+	while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iter = atoi(optarg);
+				break;
+			case 'c':
+				file = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n ITERATIONS] "
+				        "[-c FILE]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (iter <= 0)
+		iter = 1;
+
+	lines[0].name = "short";
+	lines[0].line = strdup("ls -la /tmp >/tmp/out");
+	lines[1].name = "many_args";
+	lines[1].line = repeat("rm -f", "build/obj/module_file.o", 2000);
+	lines[2].name = "quoted";
+	lines[2].line = repeat("echo",
+	                       "'single q' \"double \\\" q\" a\\ b", 500);
+	lines[3].name = "dense_ws";
+	lines[3].line = repeat("echo", " \t  x \t ", 2000);
+	lines[4].name = "long_word";
+	lines[4].line = malloc(4 + 65536 + 1);
+	if (lines[4].line == NULL)
+		return 1;
+	memcpy(lines[4].line, "cat ", 4);
+	memset(lines[4].line + 4, 'a', 65536);
+	lines[4].line[65540] = '\0';
+
+	arena_init(&a);
+	printf("%-10s %8s %-8s %12s %12s\n", "line", "bytes", "scanner",
+	       "ticks/line", "bytes/tick");
+	for (i = 0; i < 5; i++) {
+		n = strlen(lines[i].line);
+		for (j = -1; j == -1 || scan_names[j] != NULL; j++) {
+			/* j == -1 is the table walk without the bitmap */
+			if (j == -1) {
+				parse_scan_min = (size_t)-1;
+			} else {
+				parse_scan_min = 0;
+				if (scan_select(scan_names[j]) == -1)
+					continue;
+			}
+			t = measure(lines[i].line,
+			            n > 4096 ? iter / 20 + 1 : iter, &a);
+			printf("%-10s %8d %-8s %12.0f %12.3f\n", lines[i].name,
+			       n, j == -1 ? "table" : scan_names[j], t, n / t);
+		}
+	}
+
+	printf("\nscan only (%s):\n", lines[1].name);
+	n = strlen(lines[1].line);
+	for (j = 0; scan_names[j] != NULL; j++) {
+		if (scan_select(scan_names[j]) == -1)
+			continue;
+		t = measure_scan(lines[1].line, iter / 20 + 1);
+		printf("%-10s %8d %-8s %12.0f %12.3f\n", "", n, scan_names[j],
+		       t, n / t);
+	}
+
+	for (i = 0; i < 5; i++)
+		free(lines[i].line);
+
+	nset = 0;
+	corpus_add(&set[nset++], "typical", typical);
+	corpus_one(&set[nset++], "huge_argv",
+	           repeat("rm -f", "src/obj/module_0000.o", 100000));
+	corpus_one(&set[nset++], "redirs",
+	           repeat("sort", ">out.txt <in.txt", 5000));
+	corpus_one(&set[nset++], "pipeline", stages("tr -d x", 1000));
+	corpus_one(&set[nset++], "dense_ws",
+	           repeat("echo", "  \t \t  \t  a  \t\t  ", 5000));
+	corpus_one(&set[nset++], "quoting",
+	           repeat("echo", "\"a\\\"b\"'c d'\\ e\"\"''f", 5000));
+	if (file != NULL) {
+		if (corpus_file(&set[nset], file) == -1)
+			return 1;
+		nset++;
+	}
+
+	parse_scan_min = PARSE_SCAN_MIN;
+	scan_init();
+	printf("\ncorpus:\n%-10s %8s %10s %12s %12s\n", "set", "lines",
+	       "bytes", "ns/line", "bytes/ns");
+	for (i = 0; i < nset; i++) {
+		t = measure_set(&set[i], set[i].bytes > 4096 ? iter / 200 + 1 :
+		                iter, &a);
+		printf("%-10s %8d %10zu %12.1f %12.3f\n", set[i].name,
+		       set[i].n, set[i].bytes, t / set[i].n, set[i].bytes / t);
+		for (j = 0; j < set[i].n; j++)
+			free(set[i].lines[j]);
+		free(set[i].lines);
+	}
+	arena_free(&a);
+
+	streams[0].name = "typical";
+	streams[0].s = script(typical, 1 << 20, &streams[0].len);
+	streams[1].name = "multiline";
+	streams[1].s = script(multiline, 1 << 20, &streams[1].len);
+	printf("\nstream:\n%-10s %8s %-8s %8s %10s %12s\n", "script", "chunk",
+	       "split", "pieces", "bytes", "bytes/ns");
+	for (i = 0; i < 2; i++) {
+		for (k = 64; k <= 65536; k *= 8) {
+			for (j = 0; j < 2; j++) {
+				t = measure_stream(streams[i].s, streams[i].len,
+				                   k, j, iter / 2000 + 1, &count);
+				printf("%-10s %8zu %-8s %8ld %10zu %12.3f\n",
+				       streams[i].name, k,
+				       j ? "commands" : "lines", count,
+				       streams[i].len, streams[i].len / t);
+			}
+		}
+		free(streams[i].s);
+	}
+
+	return 0;
+}
@@ -0,0 +1,331 @@
+/* pty.c - Mini POSIX Shell interactive latency benchmark
+ *
+ * Runs the shell on a pseudo-terminal and types commands into it the way
+ * a user does, a whole line ending with Enter, and measures the latency
+ * seen on the terminal:
+ *   enter->exec   - from Enter until the typed command runs (the command is
+ *                   this program started as a probe, the time includes its
+ *                   exec and dynamic loading),
+ *   exit->prompt  - from the exit of the probe until the next "$ " prompt
+ *                   is read from the terminal,
+ *   builtin       - from Enter until the prompt after "true" (a built-in
+ *                   command in most shells).
+ * The probe takes its clock when main() starts and just before it exits
+ * and sends both through a FIFO. Every load (-l, busy looping processes,
+ * by default none and one per CPU) is measured for ITERATIONS rounds, the
+ * percentiles of every measure are printed. PS1 is set to "$ " for other
+ * shells (bench/pty dash, bench/pty bash --norc --noediting).
+ *
+ * Usage: bench/pty [-n ITERATIONS] [-l LOAD[,LOAD...]] [SHELL [ARG...]]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+/* most busy looping processes */
+#define PTY_LOAD_MAX 256
+/* time to wait for a prompt */
+#define PTY_TIMEOUT_MS 10000
+
+enum { M_EXEC = 0, M_PROMPT, M_BUILTIN, M_COUNT };
+
+static const char *const measure_names[M_COUNT] = {
+	"enter->exec", "exit->prompt", "builtin"
+};
+
+/* what the probe sends */
+struct probe {
+	double start;   /* main() entered, us */
+	double end;     /* about to exit, us */
+};
+
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Probe: sends its start and end time into FIFO path. */
+static int probe(const char *path)
+{
+	struct probe p;
+	int fd;
+
+	p.start = now_us();
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return 1;
+	p.end = now_us();
+	if (write(fd, &p, sizeof(p)) != sizeof(p))
+		return 1;
+
+	return 0;
+}
+
+/* Starts argv on a new pseudo-terminal, its master is stored in master.
+ * Returns the pid or -1 on error. */
+static pid_t start_shell(char **argv, int *master)
+{
+	struct winsize ws = { 24, 80, 0, 0 };
+	char *name;
+	pid_t pid;
+	int fd;
+
+	*master = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC);
+	if (*master == -1 || grantpt(*master) == -1 ||
+	    unlockpt(*master) == -1 || (name = ptsname(*master)) == NULL) {
+		perror("pty");
+		return -1;
+	}
+	ioctl(*master, TIOCSWINSZ, &ws);
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		/* the terminal becomes the controlling one of a new session */
+		setsid();
+		fd = open(name, O_RDWR);
+		if (fd == -1)
+			_exit(127);
+		ioctl(fd, TIOCSCTTY, 0);
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+		setenv("PS1", "$ ", 1);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+/* Reads the terminal until the output ends with the prompt. Returns the
+ * time the prompt was read, -1 on timeout or EOF. */
+static double read_prompt(int master)
+{
+	struct pollfd pfd = { master, POLLIN, 0 };
+	char buf[4096], last[2] = { 0, 0 };
+	ssize_t n;
+
+	for (;;) {
+		if (poll(&pfd, 1, PTY_TIMEOUT_MS) <= 0)
+			return -1;
+		n = read(master, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		if (n >= 2) {
+			last[0] = buf[n - 2];
+			last[1] = buf[n - 1];
+		} else {
+			last[0] = last[1];
+			last[1] = buf[0];
+		}
+		if (last[0] == '$' && last[1] == ' ')
+			return now_us();
+	}
+}
+
+/* Types line into the terminal. Returns the time of the Enter, -1 on
+ * error. */
+static double type_line(int master, const char *line)
+{
+	double t = now_us();
+
+	if (write(master, line, strlen(line)) != (ssize_t)strlen(line)) {
+		perror("write");
+		return -1;
+	}
+
+	return t;
+}
+
+/* Prints the percentiles of the n samples of v. */
+static void report(int load, const char *name, double *v, int n)
+{
+	qsort(v, n, sizeof(double), cmp_double);
+	printf("%4d  %-13s %7d %9.1f %9.1f %9.1f %9.1f %9.1f\n", load, name, n,
+	       v[n / 2], v[n * 90 / 100], v[n * 99 / 100], v[n * 999 / 1000],
+	       v[n - 1]);
+	fflush(stdout);
+}
+
+/* Runs iter rounds with load busy looping processes. Returns 0, -1 on
+ * error. */
+static int run(char **argv, const char *cmd, int rfd, int iter, int load)
+{
+	static pid_t busy[PTY_LOAD_MAX];
+	double *v[M_COUNT], enter, prompt;
+	struct probe p;
+	pid_t sh;
+	int master, i, m, st, rv = -1;
+
+	for (m = 0; m < M_COUNT; m++) {
+		v[m] = malloc(iter * sizeof(double));
+		if (v[m] == NULL) {
+			fprintf(stderr, "Not enough memory!\n");
+			return -1;
+		}
+	}
+	for (i = 0; i < load; i++) {
+		busy[i] = fork();
+		if (busy[i] == 0)
+			for (;;)
+				;
+	}
+
+	sh = start_shell(argv, &master);
+	if (sh == -1)
+		goto out;
+	if (read_prompt(master) == -1) {
+		fprintf(stderr, "%s: no prompt\n", argv[0]);
+		goto out_shell;
+	}
+	for (i = 0; i < iter; i++) {
+		enter = type_line(master, cmd);
+		prompt = read_prompt(master);
+		if (enter == -1 || prompt == -1 ||
+		    read(rfd, &p, sizeof(p)) != sizeof(p)) {
+			fprintf(stderr, "%s: round %d failed\n", argv[0], i);
+			goto out_shell;
+		}
+		v[M_EXEC][i] = p.start - enter;
+		v[M_PROMPT][i] = prompt - p.end;
+
+		enter = type_line(master, "true\n");
+		prompt = read_prompt(master);
+		if (enter == -1 || prompt == -1) {
+			fprintf(stderr, "%s: round %d failed\n", argv[0], i);
+			goto out_shell;
+		}
+		v[M_BUILTIN][i] = prompt - enter;
+	}
+	for (m = 0; m < M_COUNT; m++)
+		report(load, measure_names[m], v[m], iter);
+	rv = 0;
+
+out_shell:
+	type_line(master, "exit\n");
+	close(master);
+	kill(sh, SIGHUP);
+	waitpid(sh, &st, 0);
+out:
+	for (i = 0; i < load; i++) {
+		kill(busy[i], SIGKILL);
+		waitpid(busy[i], &st, 0);
+	}
+	for (m = 0; m < M_COUNT; m++)
+		free(v[m]);
+
+	return rv;
+}
+
+int main(int argc, char *argv[])
+{
+	static char *def_argv[] = { "./shell", NULL };
+	char self[4096], fifo[64], cmd[4096 + 128], *loads = NULL, *l;
+	char **sh_argv = def_argv;
+	int iter = 2000, opt, load, rfd, rv = 0;
+	ssize_t n;
+
+	if (argc == 3 && strcmp(argv[1], "-P") == 0)
+		return probe(argv[2]);
+
+	while ((opt = getopt(argc, argv, "+n:l:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iter = atoi(optarg);
+				break;
+			case 'l':
+				loads = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n ITERATIONS] "
+				        "[-l LOAD[,LOAD...]] [SHELL [ARG...]]\n",
+				        argv[0]);
+				return 1;
+		}
+	}
+	if (iter <= 0)
+		iter = 1;
+	if (optind < argc)
+		sh_argv = argv + optind;
+
+	n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (n == -1) {
+		perror("readlink");
+		return 1;
+	}
+	self[n] = '\0';
+	snprintf(fifo, sizeof(fifo), "/tmp/pty.%d", getpid());
+	if (mkfifo(fifo, 0600) == -1) {
+		perror(fifo);
+		return 1;
+	}
+	/* read and write, the probes never block opening it */
+	rfd = open(fifo, O_RDWR|O_CLOEXEC);
+	if (rfd == -1) {
+		perror(fifo);
+		unlink(fifo);
+		return 1;
+	}
+	snprintf(cmd, sizeof(cmd), "%s -P %s\n", self, fifo);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%4s  %-13s %7s %9s %9s %9s %9s %9s\n", "load", "measure",
+	       "count", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+	if (loads == NULL) {
+		if (run(sh_argv, cmd, rfd, iter, 0) == -1)
+			rv = 1;
+		load = sysconf(_SC_NPROCESSORS_ONLN);
+		if (run(sh_argv, cmd, rfd, iter,
+		        load < PTY_LOAD_MAX ? load : PTY_LOAD_MAX) == -1)
+			rv = 1;
+	} else {
+		for (l = strtok(loads, ","); l != NULL; l = strtok(NULL, ",")) {
+			load = atoi(l);
+			if (load < 0 || load > PTY_LOAD_MAX) {
+				fprintf(stderr, "%s: invalid load\n", l);
+				rv = 1;
+				continue;
+			}
+			if (run(sh_argv, cmd, rfd, iter, load) == -1)
+				rv = 1;
+		}
+	}
+
+	close(rfd);
+	unlink(fifo);
+
+	return rv;
+}
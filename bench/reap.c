@@ -0,0 +1,290 @@
+/* reap.c - Mini POSIX Shell background job reaping stress benchmark
+ *
+ * Feeds the shell with N background jobs ("true &" lines) followed by the
+ * wait built-in and checks that every job is reaped. While the jobs run,
+ * the children of the shell are sampled through /proc and the time every
+ * zombie stays unreaped is measured (with the resolution of the sampling
+ * interval). The benchmark fails if any zombie is left behind once wait
+ * returns, or if the 99th percentile of the zombie lifetimes exceeds MAX_US
+ * (REAP_MAX_US by default: a few sampling intervals of lag are noise,
+ * zombies reaped only by wait live for seconds).
+ *
+ * Usage: bench/reap [-n JOBS] [-i INTERVAL_US] [-l MAX_US] [-s SHELL]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+
+/* zombies tracked at once */
+#define REAP_TRACK 4096
+/* default limit of the 99th percentile zombie lifetime, microseconds */
+#define REAP_MAX_US 50000
+
+struct zombie {
+	pid_t pid;
+	double since;   /* first seen, microseconds */
+	int seen;       /* seen in the current sample */
+};
+
+static struct zombie zombies[REAP_TRACK];
+static int nzombies;
+static double *life;   /* lifetimes of the reaped zombies */
+static size_t nlife, caplife;
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Returns 1 if process pid is a zombie. */
+static int is_zombie(pid_t pid)
+{
+	char path[64], buf[256], *p;
+	FILE *f;
+	int z = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) != NULL) {
+		p = strrchr(buf, ')');   /* comm may contain spaces */
+		z = (p != NULL && p[1] == ' ' && p[2] == 'Z');
+	}
+	fclose(f);
+
+	return z;
+}
+
+static void record(double us)
+{
+	double *l;
+
+	if (nlife == caplife) {
+		l = realloc(life, 2 * (caplife + 1024) * sizeof(double));
+		if (l == NULL)
+			return;
+		life = l;
+		caplife = 2 * (caplife + 1024);
+	}
+	life[nlife++] = us;
+}
+
+/* Samples the children of all threads of process sh, updates the zombie
+ * lifetimes. Returns the number of zombies found. */
+static int sample(pid_t sh)
+{
+	char path[320];
+	DIR *d;
+	struct dirent *e;
+	FILE *f;
+	pid_t pid;
+	double t = now_us();
+	int i, n = 0;
+
+	for (i = 0; i < nzombies; i++)
+		zombies[i].seen = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", sh);
+	d = opendir(path);
+	if (d == NULL)
+		return 0;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%s/children", sh,
+		         e->d_name);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		while (fscanf(f, "%d", &pid) == 1) {
+			if (!is_zombie(pid))
+				continue;
+			n++;
+			for (i = 0; i < nzombies && zombies[i].pid != pid; i++)
+				;
+			if (i == nzombies) {
+				if (nzombies == REAP_TRACK)
+					continue;
+				zombies[nzombies].pid = pid;
+				zombies[nzombies].since = t;
+				nzombies++;
+			}
+			zombies[i].seen = 1;
+		}
+		fclose(f);
+	}
+	closedir(d);
+
+	/* zombies not seen any more were reaped */
+	for (i = 0; i < nzombies; ) {
+		if (zombies[i].seen) {
+			i++;
+			continue;
+		}
+		record(t - zombies[i].since);
+		zombies[i] = zombies[--nzombies];
+	}
+
+	return n;
+}
+
+struct feed {
+	int fd;
+	int jobs;
+};
+
+/* Writes the script into the shell's stdin. */
+static void *feeder(void *arg)
+{
+	struct feed *fe = arg;
+	static const char job[] = "true &\n", end[] = "wait\necho done\n";
+	int i;
+
+	for (i = 0; i < fe->jobs; i++)
+		if (write(fe->fd, job, sizeof(job) - 1) == -1)
+			return NULL;
+	if (write(fe->fd, end, sizeof(end) - 1) == -1)
+		return NULL;
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	char *shell = "./shell", buf[64];
+	int jobs = 50000, interval = 1000, opt, in[2], out[2], n, left;
+	double max_us = REAP_MAX_US, p99;
+	int maxz = 0, samples = 0;
+	long sumz = 0;
+	struct feed fe;
+	struct timeval tv;
+	fd_set rfds;
+	pthread_t th;
+	double t0, t;
+	pid_t sh;
+	ssize_t r;
+
+	while ((opt = getopt(argc, argv, "n:i:l:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				jobs = atoi(optarg);
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'l':
+				max_us = atof(optarg);
+				break;
+			case 's':
+				shell = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n JOBS] "
+				        "[-i INTERVAL_US] [-l MAX_US] [-s SHELL]\n",
+				        argv[0]);
+				return 1;
+		}
+	}
+
+	if (pipe(in) == -1 || pipe(out) == -1) {
+		perror("pipe");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	sh = fork();
+	if (sh == -1) {
+		perror("fork");
+		return 1;
+	}
+	if (sh == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execl(shell, shell, (char *)NULL);
+		perror(shell);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+
+	t0 = now_us();
+	fe.fd = in[1];
+	fe.jobs = jobs;
+	pthread_create(&th, NULL, feeder, &fe);
+
+	/* sample until the shell prints "done" after wait */
+	for (;;) {
+		tv.tv_sec = 0;
+		tv.tv_usec = interval;
+		FD_ZERO(&rfds);
+		FD_SET(out[0], &rfds);
+		if (select(out[0] + 1, &rfds, NULL, NULL, &tv) > 0) {
+			r = read(out[0], buf, sizeof(buf));
+			if (r <= 0)
+				break;
+			if (memmem(buf, r, "done", 4) != NULL)
+				break;
+		}
+		n = sample(sh);
+		samples++;
+		sumz += n;
+		if (n > maxz)
+			maxz = n;
+	}
+	t = now_us() - t0;
+	pthread_join(th, NULL);
+
+	left = sample(sh);
+	close(in[1]);   /* end of input, the shell exits */
+	waitpid(sh, NULL, 0);
+
+	printf("%8s %10s %10s %10s %10s %12s %12s %8s\n", "jobs", "seconds",
+	       "jobs/s", "max_zomb", "mean_zomb", "p99_life_us",
+	       "max_life_us", "left");
+	if (nlife > 0)
+		qsort(life, nlife, sizeof(double), cmp_double);
+	p99 = nlife ? life[(size_t)(nlife * 0.99)] : 0.0;
+	printf("%8d %10.2f %10.0f %10d %10.2f %12.0f %12.0f %8d\n", jobs,
+	       t / 1e6, jobs / (t / 1e6), maxz,
+	       samples ? (double)sumz / samples : 0.0, p99,
+	       nlife ? life[nlife - 1] : 0.0, left);
+	free(life);
+
+	if (left != 0) {
+		fprintf(stderr, "FAIL: %d zombies left\n", left);
+		return 1;
+	}
+	if (p99 > max_us) {
+		fprintf(stderr, "FAIL: p99 zombie lifetime %.0f us exceeds %.0f "
+		        "us\n", p99, max_us);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,160 @@
+/* spawn.c - Mini POSIX Shell spawn benchmark
+ *
+ * Measures the latency of spawning and reaping /bin/true with every spawn
+ * backend from spawn.h while the resident set of the parent grows, and the
+ * part of it until spawn_file() returns (the exec is done). Two idle
+ * threads are started to mimic the signal and input threads of the shell,
+ * the zygote is started before them as the shell does.
+ *
+ * Usage: bench/spawn [-n ITERATIONS] [-m MB[,MB...]] [-c PROGRAM]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "../spawn.h"
+
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void *idle_thread(void *arg)
+{
+	pause();
+	return NULL;
+}
+
+/* Returns the resident set size of this process in megabytes. */
+static long rss_mb(void)
+{
+	long pages = 0, rss = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f != NULL) {
+		if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+			rss = 0;
+		fclose(f);
+	}
+
+	return rss * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+/* Spawns prog n times with backend b, stores per spawn latencies in lat
+ * and the part until spawn_file() returned in sp. */
+static int run(enum spawn_backend b, char *prog, int n, double *lat,
+               double *sp)
+{
+	char *argv[] = { prog, NULL };
+	struct spawn_attr sa;
+	double t0;
+	pid_t pid;
+	int i, rc;
+
+	spawn_backend = b;
+	spawn_attr_init(&sa);
+	for (i = 0; i < n; i++) {
+		t0 = now_us();
+		rc = spawn_file(&pid, argv, &sa);
+		sp[i] = now_us() - t0;
+		if (rc != 0) {
+			fprintf(stderr, "%s: %s\n", spawn_names[b], strerror(rc));
+			return -1;
+		}
+		waitpid(pid, NULL, 0);
+		lat[i] = now_us() - t0;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char def_sizes[] = "0,64,256,1024";
+	char *sizes = def_sizes, *prog = "/bin/true", *s;
+	int n = 2000, opt, b, i;
+	pthread_t th[2];
+	double *lat, *sp, sum;
+	char *heap = NULL;
+	size_t have = 0, want;
+
+	while ((opt = getopt(argc, argv, "n:m:c:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 'm':
+				sizes = optarg;
+				break;
+			case 'c':
+				prog = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n ITERATIONS] "
+				        "[-m MB[,MB...]] [-c PROGRAM]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (n <= 0)
+		n = 1;
+
+	/* started small and single threaded, like the shell does */
+	zygote_start(ZYGOTE_POOL);
+	lat = malloc(n * sizeof(double));
+	sp = malloc(n * sizeof(double));
+	if (lat == NULL || sp == NULL)
+		return 1;
+	for (i = 0; i < 2; i++)
+		pthread_create(&th[i], NULL, idle_thread, NULL);
+
+	printf("%8s %-12s %10s %10s %10s %10s\n", "rss_mb", "backend",
+	       "mean_us", "p50_us", "p99_us", "spawn_p50");
+	for (s = strtok(sizes, ","); s != NULL; s = strtok(NULL, ",")) {
+		/* grow (and touch) the heap so the page tables are populated */
+		want = (size_t)atol(s) * 1024 * 1024;
+		if (want > have) {
+			heap = realloc(heap, want);
+			if (heap == NULL) {
+				perror("realloc");
+				return 1;
+			}
+			memset(heap + have, 1, want - have);
+			have = want;
+		}
+
+		for (b = 0; b < SPAWN_NBACKENDS; b++) {
+			if (run(b, prog, n, lat, sp) == -1)
+				continue;
+			for (sum = 0, i = 0; i < n; i++)
+				sum += lat[i];
+			qsort(lat, n, sizeof(double), cmp_double);
+			qsort(sp, n, sizeof(double), cmp_double);
+			printf("%8ld %-12s %10.1f %10.1f %10.1f %10.1f\n",
+			       rss_mb(), spawn_names[b], sum / n, lat[n / 2],
+			       lat[(int)(n * 0.99)], sp[n / 2]);
+			fflush(stdout);
+		}
+	}
+
+	free(heap);
+	free(lat);
+	free(sp);
+	return 0;
+}
@@ -0,0 +1,498 @@
+/* suite.c - Mini POSIX Shell end-to-end benchmark suite
+ *
+ * Runs the same workloads through this shell and, where they are installed,
+ * through dash, bash and busybox ash, and prints the results as JSON (one
+ * object, a "results" array with a member per shell and workload) so runs
+ * of different commits can be compared by a script. A table is printed on
+ * stderr meanwhile. The workloads are scripts of plain lines, the shell
+ * has no loops, so a loop is written out:
+ *   true  - N "/bin/true" lines,
+ *   jobs  - N/10 "/bin/true &" lines and wait,
+ *   redir - N/4 times echo >FILE, echo >FILE2, /bin/cat <FILE >/dev/null
+ *           and a built-in with <FILE,
+ *   args  - N/100 "/bin/true" and echo >/dev/null lines with ARGS
+ *           arguments each,
+ *   soak  - a mix of the above piped to the shell's stdin for SECONDS, the
+ *           resident set of the shell is sampled every second and its
+ *           growth per hour is fitted (least squares, the first tenth of
+ *           the samples is the warm up and left out).
+ * Every script is run from a file, with the wall time and the user and
+ * system time of the shell and its commands (wait4(2)). None of the
+ * workloads prints anything, so a run in which the shell writes to stdout
+ * or stderr (a syntax error, a command not found) fails. A 24 hour soak is
+ * -d 86400.
+ *
+ * Usage: bench/suite [-n COMMANDS] [-a ARGS] [-d SECONDS] [-w WORKLOAD]
+ *                    [-l LABEL] [-o FILE] [-s SHELL]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/* most RSS samples kept by the soak */
+#define SUITE_SAMPLES 100000
+
+struct shell {
+	const char *name;   /* in the results */
+	const char *argv[3];   /* the script path is appended */
+};
+
+struct result {
+	double wall_s;
+	double user_s;
+	double sys_s;
+	long maxrss_kb;
+	int status;
+};
+
+static int ncmds = 100000, nargs = 1000, soak_s = 30;
+static char tmpdir[] = "/tmp/suite.XXXXXX";
+static FILE *out;
+static int nresults;
+
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns 1 if program name is found in PATH. */
+static int in_path(const char *name)
+{
+	char *path, *dir, *save, file[4096];
+	int found = 0;
+
+	path = getenv("PATH");
+	if (path == NULL || (path = strdup(path)) == NULL)
+		return 0;
+	for (dir = strtok_r(path, ":", &save); dir != NULL && !found;
+	     dir = strtok_r(NULL, ":", &save)) {
+		snprintf(file, sizeof(file), "%s/%s", dir, name);
+		found = (access(file, X_OK) == 0);
+	}
+	free(path);
+
+	return found;
+}
+
+/* Writes the script of workload work into file path. Returns the number of
+ * commands or -1 on error. */
+static long script(const char *work, const char *path)
+{
+	FILE *f;
+	long i, j, n = 0;
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (strcmp(work, "true") == 0) {
+		for (i = 0; i < ncmds; i++, n++)
+			fputs("/bin/true\n", f);
+	} else if (strcmp(work, "jobs") == 0) {
+		for (i = 0; i < ncmds / 10; i++, n++)
+			fputs("/bin/true &\n", f);
+		fputs("wait\n", f);
+		n++;
+	} else if (strcmp(work, "redir") == 0) {
+		for (i = 0; i < ncmds / 4; i++, n += 4)
+			fprintf(f, "echo %ld >%s/r\necho x >%s/r2\n"
+			        "/bin/cat <%s/r >/dev/null\ntrue <%s/r\n",
+			        i, tmpdir, tmpdir, tmpdir, tmpdir);
+	} else if (strcmp(work, "args") == 0) {
+		for (i = 0; i < ncmds / 100; i++, n++) {
+			fputs(i % 2 ? "echo" : "/bin/true", f);
+			for (j = 0; j < nargs; j++)
+				fprintf(f, " arg%ld", j);
+			fputs(i % 2 ? " >/dev/null\n" : "\n", f);
+		}
+	}
+	if (fclose(f) == EOF) {
+		perror(path);
+		return -1;
+	}
+
+	return n;
+}
+
+/* Starts shell sh on script path (NULL for stdin) with stdin in (-1 for
+ * /dev/null), its stdout and stderr go to file log. Returns the pid or -1
+ * on error. */
+static pid_t start(const struct shell *sh, const char *path, int in,
+                   const char *log)
+{
+	const char *argv[4];
+	pid_t pid;
+	int i, devnull, fd;
+
+	for (i = 0; sh->argv[i] != NULL; i++)
+		argv[i] = sh->argv[i];
+	argv[i++] = path;
+	argv[i] = NULL;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		devnull = open("/dev/null", O_RDWR);
+		fd = open(log, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd == -1)
+			_exit(127);
+		dup2(in != -1 ? in : devnull, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (in != -1)
+			close(in);
+		close(devnull);
+		close(fd);
+		execvp(argv[0], (char **)argv);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+/* Reaps pid into r, the wall time is counted from t0. */
+static void reap(pid_t pid, double t0, struct result *r)
+{
+	struct rusage ru;
+	pid_t w;
+
+	do {
+		w = wait4(pid, &r->status, 0, &ru);
+	} while (w == -1 && errno == EINTR);
+	r->wall_s = now_s() - t0;
+	if (w == -1) {
+		perror("wait4");
+		r->status = -1;
+		return;
+	}
+	r->user_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	r->sys_s = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	r->maxrss_kb = ru.ru_maxrss;
+	r->status = WIFEXITED(r->status) ? WEXITSTATUS(r->status) :
+	            128 + WTERMSIG(r->status);
+}
+
+/* Fails result r of shell and work if the shell wrote to file log: the
+ * first line is reported and the status set to -1. */
+static void check_log(const char *log, const char *shell, const char *work,
+                      struct result *r)
+{
+	char line[256];
+	FILE *f;
+
+	f = fopen(log, "r");
+	if (f == NULL) {
+		perror(log);
+		r->status = -1;
+		return;
+	}
+	if (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		fprintf(stderr, "%s %s: printed: %s\n", shell, work, line);
+		r->status = -1;
+	}
+	fclose(f);
+	unlink(log);
+}
+
+/* Returns the resident set of process pid in kB, -1 if it is gone. */
+static long rss_kb(pid_t pid)
+{
+	char path[64], line[256];
+	long kb = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	fclose(f);
+
+	return kb;
+}
+
+/* Prints the common members of a result and the table row. */
+static void result(const char *shell, const char *work, long n,
+                   const struct result *r)
+{
+	fprintf(out, "%s\n    {\"shell\": \"%s\", \"workload\": \"%s\", "
+	        "\"commands\": %ld, \"status\": %d, \"wall_s\": %.6f, "
+	        "\"per_command_us\": %.3f, \"user_s\": %.6f, \"sys_s\": %.6f, "
+	        "\"maxrss_kb\": %ld", nresults++ ? "," : "", shell, work, n,
+	        r->status, r->wall_s, n > 0 ? r->wall_s * 1e6 / n : 0.0,
+	        r->user_s, r->sys_s, r->maxrss_kb);
+	fprintf(stderr, "%-14s %-6s %8ld %10.3f %10.2f %9.3f %9.3f %9ld %4d",
+	        shell, work, n, r->wall_s, n > 0 ? r->wall_s * 1e6 / n : 0.0,
+	        r->user_s, r->sys_s, r->maxrss_kb, r->status);
+}
+
+/* Runs workload work through shell sh. */
+static int run(const struct shell *sh, const char *work)
+{
+	char path[64], log[64];
+	struct result r;
+	double t0;
+	pid_t pid;
+	long n;
+
+	snprintf(path, sizeof(path), "%s/%s.sh", tmpdir, work);
+	snprintf(log, sizeof(log), "%s/log", tmpdir);
+	n = script(work, path);
+	if (n == -1)
+		return -1;
+	memset(&r, 0, sizeof(r));
+	t0 = now_s();
+	pid = start(sh, path, -1, log);
+	if (pid == -1)
+		return -1;
+	reap(pid, t0, &r);
+	check_log(log, sh->name, work, &r);
+	result(sh->name, work, n, &r);
+	fprintf(out, "}");
+	fprintf(stderr, "\n");
+
+	return r.status == 0 ? 0 : -1;
+}
+
+/* lines piped to the shell by the soak, over and over */
+static const char soak_cycle[] =
+	"/bin/true\n"
+	"echo soak >/dev/null\n"
+	"/bin/true a b c d e f g h </dev/null >/dev/null\n"
+	"/bin/true &\n"
+	"/bin/true &\n"
+	"wait\n";
+
+struct soak_feed {
+	int fd;
+	double end;
+	long cycles;
+};
+
+/* Writes soak cycles into the shell's stdin until the end, then closes
+ * it. */
+static void *soak_feeder(void *arg)
+{
+	struct soak_feed *fe = arg;
+
+	while (now_s() < fe->end) {
+		if (write(fe->fd, soak_cycle, sizeof(soak_cycle) - 1) == -1)
+			break;
+		fe->cycles++;
+	}
+	close(fe->fd);
+
+	return NULL;
+}
+
+/* Runs the soak through shell sh. */
+static int soak(const struct shell *sh)
+{
+	static double t[SUITE_SAMPLES], kb[SUITE_SAMPLES];
+	struct timespec second = { 1, 0 };
+	struct soak_feed fe;
+	struct result r;
+	char log[64];
+	pthread_t th;
+	double t0, mt = 0, mk = 0, sxy = 0, sxx = 0, slope;
+	long rss, first = -1, last = -1, max = 0;
+	int in[2], i, ns = 0, skip, lines = 0;
+	pid_t pid;
+
+	/* close-on-exec, the shell must not hold the write end open */
+	if (pipe2(in, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		return -1;
+	}
+	snprintf(log, sizeof(log), "%s/log", tmpdir);
+	memset(&r, 0, sizeof(r));
+	t0 = now_s();
+	pid = start(sh, NULL, in[0], log);
+	close(in[0]);
+	if (pid == -1) {
+		close(in[1]);
+		return -1;
+	}
+	fe.fd = in[1];
+	fe.end = t0 + soak_s;
+	fe.cycles = 0;
+	if (pthread_create(&th, NULL, soak_feeder, &fe) != 0) {
+		fprintf(stderr, "soak: cannot create the feeder\n");
+		close(in[1]);
+		kill(pid, SIGKILL);
+		reap(pid, t0, &r);
+		return -1;
+	}
+	while (now_s() < fe.end) {
+		nanosleep(&second, NULL);
+		rss = rss_kb(pid);
+		if (rss == -1)
+			break;
+		if (first == -1)
+			first = rss;
+		last = rss;
+		if (rss > max)
+			max = rss;
+		if (ns < SUITE_SAMPLES) {
+			t[ns] = now_s() - t0;
+			kb[ns++] = rss;
+		}
+	}
+	pthread_join(th, NULL);
+	reap(pid, t0, &r);
+	check_log(log, sh->name, "soak", &r);
+
+	/* least squares slope of the samples after the warm up */
+	skip = ns / 10;
+	for (i = skip; i < ns; i++) {
+		mt += t[i];
+		mk += kb[i];
+	}
+	if (ns - skip > 0) {
+		mt /= ns - skip;
+		mk /= ns - skip;
+	}
+	for (i = skip; i < ns; i++) {
+		sxy += (t[i] - mt) * (kb[i] - mk);
+		sxx += (t[i] - mt) * (t[i] - mt);
+	}
+	slope = sxx > 0 ? sxy / sxx * 3600 : 0;
+	for (i = 0; soak_cycle[i] != '\0'; i++)
+		lines += (soak_cycle[i] == '\n');
+
+	result(sh->name, "soak", fe.cycles * lines, &r);
+	fprintf(out, ", \"seconds\": %d, \"samples\": %d, \"rss_first_kb\": "
+	        "%ld, \"rss_last_kb\": %ld, \"rss_max_kb\": %ld, "
+	        "\"rss_growth_kb_per_hour\": %.1f}", soak_s, ns, first, last,
+	        max, slope);
+	fprintf(stderr, "  rss %ld..%ld kB, %+.1f kB/h\n", first, last, slope);
+
+	return r.status == 0 ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n COMMANDS] [-a ARGS] [-d SECONDS] "
+	        "[-w WORKLOAD] [-l LABEL] [-o FILE] [-s SHELL]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *works[] = {
+		"true", "jobs", "redir", "args", "soak", NULL
+	};
+	struct shell shells[] = {
+		{ "shell", { "./shell", NULL } },
+		{ "dash", { "dash", NULL } },
+		{ "bash", { "bash", "--norc", NULL } },
+		{ "busybox-ash", { "busybox", "ash", NULL } },
+	};
+	const char *label = "", *only = NULL, *file = NULL;
+	char path[64];
+	int opt, i, j, rv = 0;
+
+	while ((opt = getopt(argc, argv, "n:a:d:w:l:o:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				ncmds = atoi(optarg);
+				break;
+			case 'a':
+				nargs = atoi(optarg);
+				break;
+			case 'd':
+				soak_s = atoi(optarg);
+				break;
+			case 'w':
+				only = optarg;
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			case 'o':
+				file = optarg;
+				break;
+			case 's':
+				shells[0].argv[0] = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (ncmds <= 0 || nargs < 0 || soak_s <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	out = stdout;
+	if (file != NULL && (out = fopen(file, "w")) == NULL) {
+		perror(file);
+		return 1;
+	}
+	if (mkdtemp(tmpdir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(out, "{\"suite\": \"shell\", \"label\": \"%s\", \"time\": %ld, "
+	        "\"commands\": %d, \"args\": %d, \"soak_seconds\": %d, "
+	        "\"results\": [", label, (long)time(NULL), ncmds, nargs, soak_s);
+	fprintf(stderr, "%-14s %-6s %8s %10s %10s %9s %9s %9s %4s\n", "shell",
+	        "work", "commands", "wall_s", "us/cmd", "user_s", "sys_s",
+	        "maxrss_kb", "exit");
+	for (i = 0; i < (int)(sizeof(shells) / sizeof(shells[0])); i++) {
+		if (i > 0 && !in_path(shells[i].argv[0]))
+			continue;
+		for (j = 0; works[j] != NULL; j++) {
+			if (only != NULL && strcmp(only, works[j]) != 0)
+				continue;
+			if (strcmp(works[j], "soak") == 0 ? soak(&shells[i]) :
+			    run(&shells[i], works[j]))
+				rv = 1;
+			fflush(out);
+		}
+	}
+	fprintf(out, "\n]}\n");
+	if (out != stdout && fclose(out) == EOF) {
+		perror(file);
+		rv = 1;
+	}
+
+	for (j = 0; works[j] != NULL; j++) {
+		snprintf(path, sizeof(path), "%s/%s.sh", tmpdir, works[j]);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/r", tmpdir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/r2", tmpdir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/log", tmpdir);
+	unlink(path);
+	rmdir(tmpdir);
+
+	return rv;
+}
@@ -0,0 +1,304 @@
+/* sysc.c - Mini POSIX Shell system call count benchmark
+ *
+ * Counts the system calls made by the shell itself (all of its threads,
+ * not the spawned commands) with ptrace(2) for every main loop of the shell
+ * (-e threads|epoll|uring) and four workloads piped to its stdin:
+ *   builtin - "pipesize" lines (no fork),
+ *   spawn   - "/bin/true" lines,
+ *   redir   - "/bin/true </dev/null >/dev/null" lines,
+ *   script  - a mix of echo, test, [, printf, pwd, true, false (built-in
+ *             utilities) and cat lines.
+ * Every workload is run with 0 and N repetitions, the difference divided by
+ * the number of lines is the cost of one command; the processes spawned
+ * (fork, vfork, clone, clone3) and the most frequent system calls are
+ * listed.
+ *
+ * Usage: bench/sysc [-n COMMANDS] [-s SHELL]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <linux/ptrace.h>
+
+/* system call numbers counted */
+#define SYSC_MAX 1024
+/* most frequent system calls printed */
+#define SYSC_TOP 6
+
+struct sysc_name {
+	int nr;
+	const char *name;
+};
+
+/* names of the system calls a shell makes most often */
+static const struct sysc_name names[] = {
+#define N(c) { SYS_##c, #c }
+	N(read), N(write), N(openat), N(close), N(fcntl), N(pipe2), N(dup3),
+	N(wait4), N(waitid), N(clone), N(clone3), N(execve), N(kill),
+	N(futex), N(ppoll), N(pidfd_open), N(epoll_ctl), N(epoll_pwait),
+	N(rt_sigprocmask), N(rt_sigtimedwait), N(rt_sigaction), N(mmap),
+	N(munmap), N(mprotect), N(brk), N(newfstatat), N(faccessat),
+	N(io_uring_enter), N(setpgid), N(getpid), N(gettid), N(tgkill),
+	N(getrusage), N(clock_gettime), N(ioctl), N(inotify_add_watch),
+#ifdef SYS_epoll_wait
+	N(epoll_wait),
+#endif
+#ifdef SYS_poll
+	N(poll),
+#endif
+#ifdef SYS_dup2
+	N(dup2),
+#endif
+#ifdef SYS_open
+	N(open),
+#endif
+#ifdef SYS_vfork
+	N(vfork),
+#endif
+#undef N
+	{ -1, NULL }
+};
+
+static const char *sysc_name(int nr)
+{
+	static char buf[16];
+	int i;
+
+	for (i = 0; names[i].name != NULL; i++)
+		if (names[i].nr == nr)
+			return names[i].name;
+	snprintf(buf, sizeof(buf), "#%d", nr);
+
+	return buf;
+}
+
+struct feed {
+	int fd;
+	int n;
+	const char *cmd;
+};
+
+/* Writes the workload into the shell's stdin and closes it. */
+static void *feeder(void *arg)
+{
+	struct feed *fe = arg;
+	size_t len = strlen(fe->cmd);
+	int i;
+
+	for (i = 0; i < fe->n; i++)
+		if (write(fe->fd, fe->cmd, len) == -1)
+			break;
+	close(fe->fd);
+
+	return NULL;
+}
+
+/* Runs shell in mode with n lines cmd on stdin and adds the system calls
+ * of the shell to counts. Returns the total count or -1 on error. */
+static long trace(const char *shell, const char *mode, const char *cmd,
+                  int n, long *counts)
+{
+	struct ptrace_syscall_info info;
+	struct feed fe;
+	pthread_t th;
+	pid_t sh, pid;
+	long total = 0;
+	int in[2], st, sig, devnull, ahead;
+
+	if (pipe(in) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	sh = fork();
+	if (sh == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (sh == 0) {
+		devnull = open("/dev/null", O_WRONLY);
+		dup2(in[0], STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(devnull);
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		raise(SIGSTOP);
+		execl(shell, shell, "-e", mode, (char *)NULL);
+		perror(shell);
+		_exit(127);
+	}
+	close(in[0]);
+	/* the whole workload is written before the shell runs if it fits,
+	 * so the counts do not depend on how the reads interleave */
+	ahead = fcntl(in[1], F_SETPIPE_SZ, strlen(cmd) * n) >=
+	        (long)(strlen(cmd) * n);
+	fe.fd = in[1];
+	fe.n = n;
+	fe.cmd = cmd;
+	pthread_create(&th, NULL, feeder, &fe);
+	if (ahead)
+		pthread_join(th, NULL);
+	if (waitpid(sh, &st, 0) == -1 || !WIFSTOPPED(st)) {
+		fprintf(stderr, "%s: not stopped\n", shell);
+		return -1;
+	}
+	/* the threads of the shell are traced, the commands are not (no
+	 * PTRACE_O_TRACEFORK nor PTRACE_O_TRACEVFORK) */
+	ptrace(PTRACE_SETOPTIONS, sh, NULL, (void *)(long)(PTRACE_O_TRACESYSGOOD|
+	       PTRACE_O_TRACECLONE|PTRACE_O_TRACEEXEC|PTRACE_O_EXITKILL));
+	ptrace(PTRACE_SYSCALL, sh, NULL, NULL);
+
+	for (;;) {
+		pid = waitpid(-1, &st, __WALL);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			break;   /* ECHILD: the shell is gone */
+		}
+		if (WIFEXITED(st) || WIFSIGNALED(st))
+			continue;
+		sig = 0;
+		if (WSTOPSIG(st) == (SIGTRAP|0x80)) {
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, pid,
+			           (void *)sizeof(info), &info) > 0 &&
+			    info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				/* execve of the shell itself is not counted */
+				if (total > 0 || info.entry.nr != SYS_execve) {
+					if (info.entry.nr < SYSC_MAX)
+						counts[info.entry.nr]++;
+					total++;
+				}
+			}
+		} else if ((st >> 16) == 0 && WSTOPSIG(st) != SIGSTOP &&
+		           WSTOPSIG(st) != SIGTRAP) {
+			/* a signal for the shell (SIGCHLD) */
+			sig = WSTOPSIG(st);
+		}
+		ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig);
+	}
+	if (!ahead)
+		pthread_join(th, NULL);
+
+	return total;
+}
+
+static long base[SYSC_MAX], counts[SYSC_MAX];
+
+/* system calls creating a process (or a thread of the shell, those are
+ * in the base count) */
+static const int spawn_nrs[] = {
+	SYS_clone, SYS_clone3,
+#ifdef SYS_fork
+	SYS_fork,
+#endif
+#ifdef SYS_vfork
+	SYS_vfork,
+#endif
+	-1
+};
+
+/* orders system call numbers by their counts, most frequent first */
+static int cmp_count(const void *a, const void *b)
+{
+	long x = counts[*(const int *)a], y = counts[*(const int *)b];
+
+	return (x < y) - (x > y);
+}
+
+/* Prints the per command system calls of one workload, cmd is repeated n
+ * times. */
+static int run(const char *shell, const char *mode, const char *work,
+               const char *cmd, int n)
+{
+	static int top[SYSC_MAX];
+	long b, t, spawns = 0;
+	const char *c;
+	int i, j, ntop = 0, lines = 0;
+
+	memset(base, 0, sizeof(base));
+	memset(counts, 0, sizeof(counts));
+	b = trace(shell, mode, cmd, 0, base);
+	t = trace(shell, mode, cmd, n, counts);
+	if (b == -1 || t == -1)
+		return -1;
+
+	for (i = 0; i < SYSC_MAX; i++) {
+		counts[i] -= base[i];
+		if (counts[i] > 0)
+			top[ntop++] = i;
+	}
+	qsort(top, ntop, sizeof(int), cmp_count);
+	for (i = 0; spawn_nrs[i] != -1; i++)
+		spawns += counts[spawn_nrs[i]];
+	for (c = cmd; *c != '\0'; c++)
+		lines += (*c == '\n');
+	n *= lines;
+
+	printf("%-8s %-8s %9.2f %7.2f  ", mode, work, (double)(t - b) / n,
+	       (double)spawns / n);
+	for (j = 0; j < ntop && j < SYSC_TOP; j++)
+		printf(" %s:%.2f", sysc_name(top[j]), (double)counts[top[j]] / n);
+	printf("\n");
+	fflush(stdout);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *modes[] = { "threads", "epoll", "uring", NULL };
+	static const char *works[][2] = {
+		{ "builtin", "pipesize\n" },
+		{ "spawn", "/bin/true\n" },
+		{ "redir", "/bin/true </dev/null >/dev/null\n" },
+		{ "script", "echo x\ntest -d /\n[ -f /etc/passwd ]\n"
+		            "printf '%s\\n' x >/dev/null\npwd\ntrue\nfalse\n"
+		            "cat /dev/null\n" },
+		{ NULL, NULL }
+	};
+	char *shell = "./shell";
+	int n = 2000, opt, i, j, rv = 0;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 's':
+				shell = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n COMMANDS] "
+				        "[-s SHELL]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (n <= 0) {
+		fprintf(stderr, "%s: invalid number of commands\n", argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-8s %-8s %9s %7s   %s\n", "loop", "work", "sys/cmd",
+	       "fork/cmd", "most frequent per command");
+	for (j = 0; works[j][0] != NULL; j++)
+		for (i = 0; modes[i] != NULL; i++)
+			if (run(shell, modes[i], works[j][0], works[j][1], n)
+			    == -1)
+				rv = 1;
+
+	return rv;
+}
@@ -0,0 +1,699 @@
+/* builtins.h - Mini POSIX Shell
+ *
+ * Built-in command registry and the utilities run inside the shell process
+ * instead of spawning a file: echo, true, false, test/[, pwd, printf and
+ * kill. Like the other built-in commands they take their arguments from
+ * the global args and write to builtin_out, redirections are applied
+ * around them by the shell (see run_builtin() in shell.c).
+ *
+ * The registry is a table indexed by a perfect hash of the first two bytes
+ * and the length of the name, computed by the compiler from the BUILTINS()
+ * list in shell.c; a collision of two names fails the build.
+ *
+ */
+
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "shell.h"
+
+/* slots of the built-in table, a power of two */
+#define BUILTIN_SLOTS 64
+/* slot of a name with first bytes c0, c1 ('\0' for one byte names) and
+ * length len, the multipliers make the names in BUILTINS() distinct */
+#define BUILTIN_SLOT(c0, c1, len) \
+	(((c0) + ((c1) << 1) + ((len) << 2)) & (BUILTIN_SLOTS - 1))
+
+/* built-in flags */
+#define BUILTIN_UTIL      1   /* a utility also found in PATH, run as a
+                                 job when started in background */
+#define BUILTIN_OWN_REDIR 2   /* handles its redirections itself */
+#define BUILTIN_PREFIX    4   /* a prefix of the command which follows,
+                                 see run_command() */
+#define BUILTIN_SYNC      8   /* depends on the background jobs being
+                                 spawned, see spawner.h */
+
+/* returned by a built-in instead of an exit status: the shell exits */
+#define BUILTIN_EXIT (-1)
+
+struct builtin {
+	const char *name;
+	int (*run)(void);   /* returns the exit status or BUILTIN_EXIT */
+	int flags;
+};
+
+/* stream the built-in commands write to, on a copy of stdout which a >FILE
+ * redirection replaces; the stdout of the shell itself is never replaced,
+ * so the job notices and prompts of the signal thread do not end up in the
+ * file */
+static FILE *builtin_out;
+static int builtin_fd = -1;   /* descriptor of builtin_out, -1 if stdout */
+
+
+/* Flushes the output of built-in name. Returns 0, or 1 if the output could
+ * not be written. */
+static int builtin_flush(const char *name)
+{
+	if (fflush(builtin_out) == 0)
+		return 0;
+	fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+	clearerr(builtin_out);
+
+	return 1;
+}
+
+/* Opens builtin_out on a copy of stdout. Returns 0, or -1 on error
+ * (reported, built-in commands then write to stdout and can't be
+ * redirected). */
+int builtin_init(void)
+{
+	builtin_out = stdout;
+	builtin_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+	if (builtin_fd != -1 &&
+	    (builtin_out = fdopen(builtin_fd, "w")) == NULL) {
+		close(builtin_fd);
+		builtin_fd = -1;
+		builtin_out = stdout;
+	}
+	if (builtin_fd == -1) {
+		perror("builtin output");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* true - does nothing, successfully. */
+int true_cmd(void)
+{
+	return 0;
+}
+
+/* false - does nothing, unsuccessfully. */
+int false_cmd(void)
+{
+	return 1;
+}
+
+/* echo [-n] [ARG...] - writes the arguments separated by spaces, followed
+ * by a newline unless -n is given. */
+int echo_cmd(void)
+{
+	int i = 1, nl = 1;
+
+	if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+		nl = 0;
+		i++;
+	}
+	for (; args[i] != NULL; i++) {
+		fputs(args[i], builtin_out);
+		if (args[i + 1] != NULL)
+			putc(' ', builtin_out);
+	}
+	if (nl)
+		putc('\n', builtin_out);
+
+	return builtin_flush("echo");
+}
+
+/* pwd - writes the current working directory. */
+int pwd_cmd(void)
+{
+	char cwd[PATH_MAX];
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		fprintf(stderr, "pwd: %s\n", strerror(errno));
+		return 1;
+	}
+	fprintf(builtin_out, "%s\n", cwd);
+
+	return builtin_flush("pwd");
+}
+
+/* Parses integer operand s of test into n. Returns 0, or -1 (reported) if
+ * s is not an integer. */
+static int test_int(const char *s, long long *n)
+{
+	char *end;
+
+	errno = 0;
+	*n = strtoll(s, &end, 10);
+	if (end == s || *end != '\0' || errno != 0) {
+		fprintf(stderr, "test: %s: integer expression expected\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns 1 if s is a unary operator of test. */
+static int test_unary(const char *s)
+{
+	return s[0] == '-' && s[1] != '\0' && s[2] == '\0' &&
+	       strchr("bcdefghLnprSstuwxz", s[1]) != NULL;
+}
+
+/* Returns 1 if s is a binary operator of test. */
+static int test_binary(const char *s)
+{
+	static const char *ops[] = { "=", "!=", "-eq", "-ne", "-lt", "-le",
+	                             "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+	int i;
+
+	for (i = 0; ops[i] != NULL; i++)
+		if (strcmp(s, ops[i]) == 0)
+			return 1;
+
+	return 0;
+}
+
+/* Evaluates unary primary op with operand s. */
+static int test_file(char op, const char *s)
+{
+	struct stat st;
+
+	switch (op) {
+		case 'n':
+			return s[0] != '\0';
+		case 'z':
+			return s[0] == '\0';
+		case 't':
+			return isatty(atoi(s));
+		case 'r':
+			return access(s, R_OK) == 0;
+		case 'w':
+			return access(s, W_OK) == 0;
+		case 'x':
+			return access(s, X_OK) == 0;
+		case 'h':
+		case 'L':
+			return lstat(s, &st) == 0 && S_ISLNK(st.st_mode);
+		default:
+			break;
+	}
+	if (stat(s, &st) == -1)
+		return 0;
+	switch (op) {
+		case 'b':
+			return S_ISBLK(st.st_mode);
+		case 'c':
+			return S_ISCHR(st.st_mode);
+		case 'd':
+			return S_ISDIR(st.st_mode);
+		case 'f':
+			return S_ISREG(st.st_mode);
+		case 'g':
+			return (st.st_mode & S_ISGID) != 0;
+		case 'p':
+			return S_ISFIFO(st.st_mode);
+		case 'S':
+			return S_ISSOCK(st.st_mode);
+		case 's':
+			return st.st_size > 0;
+		case 'u':
+			return (st.st_mode & S_ISUID) != 0;
+		default:   /* 'e' */
+			return 1;
+	}
+}
+
+/* Evaluates binary primary a op b. Returns 0 or 1, -1 on error. */
+static int test_compare(const char *a, const char *op, const char *b)
+{
+	struct stat sa, sb;
+	long long x, y;
+
+	if (strcmp(op, "=") == 0)
+		return strcmp(a, b) == 0;
+	if (strcmp(op, "!=") == 0)
+		return strcmp(a, b) != 0;
+	if (op[1] == 'n' && op[2] == 't')
+		return stat(a, &sa) == 0 && (stat(b, &sb) == -1 ||
+		       sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+		       (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec &&
+		        sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+	if (op[1] == 'o' && op[2] == 't')
+		return test_compare(b, "-nt", a);
+	if (op[1] == 'e' && op[2] == 'f')
+		return stat(a, &sa) == 0 && stat(b, &sb) == 0 &&
+		       sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+
+	if (test_int(a, &x) == -1 || test_int(b, &y) == -1)
+		return -1;
+	if (strcmp(op, "-eq") == 0)
+		return x == y;
+	if (strcmp(op, "-ne") == 0)
+		return x != y;
+	if (strcmp(op, "-lt") == 0)
+		return x < y;
+	if (strcmp(op, "-le") == 0)
+		return x <= y;
+	if (strcmp(op, "-gt") == 0)
+		return x > y;
+	return x >= y;   /* -ge */
+}
+
+static int test_or(char **av, int *i, int n);
+
+/* primary: '(' expr ')' | UNARY ARG | ARG BINARY ARG | ARG */
+static int test_primary(char **av, int *i, int n)
+{
+	int r;
+
+	if (*i >= n) {
+		fprintf(stderr, "test: argument expected\n");
+		return -1;
+	}
+	/* a binary operator wins over everything else (test -n = -n) */
+	if (*i + 2 < n && test_binary(av[*i + 1])) {
+		r = test_compare(av[*i], av[*i + 1], av[*i + 2]);
+		*i += 3;
+		return r;
+	}
+	if (strcmp(av[*i], "(") == 0 && *i + 1 < n) {
+		(*i)++;
+		r = test_or(av, i, n);
+		if (r == -1)
+			return -1;
+		if (*i >= n || strcmp(av[*i], ")") != 0) {
+			fprintf(stderr, "test: ')' expected\n");
+			return -1;
+		}
+		(*i)++;
+		return r;
+	}
+	if (test_unary(av[*i]) && *i + 1 < n) {
+		r = test_file(av[*i][1], av[*i + 1]);
+		*i += 2;
+		return r;
+	}
+	/* a lone string is true if not empty */
+	return av[(*i)++][0] != '\0';
+}
+
+/* not: '!' not | primary */
+static int test_not(char **av, int *i, int n)
+{
+	int r;
+
+	if (*i + 1 < n && strcmp(av[*i], "!") == 0) {
+		(*i)++;
+		r = test_not(av, i, n);
+		return (r == -1) ? -1 : !r;
+	}
+
+	return test_primary(av, i, n);
+}
+
+/* and: not ('-a' not)* */
+static int test_and(char **av, int *i, int n)
+{
+	int r, s;
+
+	r = test_not(av, i, n);
+	while (r != -1 && *i < n && strcmp(av[*i], "-a") == 0) {
+		(*i)++;
+		s = test_not(av, i, n);
+		r = (s == -1) ? -1 : (r && s);
+	}
+
+	return r;
+}
+
+/* or: and ('-o' and)* */
+static int test_or(char **av, int *i, int n)
+{
+	int r, s;
+
+	r = test_and(av, i, n);
+	while (r != -1 && *i < n && strcmp(av[*i], "-o") == 0) {
+		(*i)++;
+		s = test_and(av, i, n);
+		r = (s == -1) ? -1 : (r || s);
+	}
+
+	return r;
+}
+
+/* test EXPRESSION, [ EXPRESSION ] - evaluates the expression. Returns 0 if
+ * it is true, 1 if false, 2 on error. */
+int test_cmd(void)
+{
+	int n = argsc - 2, i = 0, r;
+
+	if (strcmp(args[0], "[") == 0) {
+		if (n == 0 || strcmp(args[n], "]") != 0) {
+			fprintf(stderr, "[: missing ']'\n");
+			return 2;
+		}
+		n--;
+	}
+	if (n == 0)
+		return 1;
+
+	r = test_or(args + 1, &i, n);
+	if (r != -1 && i < n) {
+		fprintf(stderr, "%s: %s: unexpected argument\n", args[0],
+		        args[i + 1]);
+		r = -1;
+	}
+
+	return (r == -1) ? 2 : !r;
+}
+
+/* Decodes the escape sequence after the '\' at s (octal \NNN, \0NNN if
+ * zero is set as in %b) into c. Returns the number of bytes consumed after
+ * the '\', 0 for an unknown sequence. */
+static int printf_escape(const char *s, char *c, int zero)
+{
+	static const char esc[] = "\\\\a\ab\bf\fn\nr\rt\tv\v\"\"''";
+	const char *e;
+	int i = 0, v = 0, max = 3;
+
+	if (*s == '\0')
+		return 0;
+	for (e = esc; *e != '\0'; e += 2) {
+		if (*e == *s) {
+			*c = e[1];
+			return 1;
+		}
+	}
+	if (zero && *s == '0') {
+		i = 1;
+		max = 4;
+	}
+	for (; i < max && s[i] >= '0' && s[i] <= '7'; i++)
+		v = v * 8 + (s[i] - '0');
+	*c = v;
+
+	return i;
+}
+
+/* Writes arg with the escapes of %b expanded. Returns 1 if \c was found
+ * (no further output), otherwise 0. */
+static int printf_b(const char *arg)
+{
+	int k;
+	char c;
+
+	for (; *arg != '\0'; arg++) {
+		if (*arg != '\\') {
+			putc(*arg, builtin_out);
+			continue;
+		}
+		if (arg[1] == 'c')
+			return 1;
+		k = printf_escape(arg + 1, &c, 1);
+		if (k == 0) {
+			putc('\\', builtin_out);
+			continue;
+		}
+		putc(c, builtin_out);
+		arg += k;
+	}
+
+	return 0;
+}
+
+/* Converts numeric argument s of printf ('c is the code of c). Sets *rv
+ * to 1 and reports invalid numbers. */
+static long long printf_num(const char *s, int sign, int *rv)
+{
+	long long n;
+	char *end;
+
+	if (s[0] == '\'' || s[0] == '"')
+		return (unsigned char)s[1];
+	errno = 0;
+	n = sign ? strtoll(s, &end, 0) : (long long)strtoull(s, &end, 0);
+	if (end == s || *end != '\0' || errno != 0) {
+		fprintf(stderr, "printf: %s: invalid number\n", s);
+		*rv = 1;
+	}
+
+	return n;
+}
+
+/* Writes one pass of format fmt taking the arguments from *ap. Returns
+ * the number of arguments used, -1 if the output should stop (\c or an
+ * invalid conversion, *rv is set). */
+static int printf_pass(const char *fmt, char ***ap, int *rv)
+{
+	char spec[64], *arg;
+	const char *p, *start;
+	int used = 0, k;
+	size_t len;
+	char c;
+
+	for (p = fmt; *p != '\0'; p++) {
+		if (*p == '\\') {
+			k = printf_escape(p + 1, &c, 0);
+			if (k == 0) {
+				putc('\\', builtin_out);
+				continue;
+			}
+			putc(c, builtin_out);
+			p += k;
+			continue;
+		}
+		if (*p != '%') {
+			putc(*p, builtin_out);
+			continue;
+		}
+		if (p[1] == '%') {
+			putc('%', builtin_out);
+			p++;
+			continue;
+		}
+
+		/* flags, width and precision are copied into spec for
+		 * printf(3), a '*' is replaced by the value of its argument */
+		start = p++;
+		spec[0] = '%';
+		len = 1;
+		for (; *p != '\0' && strchr("-+ #0123456789.*", *p) != NULL;
+		     p++) {
+			if (len + 16 > sizeof(spec))
+				break;
+			if (*p != '*') {
+				spec[len++] = *p;
+				continue;
+			}
+			arg = (**ap != NULL) ? *(*ap)++ : "0";
+			used++;
+			len += snprintf(spec + len, sizeof(spec) - len, "%d",
+			                (int)printf_num(arg, 1, rv));
+		}
+		if (*p == '\0' || len + 16 > sizeof(spec) ||
+		    strchr("diouxXcsbeEfFgGaA", *p) == NULL) {
+			fprintf(stderr, "printf: %.*s: invalid conversion\n",
+			        (int)(p - start + (*p != '\0')), start);
+			*rv = 1;
+			return -1;
+		}
+
+		arg = (**ap != NULL) ? *(*ap)++ : NULL;
+		if (arg != NULL)
+			used++;
+		switch (*p) {
+			case 'b':
+				if (arg != NULL && printf_b(arg))
+					return -1;
+				break;
+			case 's':
+				spec[len] = 's';
+				spec[len + 1] = '\0';
+				fprintf(builtin_out, spec, arg ? arg : "");
+				break;
+			case 'c':
+				spec[len] = 'c';
+				spec[len + 1] = '\0';
+				fprintf(builtin_out, spec, arg ? arg[0] : '\0');
+				break;
+			case 'd':
+			case 'i':
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				spec[len] = spec[len + 1] = 'l';
+				spec[len + 2] = *p;
+				spec[len + 3] = '\0';
+				fprintf(builtin_out, spec,
+				        printf_num(arg ? arg : "0",
+				                   *p == 'd' || *p == 'i', rv));
+				break;
+			default:   /* floating point */
+				spec[len] = *p;
+				spec[len + 1] = '\0';
+				fprintf(builtin_out, spec,
+				        arg ? strtod(arg, NULL) : 0.0);
+				break;
+		}
+	}
+
+	return used;
+}
+
+/* printf FORMAT [ARG...] - writes the arguments formatted by FORMAT, which
+ * is reused while arguments are left. */
+int printf_cmd(void)
+{
+	char **ap;
+	int rv = 0, used;
+
+	if (args[1] == NULL) {
+		fprintf(stderr, "printf: usage: printf FORMAT [ARG...]\n");
+		return 2;
+	}
+	ap = args + 2;
+	do {
+		used = printf_pass(args[1], &ap, &rv);
+	} while (used > 0 && *ap != NULL);
+
+	if (builtin_flush("printf") != 0)
+		rv = 1;
+
+	return rv;
+}
+
+/* signal names for kill (without the SIG prefix) */
+static const struct {
+	const char *name;
+	int sig;
+} kill_signals[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+	{ "ILL", SIGILL }, { "TRAP", SIGTRAP }, { "ABRT", SIGABRT },
+	{ "BUS", SIGBUS }, { "FPE", SIGFPE }, { "KILL", SIGKILL },
+	{ "USR1", SIGUSR1 }, { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 },
+	{ "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+	{ "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+	{ "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU },
+	{ "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ },
+	{ "VTALRM", SIGVTALRM }, { "PROF", SIGPROF }, { "WINCH", SIGWINCH },
+	{ "IO", SIGIO }, { "SYS", SIGSYS }, { NULL, 0 }
+};
+
+/* Returns the signal number of name (HUP, SIGHUP, hup or 1), or -1. */
+static int kill_signal(const char *name)
+{
+	char *end;
+	long n;
+	int i;
+
+	if (name[0] >= '0' && name[0] <= '9') {
+		n = strtol(name, &end, 10);
+		return (*end == '\0' && n < NSIG) ? (int)n : -1;
+	}
+	if (strncasecmp(name, "SIG", 3) == 0)
+		name += 3;
+	for (i = 0; kill_signals[i].name != NULL; i++)
+		if (strcasecmp(name, kill_signals[i].name) == 0)
+			return kill_signals[i].sig;
+
+	return -1;
+}
+
+/* Writes the signal names, or the name of the signal which terminated a
+ * process with exit status st (kill -l STATUS). Returns 0, 1 on error. */
+static int kill_list(const char *st)
+{
+	int i, sig;
+
+	if (st == NULL) {
+		for (i = 0; kill_signals[i].name != NULL; i++)
+			fprintf(builtin_out, "%s%c", kill_signals[i].name,
+			        kill_signals[i + 1].name != NULL ? ' ' : '\n');
+		return builtin_flush("kill");
+	}
+	sig = atoi(st);
+	if (sig > 128)
+		sig -= 128;
+	for (i = 0; kill_signals[i].name != NULL; i++) {
+		if (kill_signals[i].sig == sig) {
+			fprintf(builtin_out, "%s\n", kill_signals[i].name);
+			return builtin_flush("kill");
+		}
+	}
+	fprintf(stderr, "kill: %s: invalid signal\n", st);
+
+	return 1;
+}
+
+/* kill [-s SIGNAL | -SIGNAL] PID|%N..., kill -l [STATUS] - sends a signal
+ * (TERM by default) to processes or to the process groups of jobs. */
+int kill_cmd(void)
+{
+	char *end;
+	long pid;
+	int i = 1, sig = SIGTERM, rv = 0;
+
+	if (args[1] != NULL && strcmp(args[1], "-l") == 0)
+		return kill_list(args[2]);
+	if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+		if (args[2] == NULL || (sig = kill_signal(args[2])) == -1) {
+			fprintf(stderr, "kill: %s: invalid signal\n",
+			        args[2] ? args[2] : "");
+			return 2;
+		}
+		i = 3;
+	} else if (args[1] != NULL && args[1][0] == '-' &&
+	           strcmp(args[1], "--") != 0) {
+		sig = kill_signal(args[1] + 1);
+		if (sig == -1) {
+			fprintf(stderr, "kill: %s: invalid signal\n", args[1] + 1);
+			return 2;
+		}
+		i = 2;
+	}
+	if (args[i] != NULL && strcmp(args[i], "--") == 0)
+		i++;
+	if (args[i] == NULL) {
+		fprintf(stderr, "kill: usage: kill [-s SIGNAL | -SIGNAL] "
+		        "PID|%%N...\n");
+		return 2;
+	}
+
+	for (; args[i] != NULL; i++) {
+		if (args[i][0] == '%') {
+			pid = strtol(args[i] + 1, &end, 10);
+			if (*end != '\0' || pid <= 0 || pid > INT_MAX ||
+			    (pid = jobs_pgid(&jobs, pid)) == -1) {
+				fprintf(stderr, "kill: %s: no such job\n",
+				        args[i]);
+				rv = 1;
+				continue;
+			}
+			pid = -pid;   /* the whole process group */
+		} else {
+			pid = strtol(args[i], &end, 10);
+			if (*end != '\0' || end == args[i] || pid > INT_MAX ||
+			    pid < INT_MIN) {
+				fprintf(stderr, "kill: %s: arguments must be "
+				        "process or job IDs\n", args[i]);
+				rv = 1;
+				continue;
+			}
+		}
+		if (kill(pid, sig) == -1) {
+			fprintf(stderr, "kill: %s: %s\n", args[i],
+			        strerror(errno));
+			rv = 1;
+		}
+	}
+
+	return rv;
+}
+
+#endif /* BUILTINS_H */
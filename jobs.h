@@ -0,0 +1,593 @@
+/* jobs.h - Mini POSIX Shell
+ *
+ * Table of background jobs. A job is a process group of one or more
+ * processes (stages of a pipeline) and keeps its job number (%N) for its
+ * whole life. Jobs are found by number through an array and by process
+ * group id through a hash table, both in constant time.
+ *
+ * Every process of a job is watched through a pidfd registered in an
+ * epoll instance, the epoll event carries the job number. A SIGCHLD wakeup
+ * drains epoll of all ready pidfds (signals coalesce, so one wakeup may
+ * stand for many exits), so reaping costs O(finished processes) however
+ * many jobs are running, and only job processes are ever waited for (the
+ * exec thread waits for the foreground ones itself). The processes are
+ * reaped without the lock, the statuses are applied to the table in
+ * batches under a single lock acquisition. Processes without a pidfd (old
+ * kernel, descriptors exhausted) are reaped by polling their process
+ * group.
+ *
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+#ifndef P_PIDFD
+#  define P_PIDFD 3
+#endif
+
+/* number of job items allocated at once */
+#define JOBS_SLAB 64
+/* initial sizes of the job number array and of the hash table */
+#define JOBS_TAB 64
+/* ready pidfds taken from epoll at once */
+#define JOBS_EVENTS 64
+/* longest command line kept for a job, a longer one is cut with "..." */
+#define JOBS_CMDLINE 256
+/* bytes of the jobs listing formatted at once */
+#define JOBS_PRINT 4096
+
+struct job_item {
+	int num;       /* job number */
+	int pid;       /* process group id */
+	int last;      /* last stage, its status is the status of the job */
+	int nprocs;    /* processes not reaped yet */
+	int nopidfd;   /* processes are reaped by polling the group */
+	int status;
+	char cmdline[JOBS_CMDLINE];
+	struct job_item *hnext;   /* hash chain */
+	struct job_item *next;    /* finished or free list */
+};
+
+/* job items are allocated in slabs and recycled through a free list */
+struct job_slab {
+	struct job_slab *next;
+	struct job_item items[JOBS_SLAB];
+};
+
+/* reaped process, an entry of a batch applied to the table */
+struct job_exit {
+	int num;
+	pid_t pid;
+	int status;
+};
+
+/* finished job handed out by jobs_reap() */
+struct job_done {
+	int num;
+	int pid;
+	int status;
+	char cmdline[JOBS_CMDLINE];
+};
+
+struct job_list {
+	struct job_item **tab;    /* by job number, NULL if unused */
+	int cap;                  /* size of tab */
+	int top;                  /* highest job number in use, 0 if none */
+	int njobs;
+	struct job_item **hash;   /* by process group id */
+	unsigned nbuckets;
+	int nopidfd;              /* jobs reaped by polling */
+	int epfd;
+	struct job_item *done;    /* finished, not handed out yet */
+	struct job_item *free;
+	struct job_slab *slabs;
+	int intr;                 /* jobs_wait() is interrupted */
+	pthread_mutex_t jmtx;
+	pthread_cond_t jcond;     /* signaled when jobs finish */
+};
+
+
+/* Takes the lock of the job table, a wait for another thread holding it
+ * is traced. */
+static void jobs_lock(struct job_list *list)
+{
+	uint64_t t0;
+
+	if (pthread_mutex_trylock(&(list->jmtx)) == 0)
+		return;
+	t0 = trace_begin();
+	pthread_mutex_lock(&(list->jmtx));
+	trace_end("jobs lock", t0, NULL, 0);
+}
+
+/* Initializes job_list structure and mutexe variable. Returns 0 on success,
+ * error code on error. */
+int jobs_init(struct job_list *list)
+{
+	int rc;
+
+	rc = pthread_mutex_init(&(list->jmtx), NULL);
+	if (rc == 0)
+		rc = pthread_cond_init(&(list->jcond), NULL);
+	if (rc != 0)
+		return rc;
+	list->cap = JOBS_TAB;
+	list->nbuckets = JOBS_TAB;
+	list->tab = calloc(list->cap, sizeof(struct job_item *));
+	list->hash = calloc(list->nbuckets, sizeof(struct job_item *));
+	if (list->tab == NULL || list->hash == NULL)
+		return ENOMEM;
+	list->top = list->njobs = list->nopidfd = list->intr = 0;
+	list->done = NULL;
+	list->free = NULL;
+	list->slabs = NULL;
+	list->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	return (list->epfd == -1) ? errno : 0;
+}
+
+/* Frees the memory occupied by the job_list structure. */
+void jobs_free(struct job_list *list)
+{
+	struct job_slab *slab;
+
+	jobs_lock(list);
+	list->done = NULL;
+	while (list->slabs != NULL) {
+		slab = list->slabs;
+		list->slabs = slab->next;
+		free(slab);
+	}
+	free(list->tab);
+	free(list->hash);
+	list->tab = list->hash = NULL;
+	list->free = NULL;
+	close(list->epfd);
+	pthread_mutex_unlock(&(list->jmtx));
+
+	pthread_mutex_destroy(&(list->jmtx));
+	pthread_cond_destroy(&(list->jcond));
+}
+
+/* Takes a job item from the free list, allocating a new slab of items when
+ * the list is empty. The caller holds jmtx. Returns NULL on error. */
+struct job_item *jobs_alloc(struct job_list *list)
+{
+	struct job_slab *slab;
+	struct job_item *it;
+	int i;
+
+	if (list->free == NULL) {
+		slab = malloc(sizeof(struct job_slab));
+		if (slab == NULL)
+			return NULL;
+		slab->next = list->slabs;
+		list->slabs = slab;
+		for (i = 0; i < JOBS_SLAB; i++) {
+			slab->items[i].next = list->free;
+			list->free = &slab->items[i];
+		}
+	}
+	it = list->free;
+	list->free = it->next;
+
+	return it;
+}
+
+/* Returns a free job number, growing the array if needed. Like in other
+ * shells it is one above the highest number in use; only when the array
+ * is full and has holes the lowest free number is taken. The caller holds
+ * jmtx. Returns -1 if there is not enough memory. */
+static int jobs_number(struct job_list *list)
+{
+	struct job_item **tab;
+	int i;
+
+	if (list->top + 1 < list->cap)
+		return list->top + 1;
+	if (list->njobs < list->cap / 2) {
+		for (i = 1; i < list->cap; i++)
+			if (list->tab[i] == NULL)
+				return i;
+	}
+	tab = realloc(list->tab, 2 * list->cap * sizeof(struct job_item *));
+	if (tab == NULL)
+		return -1;
+	memset(tab + list->cap, 0, list->cap * sizeof(struct job_item *));
+	list->tab = tab;
+	list->cap *= 2;
+
+	return list->top + 1;
+}
+
+/* Doubles the hash table, the caller holds jmtx. */
+static void jobs_rehash(struct job_list *list)
+{
+	struct job_item **hash, *it, *next;
+	unsigned i, n = 2 * list->nbuckets;
+
+	hash = calloc(n, sizeof(struct job_item *));
+	if (hash == NULL)
+		return;   /* longer chains, but still correct */
+	for (i = 0; i < list->nbuckets; i++) {
+		for (it = list->hash[i]; it != NULL; it = next) {
+			next = it->hnext;
+			it->hnext = hash[it->pid & (n - 1)];
+			hash[it->pid & (n - 1)] = it;
+		}
+	}
+	free(list->hash);
+	list->hash = hash;
+	list->nbuckets = n;
+}
+
+/* Copies command line s into the job item it, cut to JOBS_CMDLINE. */
+static void jobs_cmdline(struct job_item *it, const char *s)
+{
+	size_t len = strlen(s);
+
+	if (len < JOBS_CMDLINE) {
+		memcpy(it->cmdline, s, len + 1);
+		return;
+	}
+	memcpy(it->cmdline, s, JOBS_CMDLINE - 4);
+	strcpy(it->cmdline + JOBS_CMDLINE - 4, "...");
+}
+
+/* Inserts job with command line cmdline (copied) into the job_list: the
+ * process group pid of the processes pids (n of them, -1 entries are
+ * skipped), the last of them is the last stage of the pipeline; fds is
+ * room for n pidfds provided by the caller. Returns the job number or -1
+ * on error. */
+int jobs_insert(struct job_list *list, const char *cmdline, int pid,
+                const pid_t *pids, int *fds, int n)
+{
+	struct epoll_event ev;
+	struct job_item *it;
+	int i, num, fd;
+
+	/* pidfds are opened before the lock is taken */
+	for (i = 0; i < n; i++)
+		fds[i] = (pids[i] == -1) ? -1
+		                         : syscall(SYS_pidfd_open, pids[i], 0);
+
+	jobs_lock(list);
+	it = jobs_alloc(list);
+	num = jobs_number(list);
+	if (it == NULL || num == -1) {
+		if (it != NULL) {
+			it->next = list->free;
+			list->free = it;
+		}
+		pthread_mutex_unlock(&(list->jmtx));
+		fprintf(stderr, "Could not allocate memory for job\n");
+		for (i = 0; i < n; i++)
+			if (fds[i] != -1)
+				close(fds[i]);
+		return -1;
+	}
+	jobs_cmdline(it, cmdline);
+	it->num = num;
+	it->pid = pid;
+	it->last = pids[n - 1];
+	it->nprocs = 0;
+	it->nopidfd = 0;
+	it->status = 0;
+
+	for (i = 0; i < n; i++) {
+		if (pids[i] == -1)
+			continue;
+		it->nprocs++;
+		fd = fds[i];
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint64_t)num << 32 | (uint32_t)fd;
+		if (fd == -1 || epoll_ctl(list->epfd, EPOLL_CTL_ADD, fd,
+		                          &ev) == -1)
+			it->nopidfd = 1;
+	}
+	if (it->nopidfd) {
+		/* the whole group is reaped by polling */
+		for (i = 0; i < n; i++) {
+			if (fds[i] == -1)
+				continue;
+			epoll_ctl(list->epfd, EPOLL_CTL_DEL, fds[i], NULL);
+			close(fds[i]);
+		}
+		list->nopidfd++;
+	}
+
+	list->tab[num] = it;
+	if (num > list->top)
+		list->top = num;
+	list->njobs++;
+	if ((unsigned)list->njobs > list->nbuckets)
+		jobs_rehash(list);
+	it->hnext = list->hash[pid & (list->nbuckets - 1)];
+	list->hash[pid & (list->nbuckets - 1)] = it;
+	pthread_mutex_unlock(&(list->jmtx));
+
+	return num;
+}
+
+/* Returns the job number of the job with process group id pid or 0. */
+int jobs_find(struct job_list *list, int pid)
+{
+	struct job_item *it;
+	int num = 0;
+
+	jobs_lock(list);
+	for (it = list->hash[pid & (list->nbuckets - 1)]; it != NULL;
+	     it = it->hnext) {
+		if (it->pid == pid) {
+			num = it->num;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(list->jmtx));
+
+	return num;
+}
+
+/* Returns the process group of job num, or -1 if there is no such job. */
+pid_t jobs_pgid(struct job_list *list, int num)
+{
+	pid_t pgid = -1;
+
+	jobs_lock(list);
+	if (num > 0 && num <= list->top && list->tab[num] != NULL)
+		pgid = list->tab[num]->pid;
+	pthread_mutex_unlock(&(list->jmtx));
+
+	return pgid;
+}
+
+/* Moves the job with all processes reaped from the tables to the list of
+ * finished jobs. The caller holds jmtx. */
+static void jobs_finish(struct job_list *list, struct job_item *it)
+{
+	struct job_item **p;
+
+	for (p = &list->hash[it->pid & (list->nbuckets - 1)]; *p != it;
+	     p = &(*p)->hnext)
+		;
+	*p = it->hnext;
+	list->tab[it->num] = NULL;
+	while (list->top > 0 && list->tab[list->top] == NULL)
+		list->top--;
+	list->njobs--;
+	if (it->nopidfd)
+		list->nopidfd--;
+
+	it->next = list->done;
+	list->done = it;
+}
+
+/* Returns the wait status described by si (as returned by waitid()). */
+static int jobs_wstatus(const siginfo_t *si)
+{
+	if (si->si_code == CLD_EXITED)
+		return W_EXITCODE(si->si_status, 0);
+	if (si->si_code == CLD_DUMPED)
+		return W_EXITCODE(0, si->si_status) | WCOREFLAG;
+
+	return W_EXITCODE(0, si->si_status);
+}
+
+/* Reaps the processes of job it in group it->pid without a pidfd. The
+ * caller holds jmtx. */
+static void jobs_poll(struct job_list *list, struct job_item *it)
+{
+	pid_t w = 0;
+	int st;
+
+	while (it->nprocs > 0 && (w = waitpid(-it->pid, &st, WNOHANG)) > 0) {
+		it->nprocs--;
+		if (w == it->last)
+			it->status = st;
+	}
+	if (w == -1 && errno == ECHILD)  /* reaped elsewhere */
+		it->nprocs = 0;
+	if (it->nprocs == 0)
+		jobs_finish(list, it);
+}
+
+/* Applies the batch of n reaped processes to the table, the caller holds
+ * jmtx. */
+static void jobs_apply(struct job_list *list, const struct job_exit *ex,
+                       int n)
+{
+	struct job_item *it;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		it = list->tab[ex[i].num];
+		it->nprocs--;
+		if (ex[i].pid == it->last)
+			it->status = ex[i].status;
+		if (it->nprocs == 0)
+			jobs_finish(list, it);
+	}
+}
+
+/* Reaps all finished processes of background jobs. Only job processes
+ * are waited for, so the exit status of a foreground process stays for
+ * the exec thread. Jobs all processes of which are reaped are removed
+ * from the job_list and up to max of them are stored in d, the rest is
+ * kept for the next call. Returns the number of jobs stored in d. Must
+ * be called from one thread only. */
+int jobs_reap(struct job_list *list, struct job_done *d, int max)
+{
+	struct epoll_event ev[JOBS_EVENTS];
+	struct job_exit ex[JOBS_EVENTS];
+	struct job_item *it;
+	siginfo_t si;
+	int i, k, n, fd, num, status, finished = 0;
+
+	/* drain loop: every ready pidfd is reaped in this wakeup, the job
+	 * numbers stay valid until the batch is applied */
+	do {
+		n = epoll_wait(list->epfd, ev, JOBS_EVENTS, 0);
+		for (i = k = 0; i < n; i++) {
+			fd = (int)(uint32_t)ev[i].data.u64;
+			num = ev[i].data.u64 >> 32;
+			si.si_pid = 0;
+			if (waitid(P_PIDFD, fd, &si, WEXITED|WNOHANG) == 0) {
+				if (si.si_pid == 0)
+					continue;   /* not finished yet */
+				status = jobs_wstatus(&si);
+			} else if (errno == ECHILD) {
+				/* reaped elsewhere, the status is lost and
+				 * the job keeps the one it has */
+				si.si_pid = 0;
+				status = 0;
+			} else {
+				/* the pidfd can't be waited for (EINVAL
+				 * without P_PIDFD before Linux 5.4): the
+				 * group of the job is reaped by polling */
+				epoll_ctl(list->epfd, EPOLL_CTL_DEL, fd, NULL);
+				close(fd);
+				jobs_lock(list);
+				it = list->tab[num];
+				if (it != NULL && !it->nopidfd) {
+					it->nopidfd = 1;
+					list->nopidfd++;
+				}
+				pthread_mutex_unlock(&(list->jmtx));
+				continue;
+			}
+			/* a child being spawned may still share the pidfd,
+			 * closing it would not unregister it */
+			epoll_ctl(list->epfd, EPOLL_CTL_DEL, fd, NULL);
+			close(fd);
+			ex[k].num = num;
+			ex[k].pid = si.si_pid;
+			ex[k].status = status;
+			k++;
+		}
+		if (k > 0) {
+			jobs_lock(list);
+			jobs_apply(list, ex, k);
+			pthread_mutex_unlock(&(list->jmtx));
+		}
+	} while (n == JOBS_EVENTS);
+
+	jobs_lock(list);
+	for (i = 1; list->nopidfd > 0 && i <= list->top; i++)
+		if (list->tab[i] != NULL && list->tab[i]->nopidfd)
+			jobs_poll(list, list->tab[i]);
+
+	for (; list->done != NULL && finished < max; finished++) {
+		it = list->done;
+		list->done = it->next;
+		d[finished].num = it->num;
+		d[finished].pid = it->pid;
+		d[finished].status = it->status;
+		memcpy(d[finished].cmdline, it->cmdline,
+		       strlen(it->cmdline) + 1);
+		it->next = list->free;
+		list->free = it;
+	}
+	if (finished > 0)
+		pthread_cond_broadcast(&(list->jcond));
+	pthread_mutex_unlock(&(list->jmtx));
+
+	return finished;
+}
+
+/* Returns 1 if job num (any job if num is 0) has not finished yet, called
+ * with jmtx locked. */
+static int jobs_pending(struct job_list *list, int num)
+{
+	if (num == 0)
+		return list->njobs > 0;
+	return num <= list->top && list->tab[num] != NULL;
+}
+
+/* Returns 1 if job num (any job if num is 0) is still running, otherwise
+ * 0. For callers which reap the jobs themselves instead of jobs_wait(). */
+int jobs_running(struct job_list *list, int num)
+{
+	int rv;
+
+	jobs_lock(list);
+	rv = jobs_pending(list, num);
+	pthread_mutex_unlock(&(list->jmtx));
+
+	return rv;
+}
+
+/* Waits until job num (all jobs if num is 0) has finished. Returns 0, or
+ * -1 if the wait was interrupted by jobs_interrupt(). */
+int jobs_wait(struct job_list *list, int num)
+{
+	int rv = 0;
+
+	jobs_lock(list);
+	list->intr = 0;
+	while (jobs_pending(list, num)) {
+		if (list->intr) {
+			rv = -1;
+			break;
+		}
+		pthread_cond_wait(&(list->jcond), &(list->jmtx));
+	}
+	pthread_mutex_unlock(&(list->jmtx));
+
+	return rv;
+}
+
+/* Interrupts jobs_wait() (ctrl+c). */
+void jobs_interrupt(struct job_list *list)
+{
+	jobs_lock(list);
+	list->intr = 1;
+	pthread_cond_broadcast(&(list->jcond));
+	pthread_mutex_unlock(&(list->jmtx));
+}
+
+/* Prints background job num (all jobs if num is 0) on stream f. The
+ * lines are formatted under the lock into a buffer of JOBS_PRINT bytes
+ * and written after it is released, a buffer at a time, so a slow
+ * terminal does not hold up reaping. Returns 0 on success, 1 if there is
+ * no such job. */
+int jobs_print(struct job_list *list, int num, FILE *f)
+{
+	char buf[JOBS_PRINT];
+	struct job_item *it;
+	size_t len;
+	int i = (num != 0) ? num : 1, to;
+
+	do {
+		jobs_lock(list);
+		to = (num != 0) ? num : list->top;
+		if (num != 0 && (num > list->top || list->tab[num] == NULL)) {
+			pthread_mutex_unlock(&(list->jmtx));
+			return 1;
+		}
+		for (len = 0; i <= to &&
+		     len + JOBS_CMDLINE + 40 <= sizeof(buf); i++)
+			if ((it = list->tab[i]) != NULL)
+				len += sprintf(buf + len, "[%d] %d Running %s\n",
+				               it->num, it->pid, it->cmdline);
+		pthread_mutex_unlock(&(list->jmtx));
+		fwrite(buf, 1, len, f);
+	} while (i <= to);
+
+	return 0;
+}
+
+#endif /* JOBS_H */
@@ -0,0 +1,310 @@
+/* parse.h - Mini POSIX Shell
+ *
+ * Single-pass, table-driven command line tokenizer. The line is tokenized
+ * in place: quotes and backslashes are removed by moving the bytes of the
+ * word towards its beginning, every word is terminated by '\0' and the
+ * argument vector points straight into the line buffer. Only the vector
+ * itself is taken from the arena. Runs of plain word characters of long
+ * lines are skipped using the delimiter bitmap from scan.h.
+ *
+ * Supported syntax:
+ * -- words separated by spaces or tabs
+ * -- 'single quotes', "double quotes" (\ escapes $ ` " and \ only)
+ *    and \ escaping the next character outside of quotes
+ * -- a command spanning lines: newlines inside quotes are kept, \ at the
+ *    end of a line outside single quotes joins it with the next one (the
+ *    reader returns such commands whole, see reader.h)
+ * -- >FILE and <FILE redirections, whitespace after the operator allowed
+ * -- pipelines cmd | cmd | ..., every stage may have its own redirections
+ * -- & at the end of the line
+ *
+ */
+
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+#include "scan.h"
+
+/* initial size of the argument vector, doubled as needed */
+#define PARSE_ARGV 16
+/* lines at least this long are pre-scanned by scan_mask() */
+#define PARSE_SCAN_MIN 128
+
+/* character classes of the tokenizer */
+enum {
+	CL_CHAR = 0,   /* part of a word */
+	CL_SPACE,      /* word separator */
+	CL_SQUOTE,
+	CL_DQUOTE,
+	CL_BSLASH,
+	CL_OP,         /* > < & | */
+	CL_END         /* '\0' */
+};
+
+static const unsigned char parse_class[256] = {
+	['\0'] = CL_END,
+	[' '] = CL_SPACE, ['\t'] = CL_SPACE, ['\n'] = CL_SPACE,
+	['\''] = CL_SQUOTE,
+	['"'] = CL_DQUOTE,
+	['\\'] = CL_BSLASH,
+	['>'] = CL_OP, ['<'] = CL_OP, ['&'] = CL_OP, ['|'] = CL_OP
+};
+
+/* minimal line length for the bitmap scan, a tunable for benchmarks */
+size_t parse_scan_min = PARSE_SCAN_MIN;
+
+/* delimiter bitmap of the line being parsed */
+struct scan {
+	const char *base;
+	const uint64_t *mask;   /* NULL if the line was not pre-scanned */
+	size_t nwords;
+};
+
+/* parsed command line, a pipeline is a list of commands linked by pipe */
+struct command {
+	char **argv;       /* NULL terminated, strings point into the line */
+	int argc;          /* not counting the trailing NULL */
+	char *redir_out;   /* file of >FILE or NULL */
+	char *redir_in;    /* file of <FILE or NULL */
+	int bg;            /* run in background (line ended with '&'), set in
+	                    * the first command of a pipeline only */
+	struct command *pipe;   /* next stage of the pipeline or NULL */
+};
+
+/* Initializes empty command cmd with the argument vector of cap slots
+ * taken from arena a. Returns 0 on success, -1 if there is not enough
+ * memory. */
+static int parse_init(struct command *cmd, int cap, struct arena *a)
+{
+	cmd->argc = 0;
+	cmd->redir_out = NULL;
+	cmd->redir_in = NULL;
+	cmd->bg = 0;
+	cmd->pipe = NULL;
+	cmd->argv = arena_alloc(a, cap * sizeof(char *));
+
+	return (cmd->argv == NULL) ? -1 : 0;
+}
+
+/* Appends word to the argument vector of cmd, growing it in arena a.
+ * Returns 0 on success, -1 if there is not enough memory. */
+static int parse_push(struct command *cmd, int *cap, struct arena *a,
+                      char *word)
+{
+	char **argv;
+
+	/* keep one slot for the trailing NULL */
+	if (cmd->argc + 1 >= *cap) {
+		argv = arena_alloc(a, 2 * *cap * sizeof(char *));
+		if (argv == NULL)
+			return -1;
+		memcpy(argv, cmd->argv, cmd->argc * sizeof(char *));
+		cmd->argv = argv;
+		*cap *= 2;
+	}
+	cmd->argv[cmd->argc++] = word;
+
+	return 0;
+}
+
+/* Returns the first byte at or after r which is not whitespace nor a line
+ * continuation. */
+static inline char *parse_blank(char *r)
+{
+	for (;;) {
+		if (parse_class[(unsigned char)*r] == CL_SPACE)
+			r++;
+		else if (r[0] == '\\' && r[1] == '\n')
+			r += 2;
+		else
+			return r;
+	}
+}
+
+/* Returns the first byte at or after p which may end a run of plain word
+ * characters (never past the terminating '\0'). */
+static inline char *scan_next(const struct scan *sc, char *p)
+{
+	size_t i, w;
+	uint64_t bits;
+
+	if (sc->mask == NULL) {
+		while (parse_class[(unsigned char)*p] == CL_CHAR)
+			p++;
+		return p;
+	}
+
+	i = p - sc->base;
+	w = i >> 6;
+	bits = sc->mask[w] & (~0ULL << (i & 63));
+	while (bits == 0)  /* the bit of the '\0' ends the loop */
+		bits = sc->mask[++w];
+
+	return (char *)sc->base + (w << 6) + __builtin_ctzll(bits);
+}
+
+/* Tokenizes line of length len (line[len] is '\0') in place and fills cmd,
+ * further stages of a pipeline are allocated in arena a. Returns:
+ *  0 - line parsed (cmd->argc may be 0 for an empty line)
+ *  1 - syntax error, *err describes it
+ * -1 - memory allocation error
+ */
+int parse_line(char *line, size_t len, struct arena *a, struct command *cmd,
+               const char **err)
+{
+	char *r = line, *w, *word, *e;
+	char **target = NULL;   /* file name of a redirection comes next */
+	struct command *cur = cmd;   /* stage being filled */
+	int cap = PARSE_ARGV;
+	unsigned char c = 0, op = 0;
+	struct scan sc;
+	uint64_t *mask;
+
+	if (parse_init(cmd, cap, a) == -1)
+		return -1;
+
+	sc.base = line;
+	sc.mask = NULL;
+	if (len >= parse_scan_min) {
+		/* the bitmap includes the terminating '\0' */
+		sc.nwords = (len + 1 + 63) / 64;
+		mask = arena_alloc(a, sc.nwords * sizeof(uint64_t));
+		if (mask == NULL)
+			return -1;
+		if (scan_mask == NULL)
+			scan_init();
+		scan_mask(line, len + 1, mask);
+		sc.mask = mask;
+	}
+
+	for (;;) {
+		if (op == 0) {
+			/* skip whitespace between words */
+			r = parse_blank(r);
+			c = *r;
+			if (parse_class[c] == CL_OP) {
+				op = c;
+				r++;
+			}
+		}
+
+		if (op != 0 || c == '\0') {
+			if (target != NULL) {
+				*err = "missing file name after redirection";
+				return 1;
+			}
+			if (op == '>') {
+				target = &cur->redir_out;
+			} else if (op == '<') {
+				target = &cur->redir_in;
+			} else if (op == '|') {
+				if (cur->argc == 0) {
+					*err = "missing command before '|'";
+					return 1;
+				}
+				cur->argv[cur->argc] = NULL;
+				cur->pipe = arena_alloc(a, sizeof(*cur));
+				if (cur->pipe == NULL)
+					return -1;
+				cur = cur->pipe;
+				cap = PARSE_ARGV;
+				if (parse_init(cur, cap, a) == -1)
+					return -1;
+			} else if (op == '&') {  /* must end the line */
+				r = parse_blank(r);
+				if (*r != '\0') {
+					*err = "'&' must end the line";
+					return 1;
+				}
+				cmd->bg = 1;
+			} else {
+				if (cur != cmd && cur->argc == 0) {
+					*err = "missing command after '|'";
+					return 1;
+				}
+				cur->argv[cur->argc] = NULL;
+				return 0;
+			}
+			op = 0;
+			continue;
+		}
+
+		/* a word starts here, its bytes move from r to w once a quote
+		 * or backslash is removed */
+		word = w = r;
+		for (;;) {
+			c = *r;
+			switch (parse_class[c]) {
+				case CL_CHAR:
+					/* whole run of plain characters */
+					e = scan_next(&sc, r + 1);
+					if (w != r)
+						memmove(w, r, e - r);
+					w += e - r;
+					r = e;
+					continue;
+				case CL_SQUOTE:
+					r++;
+					while (*r != '\'' && *r != '\0')
+						*w++ = *r++;
+					if (*r == '\0') {
+						*err = "unterminated quote";
+						return 1;
+					}
+					r++;
+					continue;
+				case CL_DQUOTE:
+					r++;
+					while (*r != '"' && *r != '\0') {
+						if (*r == '\\' && r[1] == '\n') {
+							r += 2;   /* joined */
+							continue;
+						}
+						if (*r == '\\' && (r[1] == '"' ||
+						    r[1] == '\\' || r[1] == '$' ||
+						    r[1] == '`'))
+							r++;
+						*w++ = *r++;
+					}
+					if (*r == '\0') {
+						*err = "unterminated quote";
+						return 1;
+					}
+					r++;
+					continue;
+				case CL_BSLASH:
+					r++;
+					if (*r == '\0') {
+						*err = "'\\' at the end of line";
+						return 1;
+					}
+					if (*r == '\n')   /* joined lines */
+						r++;
+					else
+						*w++ = *r++;
+					continue;
+			}
+			break;
+		}
+
+		/* the '\0' may overwrite the delimiter kept in c */
+		if (parse_class[c] == CL_OP)
+			op = c;
+		if (c != '\0')
+			r++;
+		*w = '\0';
+
+		if (target != NULL) {
+			*target = word;
+			target = NULL;
+		} else if (parse_push(cur, &cap, a, word) == -1) {
+			return -1;
+		}
+	}
+}
+
+#endif /* PARSE_H */
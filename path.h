@@ -0,0 +1,569 @@
+/* path.h - Mini POSIX Shell
+ *
+ * Hashed PATH lookup cache. Command names are resolved once by probing the
+ * PATH directories through directory descriptors opened at startup and the
+ * result - including "not found" - is remembered in a hash table. Entries
+ * are invalidated by inotify watches on the PATH directories, so creating,
+ * removing, renaming or chmod-ing a file in any of them drops the cached
+ * result for that name. A directory missing so far is waited for by a watch
+ * on its nearest existing ancestor and opened when that gains an entry (a
+ * directory moved away becomes missing again), the cache is flushed when
+ * it appears. Directories without a watch (relative ones) can
+ * gain a command unnoticed, so a name is remembered only if it was found
+ * before the first of them.
+ *
+ */
+
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define PATH_DEFAULT "/bin:/usr/bin"
+#define PATH_BUCKETS 256
+
+struct path_dir {
+	char *name;       /* directory as written in PATH */
+	int fd;           /* O_PATH descriptor, -1 if it can't be opened */
+	int wd;           /* inotify watch descriptor, of the nearest existing
+	                     ancestor if fd is -1 */
+};
+
+struct path_entry {
+	char *name;       /* command name */
+	char *path;       /* resolved path, NULL if command was not found */
+	unsigned hits;
+	struct path_entry *next;
+};
+
+struct path_cache {
+	char *path_env;             /* PATH the directories were built from */
+	char *dirbuf;               /* copy of PATH split into directories */
+	struct path_dir *dirs;
+	int ndirs;
+	int relative;               /* PATH has directories relative to cwd */
+	int unwatched;              /* first directory without a watch, ndirs
+	                               if all are watched */
+	int ifd;                    /* inotify descriptor */
+	struct path_entry **tab;
+	unsigned nbuckets, nentries;
+	pthread_mutex_t pmtx;
+};
+
+struct path_cache path_cache = {
+	.ifd = -1,
+	.pmtx = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+static unsigned path_hash(const char *s)
+{
+	unsigned h = 2166136261u;  /* FNV-1a */
+
+	while (*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* Drops all cached entries, the caller holds pmtx. */
+static void path_flush(struct path_cache *pc)
+{
+	struct path_entry *e, *next;
+	unsigned i;
+
+	for (i = 0; i < pc->nbuckets; i++) {
+		for (e = pc->tab[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e);
+		}
+		pc->tab[i] = NULL;
+	}
+	pc->nentries = 0;
+}
+
+/* Drops the cached entry of name, the caller holds pmtx. */
+static void path_forget_locked(struct path_cache *pc, const char *name)
+{
+	struct path_entry **pe, *e;
+
+	if (pc->tab == NULL)
+		return;
+	pe = &pc->tab[path_hash(name) & (pc->nbuckets - 1)];
+	for (e = *pe; e != NULL; pe = &e->next, e = e->next) {
+		if (strcmp(e->name, name) == 0) {
+			*pe = e->next;
+			free(e);
+			pc->nentries--;
+			return;
+		}
+	}
+}
+
+/* Closes directory descriptors and watches, the caller holds pmtx. */
+static void path_close_dirs(struct path_cache *pc)
+{
+	int i;
+
+	for (i = 0; i < pc->ndirs; i++) {
+		if (pc->dirs[i].fd != -1)
+			close(pc->dirs[i].fd);
+		if (pc->dirs[i].wd != -1)
+			inotify_rm_watch(pc->ifd, pc->dirs[i].wd);
+	}
+	free(pc->dirs);
+	free(pc->dirbuf);
+	free(pc->path_env);
+	pc->dirs = NULL;
+	pc->dirbuf = NULL;
+	pc->path_env = NULL;
+	pc->ndirs = 0;
+	pc->unwatched = 0;
+}
+
+/* Returns 1 if a directory uses watch wd, the caller holds pmtx. */
+static int path_wd_used(struct path_cache *pc, int wd)
+{
+	int i;
+
+	for (i = 0; i < pc->ndirs; i++)
+		if (pc->dirs[i].wd == wd)
+			return 1;
+
+	return 0;
+}
+
+/* Watches the nearest existing ancestor of missing directory name for
+ * entries appearing (the mask is added to a watch the ancestor may have
+ * already). Returns the watch descriptor or -1. */
+static int path_watch_ancestor(struct path_cache *pc, const char *name)
+{
+	char dir[PATH_MAX], *s;
+	int wd = -1;
+
+	if (strlen(name) >= sizeof(dir))
+		return -1;
+	strcpy(dir, name);
+	while ((s = strrchr(dir, '/')) != NULL) {
+		s[s == dir] = '\0';   /* the root keeps its slash */
+		wd = inotify_add_watch(pc->ifd, dir, IN_CREATE|IN_MOVED_TO|
+		                       IN_ONLYDIR|IN_MASK_ADD);
+		if (wd != -1 || (errno != ENOENT && errno != ENOTDIR) ||
+		    s == dir)
+			break;
+	}
+
+	return wd;
+}
+
+/* Opens PATH directory d and watches it if it is absolute, or its nearest
+ * existing ancestor if it is missing; the caller holds pmtx. */
+static void path_open_dir(struct path_cache *pc, struct path_dir *d)
+{
+	int wd;
+
+	d->fd = open(d->name, O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (d->name[0] != '/' || pc->ifd == -1)
+		return;
+	if (d->fd == -1) {
+		d->wd = path_watch_ancestor(pc, d->name);
+		/* it might have been created before the watch was placed */
+		if (d->wd == -1 || (d->fd = open(d->name,
+		                     O_PATH|O_DIRECTORY|O_CLOEXEC)) == -1)
+			return;
+	}
+	wd = d->wd;
+	d->wd = inotify_add_watch(pc->ifd, d->name,
+	          IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|
+	          IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR);
+	if (wd != -1 && wd != d->wd && !path_wd_used(pc, wd))
+		inotify_rm_watch(pc->ifd, wd);
+}
+
+/* Closes PATH directory d and opens it again, the watch it had is removed
+ * unless it is still in use; the caller holds pmtx. */
+static void path_reopen_dir(struct path_cache *pc, struct path_dir *d)
+{
+	int wd = d->wd;
+
+	if (d->fd != -1)
+		close(d->fd);
+	d->wd = -1;
+	path_open_dir(pc, d);
+	if (wd != -1 && wd != d->wd && !path_wd_used(pc, wd))
+		inotify_rm_watch(pc->ifd, wd);
+}
+
+/* Sets the first directory without a watch, the caller holds pmtx. */
+static void path_unwatched(struct path_cache *pc)
+{
+	for (pc->unwatched = 0; pc->unwatched < pc->ndirs; pc->unwatched++)
+		if (pc->dirs[pc->unwatched].wd == -1)
+			break;
+}
+
+/* (Re)opens all directories of the PATH variable and places inotify watches
+ * on them, the caller holds pmtx. Returns 0 on success, -1 on error. */
+static int path_open_dirs(struct path_cache *pc)
+{
+	const char *env = getenv("PATH");
+	char *p, *dir, *next;
+	int n;
+
+	path_close_dirs(pc);
+	path_flush(pc);
+
+	if (env == NULL)
+		env = PATH_DEFAULT;
+	pc->path_env = strdup(env);
+	p = strdup(env);
+	if (pc->path_env == NULL || p == NULL) {
+		free(p);
+		return -1;
+	}
+	for (n = 1, dir = p; *dir != '\0'; dir++)
+		if (*dir == ':')
+			n++;
+	pc->dirs = calloc(n, sizeof(struct path_dir));
+	if (pc->dirs == NULL) {
+		free(p);
+		return -1;
+	}
+
+	pc->relative = 0;
+	for (dir = p; dir != NULL; dir = next) {
+		struct path_dir *d = &pc->dirs[pc->ndirs++];
+
+		next = strchr(dir, ':');
+		if (next != NULL)
+			*next++ = '\0';
+		/* an empty PATH element means the current directory */
+		d->name = (dir[0] == '\0') ? "." : dir;
+		d->wd = -1;
+		if (d->name[0] != '/')
+			pc->relative = 1;
+		path_open_dir(pc, d);
+	}
+	pc->dirbuf = p;
+	path_unwatched(pc);
+
+	return 0;
+}
+
+/* Reopens the directories inotify event ev concerns: missing ones whose
+ * ancestor gained an entry (all of them after an overflow) and ones whose
+ * watch is gone (removed or moved away). The cache is flushed if one
+ * appears, it may shadow any result. The caller holds pmtx. */
+static void path_event_dirs(struct path_cache *pc,
+                            const struct inotify_event *ev)
+{
+	const uint32_t gone = IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED;
+	struct path_dir *d;
+	int i, changed = 0;
+
+	for (i = 0; i < pc->ndirs; i++) {
+		d = &pc->dirs[i];
+		if (d->name[0] != '/')
+			continue;
+		if ((ev->mask & IN_Q_OVERFLOW) ? d->fd != -1 :
+		    ev->wd != d->wd || (d->fd != -1 && !(ev->mask & gone)))
+			continue;
+		path_reopen_dir(pc, d);
+		if (d->fd != -1)
+			path_flush(pc);
+		changed = 1;
+	}
+	if (changed)
+		path_unwatched(pc);
+}
+
+/* Applies the pending inotify events to the cache, the caller holds pmtx. */
+static void path_sync(struct path_cache *pc)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	if (pc->ifd == -1)
+		return;
+	while ((n = read(pc->ifd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & (IN_Q_OVERFLOW|IN_DELETE_SELF|
+			                IN_MOVE_SELF|IN_IGNORED))
+				path_flush(pc);
+			else if (ev->len > 0)
+				path_forget_locked(pc, ev->name);
+			path_event_dirs(pc, ev);
+		}
+	}
+}
+
+/* Initializes the PATH cache. Returns 0 on success, -1 on error. */
+int path_init(void)
+{
+	struct path_cache *pc = &path_cache;
+	int rc;
+
+	pc->nbuckets = PATH_BUCKETS;
+	pc->tab = calloc(pc->nbuckets, sizeof(struct path_entry *));
+	if (pc->tab == NULL)
+		return -1;
+	/* without inotify nothing is cached, see path_lookup() */
+	pc->ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+
+	pthread_mutex_lock(&pc->pmtx);
+	rc = path_open_dirs(pc);
+	pthread_mutex_unlock(&pc->pmtx);
+
+	return rc;
+}
+
+/* Frees the memory occupied by the PATH cache. */
+void path_free(void)
+{
+	struct path_cache *pc = &path_cache;
+
+	pthread_mutex_lock(&pc->pmtx);
+	if (pc->tab != NULL)
+		path_flush(pc);
+	path_close_dirs(pc);
+	free(pc->tab);
+	pc->tab = NULL;
+	if (pc->ifd != -1)
+		close(pc->ifd);
+	pc->ifd = -1;
+	pthread_mutex_unlock(&pc->pmtx);
+}
+
+/* Doubles the number of buckets, the caller holds pmtx. */
+static void path_grow(struct path_cache *pc)
+{
+	struct path_entry **tab, *e, *next;
+	unsigned i, nb = pc->nbuckets * 2;
+
+	tab = calloc(nb, sizeof(struct path_entry *));
+	if (tab == NULL)
+		return;  /* longer chains, but still correct */
+	for (i = 0; i < pc->nbuckets; i++) {
+		for (e = pc->tab[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = tab[path_hash(e->name) & (nb - 1)];
+			tab[path_hash(e->name) & (nb - 1)] = e;
+		}
+	}
+	free(pc->tab);
+	pc->tab = tab;
+	pc->nbuckets = nb;
+}
+
+/* Probes the PATH directories for an executable regular file name, those
+ * missing so far without a watch are opened again in case they have been
+ * created (path_sync() opens the watched ones). Returns index of the
+ * directory or -1 if not found, the caller holds pmtx. */
+static int path_search(struct path_cache *pc, const char *name)
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; i < pc->ndirs; i++) {
+		if (pc->dirs[i].fd == -1) {
+			if (pc->dirs[i].wd != -1)
+				continue;
+			path_reopen_dir(pc, &pc->dirs[i]);
+			path_unwatched(pc);
+			if (pc->dirs[i].fd == -1)
+				continue;
+		}
+		if (fstatat(pc->dirs[i].fd, name, &st, 0) == 0 &&
+		    S_ISREG(st.st_mode) &&
+		    faccessat(pc->dirs[i].fd, name, X_OK, AT_EACCESS) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Creates entry for name resolved to directory dir (-1 means not found),
+ * the caller holds pmtx. Returns the new entry or NULL. */
+static struct path_entry *path_insert(struct path_cache *pc,
+                                      const char *name, int dir)
+{
+	struct path_entry *e;
+	size_t nlen = strlen(name) + 1, plen = 0;
+	unsigned b;
+
+	if (dir != -1)
+		plen = strlen(pc->dirs[dir].name) + 1 + nlen;
+	e = malloc(sizeof(struct path_entry) + nlen + plen);
+	if (e == NULL)
+		return NULL;
+	e->name = (char *)(e + 1);
+	memcpy(e->name, name, nlen);
+	e->path = NULL;
+	if (dir != -1) {
+		e->path = e->name + nlen;
+		sprintf(e->path, "%s/%s", pc->dirs[dir].name, name);
+	}
+	e->hits = 0;
+
+	if (pc->nentries >= pc->nbuckets * 2)
+		path_grow(pc);
+	b = path_hash(name) & (pc->nbuckets - 1);
+	e->next = pc->tab[b];
+	pc->tab[b] = e;
+	pc->nentries++;
+
+	return e;
+}
+
+/* Finds the entry of name, the caller holds pmtx. */
+static struct path_entry *path_find(struct path_cache *pc, const char *name)
+{
+	struct path_entry *e;
+
+	for (e = pc->tab[path_hash(name) & (pc->nbuckets - 1)]; e != NULL;
+	     e = e->next)
+		if (strcmp(e->name, name) == 0)
+			return e;
+
+	return NULL;
+}
+
+/* Resolves command name (without '/') to its path stored in buf of size
+ * len. Returns 0 on success, ENOENT if the command is not found in PATH
+ * or other error number. If hashed is not NULL it is set to 1 when the
+ * result came from the cache. */
+int path_lookup(const char *name, char *buf, size_t len, int *hashed)
+{
+	struct path_cache *pc = &path_cache;
+	struct path_entry *e;
+	const char *env;
+	int rc = 0, dir;
+
+	pthread_mutex_lock(&pc->pmtx);
+	env = getenv("PATH");
+	if (env == NULL)
+		env = PATH_DEFAULT;
+	if (pc->path_env == NULL || strcmp(env, pc->path_env) != 0)
+		path_open_dirs(pc);
+	path_sync(pc);
+
+	if (hashed != NULL)
+		*hashed = 0;
+	e = path_find(pc, name);
+	if (e != NULL) {
+		if (hashed != NULL)
+			*hashed = 1;
+	} else {
+		dir = path_search(pc, name);
+		/* without inotify the cache could not be kept valid, nor
+		 * when the file may appear in an unwatched directory first */
+		if (pc->ifd != -1 && (dir == -1 ? pc->unwatched == pc->ndirs :
+		                                  dir < pc->unwatched))
+			e = path_insert(pc, name, dir);
+		if (e == NULL) {
+			if (dir == -1)
+				rc = ENOENT;
+			else if (snprintf(buf, len, "%s/%s", pc->dirs[dir].name,
+			                  name) >= len)
+				rc = ENAMETOOLONG;
+			pthread_mutex_unlock(&pc->pmtx);
+			return rc;
+		}
+	}
+
+	e->hits++;
+	if (e->path == NULL)
+		rc = ENOENT;
+	else if (strlen(e->path) >= len)
+		rc = ENAMETOOLONG;
+	else
+		strcpy(buf, e->path);
+	pthread_mutex_unlock(&pc->pmtx);
+
+	return rc;
+}
+
+/* Drops the cached entry of name. */
+void path_forget(const char *name)
+{
+	pthread_mutex_lock(&path_cache.pmtx);
+	path_forget_locked(&path_cache, name);
+	pthread_mutex_unlock(&path_cache.pmtx);
+}
+
+/* Forgets all remembered locations and reopens the PATH directories. */
+void path_rehash(void)
+{
+	pthread_mutex_lock(&path_cache.pmtx);
+	path_open_dirs(&path_cache);
+	pthread_mutex_unlock(&path_cache.pmtx);
+}
+
+/* Must be called after the working directory changes: results found through
+ * relative PATH directories are no longer valid. */
+void path_cwd_changed(void)
+{
+	if (path_cache.relative)
+		path_rehash();
+}
+
+/* Prints the remembered locations with the number of hits on out. */
+void path_print(FILE *out)
+{
+	struct path_cache *pc = &path_cache;
+	struct path_entry *e;
+	unsigned i;
+	int n = 0;
+
+	pthread_mutex_lock(&pc->pmtx);
+	path_sync(pc);
+	for (i = 0; i < pc->nbuckets; i++) {
+		for (e = pc->tab[i]; e != NULL; e = e->next) {
+			if (e->path == NULL)
+				continue;
+			if (n++ == 0)
+				fprintf(out, "hits\tcommand\n");
+			fprintf(out, "%4u\t%s\n", e->hits, e->path);
+		}
+	}
+	pthread_mutex_unlock(&pc->pmtx);
+
+	if (n == 0)
+		fprintf(out, "hash: hash table empty\n");
+}
+
+/* Returns 1 and copies the path to buf if name is remembered as found,
+ * otherwise 0. Does not search the PATH. */
+int path_hashed(const char *name, char *buf, size_t len)
+{
+	struct path_entry *e;
+	int rv = 0;
+
+	pthread_mutex_lock(&path_cache.pmtx);
+	path_sync(&path_cache);
+	e = path_find(&path_cache, name);
+	if (e != NULL && e->path != NULL && strlen(e->path) < len) {
+		strcpy(buf, e->path);
+		rv = 1;
+	}
+	pthread_mutex_unlock(&path_cache.pmtx);
+
+	return rv;
+}
+
+#endif /* PATH_H */
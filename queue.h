@@ -0,0 +1,187 @@
+/* queue.h - Mini POSIX Shell
+ *
+ * Bounded single-producer/single-consumer ring of parsed commands between
+ * the input thread (producer) and the exec thread (consumer). Every slot
+ * owns an arena, so the input thread can parse the next lines while the
+ * exec thread is still running an earlier command.
+ *
+ * The ring indexes are free running counters, only the producer writes
+ * head and only the consumer writes tail. A thread finding the ring empty
+ * (full) sleeps in futex(2) on the other side's counter; the other side
+ * calls FUTEX_WAKE only when the waiting flag is set, so the handoff costs
+ * no system call at all while both threads are busy.
+ *
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "arena.h"
+#include "parse.h"
+#include "trace.h"
+
+/* number of slots, a power of two */
+#define CMDQ_SIZE 16
+
+/* kinds of queued entries */
+enum {
+	CMDQ_RUN = 0,   /* execute cmd */
+	CMDQ_SYNTAX,    /* report syntax error err */
+	CMDQ_TOOLONG,   /* report too long line */
+	CMDQ_END        /* end of input, the exec thread exits */
+};
+
+struct cmdq_slot {
+	int kind;
+	struct command cmd;
+	const char *err;
+	struct arena arena;   /* argv of cmd, copy of the line if needed */
+	struct timespec parsed;   /* end of parsing and its duration, */
+	long parse_ns;            /* reported by time */
+};
+
+struct cmd_queue {
+	unsigned int head;   /* next slot to fill, written by the producer */
+	unsigned int tail;   /* next slot to execute, written by the consumer */
+	int cwait;           /* consumer sleeps on head */
+	int pwait;           /* producer sleeps on tail */
+	int closed;          /* the consumer has exited */
+	struct cmdq_slot slots[CMDQ_SIZE];
+};
+
+
+static void futex_wait(unsigned int *addr, unsigned int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Initializes an empty queue. */
+void cmdq_init(struct cmd_queue *q)
+{
+	int i;
+
+	q->head = q->tail = 0;
+	q->cwait = q->pwait = q->closed = 0;
+	for (i = 0; i < CMDQ_SIZE; i++)
+		arena_init(&q->slots[i].arena);
+}
+
+/* Frees the memory of all slots. */
+void cmdq_free(struct cmd_queue *q)
+{
+	int i;
+
+	for (i = 0; i < CMDQ_SIZE; i++)
+		arena_free(&q->slots[i].arena);
+}
+
+/* Producer: waits until at most n slots are in use (by queued or running
+ * commands), n == 0 waits until the exec thread finished everything.
+ * Returns 0, or -1 if the consumer has exited. */
+int cmdq_wait(struct cmd_queue *q, unsigned int n)
+{
+	unsigned int t;
+	uint64_t t0;
+
+	for (;;) {
+		if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST))
+			return -1;
+		t = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (q->head - t <= n)
+			return 0;
+		/* the consumer checks pwait after storing tail, so either it
+		 * sees the flag or the new tail is seen here */
+		__atomic_store_n(&q->pwait, 1, __ATOMIC_SEQ_CST);
+		if (q->head - __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) > n &&
+		    !__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+			/* the input thread is blocked by the exec thread */
+			t0 = trace_begin();
+			futex_wait(&q->tail, t);
+			trace_end("wait for exec", t0, "queued", q->head - t);
+		}
+		__atomic_store_n(&q->pwait, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* Producer: returns the slot to fill next with its arena reset, waiting
+ * for a free one. Returns NULL if the consumer has exited. */
+struct cmdq_slot *cmdq_reserve(struct cmd_queue *q)
+{
+	struct cmdq_slot *s;
+
+	if (cmdq_wait(q, CMDQ_SIZE - 1) == -1)
+		return NULL;
+	s = &q->slots[q->head & (CMDQ_SIZE - 1)];
+	arena_reset(&s->arena);
+	s->kind = CMDQ_RUN;
+	s->err = NULL;
+
+	return s;
+}
+
+/* Producer: hands the slot filled after cmdq_reserve() to the consumer. */
+void cmdq_push(struct cmd_queue *q)
+{
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->cwait, __ATOMIC_SEQ_CST))
+		futex_wake(&q->head);
+}
+
+/* Consumer: returns the next queued slot, waiting for one. */
+struct cmdq_slot *cmdq_pop(struct cmd_queue *q)
+{
+	unsigned int h;
+	uint64_t t0;
+
+	for (;;) {
+		h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (h != q->tail)
+			return &q->slots[q->tail & (CMDQ_SIZE - 1)];
+		__atomic_store_n(&q->cwait, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == q->tail) {
+			t0 = trace_begin();
+			futex_wait(&q->head, h);
+			trace_end("wait for input", t0, NULL, 0);
+		}
+		__atomic_store_n(&q->cwait, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* Consumer: gives the slot returned by cmdq_pop() back to the producer
+ * once its command has finished. */
+void cmdq_release(struct cmd_queue *q)
+{
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->pwait, __ATOMIC_SEQ_CST))
+		futex_wake(&q->tail);
+}
+
+/* Consumer: releases the slot returned by cmdq_pop() and tells the
+ * producer no more slots will be released. Used instead of cmdq_release()
+ * when the exec thread exits. */
+void cmdq_close(struct cmd_queue *q)
+{
+	__atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+	/* the change of tail also wakes a producer about to sleep */
+	cmdq_release(q);
+}
+
+/* Returns 1 if a command is queued or running, otherwise 0. Safe to call
+ * from any thread. */
+int cmdq_busy(struct cmd_queue *q)
+{
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) !=
+	       __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif /* QUEUE_H */
@@ -0,0 +1,353 @@
+/* reader.h - Mini POSIX Shell
+ *
+ * Buffered line reader. Input is read in large blocks into a growable
+ * buffer and split into lines with memchr(), so one read() may serve many
+ * lines (pasted or piped input) and a line may be as long as the limit
+ * given to reader_init() (ARG_MAX for the shell). The lines are returned
+ * in place, '\n' replaced by '\0'.
+ *
+ * A reader of shell commands (reader_commands()) splits the input into
+ * commands instead: a '\n' inside quotes or escaped by a backslash (a line
+ * continuation) does not end the command. The scan is a state machine
+ * resumed where the previous read stopped (in a quote, after a
+ * backslash), so a command spanning many reads is scanned once, and every
+ * command is returned as soon as its end is read; only the command in
+ * progress is kept in the buffer.
+ *
+ * A regular file (shell script) can be mapped into memory instead with
+ * reader_init_mmap(): the lines are then slices of the private mapping and
+ * the file is never copied.
+ *
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
+
+/* initial buffer size, it grows up to the maximal line length */
+#define READER_BUF 4096
+
+/* state of the command scan at the end of the scanned bytes */
+enum {
+	RD_PLAIN = 0,
+	RD_ESC,       /* after a backslash */
+	RD_SQUOTE,
+	RD_DQUOTE,
+	RD_DQ_ESC     /* after a backslash in double quotes */
+};
+
+/* return values of reader_line() besides the line length */
+#define READER_EOF     (-1)
+#define READER_ERROR   (-2)   /* read() failed, errno is set */
+#define READER_TOOLONG (-3)   /* line longer than the limit, skipped */
+#define READER_AGAIN   (-4)   /* no complete line without reading more */
+
+struct reader {
+	int fd;
+	char *buf;
+	size_t cap;        /* size of buf */
+	size_t start;      /* first byte of the next line */
+	size_t scanned;    /* bytes from start known not to contain '\n' */
+	size_t end;        /* end of data in buf */
+	size_t max;        /* longest accepted line */
+	size_t mapped;     /* length of the mapping, 0 if buf is malloc'd */
+	int skip;          /* skipping the rest of a too long line */
+	int eof;
+	int cmds;          /* split into shell commands, not lines */
+	int state;         /* RD_* state of the command scan */
+	void (*more)(void);   /* called when a command goes on on the next
+	                       * line (the continuation prompt) */
+	int asked;         /* more() called since the last data came */
+};
+
+
+/* Initializes reader of file descriptor fd accepting lines of at most max
+ * bytes. Returns 0 on success, -1 if there is not enough memory. */
+int reader_init(struct reader *rd, int fd, size_t max)
+{
+	rd->fd = fd;
+	rd->cap = (max + 1 < READER_BUF) ? max + 1 : READER_BUF;
+	rd->buf = malloc(rd->cap);
+	rd->start = rd->scanned = rd->end = 0;
+	rd->max = max;
+	rd->mapped = 0;
+	rd->skip = 0;
+	rd->eof = 0;
+	rd->cmds = rd->state = rd->asked = 0;
+	rd->more = NULL;
+
+	return (rd->buf == NULL) ? -1 : 0;
+}
+
+/* Initializes reader of the regular file open as fd by mapping it into
+ * memory (fd may be closed afterwards). Returns 0 on success, -1 on error
+ * with errno set. */
+int reader_init_mmap(struct reader *rd, int fd, size_t max)
+{
+	struct stat st;
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *p;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (!S_ISREG(st.st_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* anonymous pages behind the file leave room for the '\0' which
+	 * terminates the last line when the file does not end with '\n' */
+	rd->mapped = (st.st_size + 1 + page - 1) & ~(page - 1);
+	p = mmap(NULL, rd->mapped, PROT_READ|PROT_WRITE,
+	         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	if (st.st_size > 0) {
+		if (mmap(p, st.st_size, PROT_READ|PROT_WRITE,
+		         MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+			munmap(p, rd->mapped);
+			return -1;
+		}
+		madvise(p, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	rd->fd = -1;
+	rd->buf = p;
+	rd->cap = rd->mapped;
+	rd->start = rd->scanned = 0;
+	rd->end = st.st_size;
+	rd->max = max;
+	rd->skip = 0;
+	rd->eof = 1;   /* all the data is already there */
+	rd->cmds = rd->state = rd->asked = 0;
+	rd->more = NULL;
+
+	return 0;
+}
+
+/* Makes reader rd split its input into shell commands instead of lines,
+ * more (may be NULL) is called when a command goes on on the next line. */
+void reader_commands(struct reader *rd, void (*more)(void))
+{
+	rd->cmds = 1;
+	rd->more = more;
+}
+
+/* Frees the memory occupied by the reader. */
+void reader_free(struct reader *rd)
+{
+	if (rd->mapped != 0)
+		munmap(rd->buf, rd->mapped);
+	else
+		free(rd->buf);
+	rd->buf = NULL;
+}
+
+/* Makes room for more input after the buffered data: moves the unfinished
+ * line to the beginning of the buffer and grows it up to the line limit
+ * (discards the data when skipping a long line and there is no room).
+ * Stores the address of the free space in p and returns its size, or -1 if
+ * there is not enough memory. For callers doing the read themselves, see
+ * reader_commit(). */
+ssize_t reader_space(struct reader *rd, char **p)
+{
+	size_t cap;
+	char *buf;
+
+	/* move the unfinished line to the beginning of the buffer */
+	if (rd->start > 0) {
+		memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+		rd->end -= rd->start;
+		rd->start = 0;
+	}
+	/* one byte is always kept for the terminating '\0' */
+	if (rd->end + 1 >= rd->cap) {
+		if (rd->cap < rd->max + 1) {
+			cap = (rd->cap * 2 < rd->max + 1) ? rd->cap * 2
+			                                  : rd->max + 1;
+			buf = realloc(rd->buf, cap);
+			if (buf == NULL)
+				return -1;
+			rd->buf = buf;
+			rd->cap = cap;
+		} else {
+			rd->end = rd->scanned = 0;
+		}
+	}
+	*p = rd->buf + rd->end;
+
+	return rd->cap - 1 - rd->end;
+}
+
+/* Adds n bytes read into the space returned by reader_space() to the
+ * buffered data, n == 0 marks the end of input. */
+void reader_commit(struct reader *rd, size_t n)
+{
+	if (n > 0)
+		rd->end += n;
+	else
+		rd->eof = 1;
+	rd->asked = 0;
+}
+
+/* Reads more data into the buffer, making room first. Returns the number
+ * of bytes read, 0 at the end of file or -1 on error. Discards the buffered
+ * data (when skipping a long line) if there is no room left. */
+static ssize_t reader_fill(struct reader *rd)
+{
+	struct timespec t0;
+	uint64_t tt;
+	char *p;
+	ssize_t n, room;
+
+	room = reader_space(rd, &p);
+	if (room == -1)
+		return -1;
+	stats_now(&t0);
+	tt = trace_begin();
+	while ((n = read(rd->fd, p, room)) == -1 && errno == EINTR)
+		;
+	stats_lap(STATS_READ, &t0);
+	trace_end("read", tt, "bytes", n);
+	if (n >= 0)
+		reader_commit(rd, n);
+
+	return n;
+}
+
+/* Returns the '\n' ending the next command, NULL if the buffered data ends
+ * first: the scan goes on from where the previous call stopped and in the
+ * state it stopped in. Outside quotes it jumps from one '\n', quote or
+ * backslash to the next (scan_cmd()). */
+static char *reader_scan(struct reader *rd)
+{
+	char *p = rd->buf + rd->start + rd->scanned, *end = rd->buf + rd->end;
+	char *q;
+
+	while (p < end) {
+		switch (rd->state) {
+			case RD_PLAIN:
+				q = scan_cmd(p, end - p);
+				if (q == end) {
+					p = end;
+					break;
+				}
+				if (*q == '\n')
+					return q;
+				rd->state = (*q == '\\') ? RD_ESC :
+				            (*q == '\'') ? RD_SQUOTE : RD_DQUOTE;
+				p = q + 1;
+				break;
+			case RD_ESC:
+				p++;
+				rd->state = RD_PLAIN;
+				break;
+			case RD_SQUOTE:
+				q = memchr(p, '\'', end - p);
+				if (q == NULL) {
+					p = end;
+					break;
+				}
+				rd->state = RD_PLAIN;
+				p = q + 1;
+				break;
+			case RD_DQUOTE:
+				while (p < end && *p != '"' && *p != '\\')
+					p++;
+				if (p < end)
+					rd->state = (*p++ == '"') ? RD_PLAIN
+					                          : RD_DQ_ESC;
+				break;
+			case RD_DQ_ESC:
+				p++;
+				rd->state = RD_DQUOTE;
+				break;
+		}
+	}
+	rd->scanned = rd->end - rd->start;
+
+	return NULL;
+}
+
+/* Returns the length of the next line and stores the pointer to it in line
+ * (valid until the next call), or one of READER_EOF, READER_ERROR,
+ * READER_TOOLONG and READER_AGAIN. At most reads read() calls are made
+ * (-1 for no limit), READER_AGAIN is returned if no complete line is
+ * buffered after them. The last line does not need to end with '\n'. */
+ssize_t reader_next(struct reader *rd, char **line, int reads)
+{
+	char *nl;
+	size_t len;
+
+	for (;;) {
+		if (rd->cmds)
+			nl = reader_scan(rd);
+		else
+			nl = memchr(rd->buf + rd->start + rd->scanned, '\n',
+			            rd->end - rd->start - rd->scanned);
+		if (nl != NULL) {
+			*nl = '\0';
+			len = nl - (rd->buf + rd->start);
+			*line = rd->buf + rd->start;
+			rd->start += len + 1;
+			rd->scanned = 0;
+			if (rd->skip || len > rd->max) {
+				rd->skip = 0;
+				return READER_TOOLONG;
+			}
+			return len;
+		}
+		rd->scanned = rd->end - rd->start;
+
+		if (rd->eof) {
+			/* an unterminated quote is left to the parser */
+			rd->state = RD_PLAIN;
+			len = rd->end - rd->start;
+			if (len == 0 && !rd->skip)
+				return READER_EOF;
+			rd->buf[rd->end] = '\0';
+			*line = rd->buf + rd->start;
+			rd->start = rd->end;
+			rd->scanned = 0;
+			if (rd->skip) {
+				rd->skip = 0;
+				return READER_TOOLONG;
+			}
+			return len;
+		}
+
+		/* no room left for the rest of the line, it is skipped */
+		if (rd->end - rd->start >= rd->max)
+			rd->skip = 1;
+		/* Enter pressed in a quote or after a backslash */
+		if (rd->more != NULL && !rd->asked && rd->end > rd->start &&
+		    rd->buf[rd->end - 1] == '\n') {
+			rd->asked = 1;
+			rd->more();
+		}
+		if (reads == 0)
+			return READER_AGAIN;
+		if (reads > 0)
+			reads--;
+		if (reader_fill(rd) == -1)
+			return READER_ERROR;
+	}
+}
+
+/* Returns the next line like reader_next(), reading as much as needed. */
+ssize_t reader_line(struct reader *rd, char **line)
+{
+	return reader_next(rd, line, -1);
+}
+
+#endif /* READER_H */
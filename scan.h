@@ -0,0 +1,176 @@
+/* scan.h - Mini POSIX Shell
+ *
+ * Vectorized delimiter scanning for the tokenizer. One sweep over the line
+ * produces a bitmap with a bit set for every byte which may end a run of
+ * plain word characters: whitespace and control characters, quotes,
+ * backslash and the operators > < & |. The tokenizer then jumps from one
+ * set bit to the next instead of classifying the line byte by byte.
+ *
+ * The bitmap is built by an AVX2 (32 bytes at a time), SSE2 (16 bytes) or
+ * scalar routine, the best one supported by the CPU is picked at runtime.
+ *
+ * scan_cmd() finds the end of a command line for the reader the same way,
+ * 16 bytes at a time where SSE2 is part of the target.
+ *
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define HAVE_SCAN_X86 1
+#endif
+
+typedef void (*scan_fn)(const char *s, size_t n, uint64_t *mask);
+
+/* Returns 1 if byte c may end a run of plain word characters. */
+static inline int scan_special(unsigned char c)
+{
+	return c <= ' ' || c == '"' || (c | 1) == '\'' || (c | 2) == '>' ||
+	       (c | 0x20) == '|';
+}
+
+/* Sets the bits of special bytes s[from..n) in mask. */
+static void scan_tail(const char *s, size_t from, size_t n, uint64_t *mask)
+{
+	size_t i;
+
+	for (i = from; i < n; i++)
+		if (scan_special(s[i]))
+			mask[i >> 6] |= 1ULL << (i & 63);
+}
+
+/* Fills mask (n bits, rounded up to whole words) for the first n bytes
+ * of s, byte by byte. */
+void scan_mask_scalar(const char *s, size_t n, uint64_t *mask)
+{
+	memset(mask, 0, ((n + 63) / 64) * sizeof(uint64_t));
+	scan_tail(s, 0, n, mask);
+}
+
+#ifdef HAVE_SCAN_X86
+/* The special bytes are matched with 5 compares: c <= ' ' (\0 \t \n ' '),
+ * c == '"', c|1 == '\'' (& '), c|2 == '>' (< >) and c|0x20 == '|' (\ |). */
+__attribute__((target("sse2")))
+void scan_mask_sse2(const char *s, size_t n, uint64_t *mask)
+{
+	const __m128i sp = _mm_set1_epi8(' '), dq = _mm_set1_epi8('"');
+	const __m128i sq = _mm_set1_epi8('\''), gt = _mm_set1_epi8('>');
+	const __m128i bar = _mm_set1_epi8('|');
+	const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+	const __m128i b5 = _mm_set1_epi8(0x20);
+	__m128i v, m;
+	size_t i;
+
+	memset(mask, 0, ((n + 63) / 64) * sizeof(uint64_t));
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_cmpeq_epi8(_mm_min_epu8(v, sp), v);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, dq));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_or_si128(v, one), sq));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_or_si128(v, two), gt));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_or_si128(v, b5), bar));
+		mask[i >> 6] |= (uint64_t)(unsigned)_mm_movemask_epi8(m)
+		                << (i & 63);
+	}
+	scan_tail(s, i, n, mask);
+}
+
+__attribute__((target("avx2")))
+void scan_mask_avx2(const char *s, size_t n, uint64_t *mask)
+{
+	const __m256i sp = _mm256_set1_epi8(' '), dq = _mm256_set1_epi8('"');
+	const __m256i sq = _mm256_set1_epi8('\''), gt = _mm256_set1_epi8('>');
+	const __m256i bar = _mm256_set1_epi8('|');
+	const __m256i one = _mm256_set1_epi8(1), two = _mm256_set1_epi8(2);
+	const __m256i b5 = _mm256_set1_epi8(0x20);
+	__m256i v, m;
+	size_t i;
+
+	memset(mask, 0, ((n + 63) / 64) * sizeof(uint64_t));
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, sp), v);
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, dq));
+		m = _mm256_or_si256(m,
+		        _mm256_cmpeq_epi8(_mm256_or_si256(v, one), sq));
+		m = _mm256_or_si256(m,
+		        _mm256_cmpeq_epi8(_mm256_or_si256(v, two), gt));
+		m = _mm256_or_si256(m,
+		        _mm256_cmpeq_epi8(_mm256_or_si256(v, b5), bar));
+		mask[i >> 6] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m)
+		                << (i & 63);
+	}
+	scan_tail(s, i, n, mask);
+}
+#endif
+
+/* Returns the first byte of s[0..n) which matters to the command scan of
+ * the reader (see reader.h): '\n', a quote or a backslash; s + n if there
+ * is none. */
+static inline char *scan_cmd(char *s, size_t n)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n'), sq = _mm_set1_epi8('\'');
+	const __m128i dq = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+	__m128i v, m;
+	unsigned bits;
+
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, sq));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, dq));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bs));
+		bits = _mm_movemask_epi8(m);
+		if (bits != 0)
+			return s + i + __builtin_ctz(bits);
+	}
+#endif
+	for (; i < n; i++)
+		if (s[i] == '\n' || s[i] == '\'' || s[i] == '"' ||
+		    s[i] == '\\')
+			return s + i;
+
+	return s + n;
+}
+
+const char *scan_names[] = { "scalar", "sse2", "avx2", NULL };
+
+/* scanner used by the tokenizer, picked by scan_init() */
+scan_fn scan_mask;
+
+/* Selects the scanner by name. Returns 0 on success, -1 if it is unknown
+ * or not supported by the CPU. */
+int scan_select(const char *name)
+{
+	if (strcmp(name, "scalar") == 0) {
+		scan_mask = scan_mask_scalar;
+		return 0;
+	}
+#ifdef HAVE_SCAN_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+		scan_mask = scan_mask_sse2;
+		return 0;
+	}
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		scan_mask = scan_mask_avx2;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+/* Picks the fastest scanner supported by the CPU. */
+void scan_init(void)
+{
+	if (scan_select("avx2") == -1 && scan_select("sse2") == -1)
+		scan_select("scalar");
+}
+
+#endif /* SCAN_H */
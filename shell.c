@@ -9,26 +9,57 @@
  * 1) Input handling thread
  * 2) Execution handling thread
  * 3) Signal handling thread
- * Input handling thread is processing the user input which is then
- * used in execution handling thread (monitor is used for synchronization)
- * which forks the new process and then executes the user input. Input
- * and execution threads have all signals blocked so only signal handling
- * thread can receive signals delivered to the main shell process.
+ * Input handling thread is reading and parsing the user input, parsed
+ * commands are passed through a lock-free ring (see queue.h) to the
+ * execution handling thread which runs built-in commands and spawns new
+ * processes. Input and execution threads have all signals blocked so only
+ * signal handling thread can receive signals delivered to the main shell
+ * process.
+ * With -e epoll (-e uring) the shell runs a single-threaded event loop
+ * instead, see loop_start() (loop_uring_start()).
  *
  *
  * Mini POSIX Shell features:
  * -- file redirection using >FILE or <FILE
+ * -- pipelines cmd | cmd | ..., one job per background pipeline
+ * -- 'single', "double" quotes and \ escapes, see parse.h; quotes and
+ *    lines ending with \ continue the command on the next line, commands
+ *    are split from the input as it is read, see reader.h
+ * -- non-interactive mode: shell SCRIPT (mapped into memory) or commands
+ *    piped to stdin, without job control and prompts
  * -- run process in background by specifying '&' character
  *    at the end of the command line
+ * -- commands found in PATH are remembered in a hash table kept valid
+ *    with inotify, see path.h
+ * -- selectable process spawning backend
+ *    (-s fork|vfork|posix_spawn|clone3|zygote), see spawn.h and zygote.h
+ * -- selectable main loop (-e threads|epoll|uring), io_uring requests are
+ *    submitted in batches, see uring.h
+ * -- background jobs of scripts spawned concurrently by a pool of spawner
+ *    threads (-j N, 0 for none), see spawner.h
+ * -- event tracing into a Chrome JSON trace (--trace FILE), see trace.h
  *
  * Mini POSIX Shell built-in commands:
- * -- jobs - prints all background jobs
+ * -- jobs - prints all background jobs (or jobs %N, PID)
  * -- cd   - change working directory
+ * -- hash - prints (-r forgets) remembered locations of commands
+ * -- type - describes how a name would be interpreted as a command
+ * -- pipesize - sets (prints) pipe buffer size of the following pipelines
+ * -- split - splits argument lists too long for exec over several
+ *    invocations of the command, see argsplit.h
+ * -- parallel - runs a command for every input line, N at once
+ * -- wait - waits for background jobs to finish
  * -- exit - exits the shell
+ * -- stats - prints (-r resets) latency percentiles of the command phases,
+ *    see stats.h
+ * -- time - reports the resource usage of every stage of a foreground
+ *    command and the shell overhead, see timing.h
+ * -- echo, true, false, test/[, pwd, printf, kill - utilities run without
+ *    a fork (spawned from PATH when started in background), see builtins.h
  *
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #ifndef _REENTRANT
 #  define _REENTRANT
 #endif
@@ -43,17 +74,66 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
 #include <pthread.h>
+#include <getopt.h>
 #include "shell.h"
+#include "spawn.h"
+#include "path.h"
+#include "parse.h"
+#include "builtins.h"
+#include "timing.h"
+#include "spawner.h"
+#include "argsplit.h"
+
+
+/* Built-in commands: name, its first two bytes for BUILTIN_SLOT() ('\0'
+ * for a one byte name), the function and flags (see builtins.h). */
+#define BUILTINS(X) \
+	X("exit",     'e', 'x',  exit_cmd,     BUILTIN_SYNC) \
+	X("jobs",     'j', 'o',  jobs_cmd,     BUILTIN_SYNC) \
+	X("cd",       'c', 'd',  cd_cmd,       BUILTIN_SYNC) \
+	X("hash",     'h', 'a',  hash_cmd,     0) \
+	X("type",     't', 'y',  type_cmd,     0) \
+	X("pipesize", 'p', 'i',  pipesize_cmd, BUILTIN_SYNC) \
+	X("split",    's', 'p',  split_cmd,    0) \
+	X("parallel", 'p', 'a',  parallel_cmd, BUILTIN_OWN_REDIR) \
+	X("wait",     'w', 'a',  wait_cmd,     BUILTIN_SYNC) \
+	X("echo",     'e', 'c',  echo_cmd,     BUILTIN_UTIL) \
+	X("true",     't', 'r',  true_cmd,     BUILTIN_UTIL) \
+	X("false",    'f', 'a',  false_cmd,    BUILTIN_UTIL) \
+	X("test",     't', 'e',  test_cmd,     BUILTIN_UTIL) \
+	X("[",        '[', '\0', test_cmd,     BUILTIN_UTIL) \
+	X("pwd",      'p', 'w',  pwd_cmd,      BUILTIN_UTIL) \
+	X("printf",   'p', 'r',  printf_cmd,   BUILTIN_UTIL) \
+	X("kill",     'k', 'i',  kill_cmd,     BUILTIN_UTIL|BUILTIN_SYNC) \
+	X("time",     't', 'i',  time_cmd,     BUILTIN_PREFIX) \
+	X("stats",    's', 't',  stats_cmd,    0)
+
+#define BUILTIN_DECL(name, c0, c1, fn, fl) int fn(void);
+#define BUILTIN_ENTRY(name, c0, c1, fn, fl) \
+	[BUILTIN_SLOT(c0, c1, sizeof(name) - 1)] = { name, fn, fl },
+/* the slots summed and or-ed together differ if two names collide */
+#define BUILTIN_SUM(name, c0, c1, fn, fl) \
+	+ (1ULL << BUILTIN_SLOT(c0, c1, sizeof(name) - 1))
+#define BUILTIN_OR(name, c0, c1, fn, fl) \
+	| (1ULL << BUILTIN_SLOT(c0, c1, sizeof(name) - 1))
+
+BUILTINS(BUILTIN_DECL)
+
+/* built-in commands indexed by the perfect hash of their names */
+const struct builtin builtin_tab[BUILTIN_SLOTS] = { BUILTINS(BUILTIN_ENTRY) };
+
+_Static_assert((0 BUILTINS(BUILTIN_SUM)) == (0 BUILTINS(BUILTIN_OR)),
+               "two built-in names hash to the same BUILTIN_SLOT()");
 
 
-int is_space(char c)
-{
-	if (c == ' ' || c == '\t')
-		return 1;
-	return 0;
-}
-
 /* Sets exit_flag to the value specified as the argument. */
 void set_exit_flag(int flag)
 {
@@ -74,456 +154,1707 @@ int is_exit_flag(void)
 	return flag;
 }
 
-/* Input thread monitor: allows to execute content in args. */
-void monitor_args_execute(void)
+/* Tokenizes shell input of length len into the queue slot s (see parse.h
+ * for the syntax). The strings of the command point into buf, or into a
+ * copy of it in the slot arena if copy is set. A syntax error is stored
+ * in the slot to be reported by the exec thread in order with the output
+ * of the preceding commands. Returns 0 on success, -1 if there is not
+ * enough memory.
+ */
+int create_args(struct cmdq_slot *s, char *buf, size_t len, int copy)
 {
-	pthread_mutex_lock(&mtx);
-	exec_args = 1;
-	pthread_cond_signal(&cond);
-	pthread_mutex_unlock(&mtx);
+	struct timespec t0;
+	uint64_t tt;
+	int rv;
+
+	if (copy) {
+		buf = arena_strndup(&s->arena, buf, len);
+		if (buf == NULL) {
+			fprintf(stderr, "Not enough memory!\n");
+			return -1;
+		}
+	}
+
+	tt = trace_begin();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	rv = parse_line(buf, len, &s->arena, &s->cmd, &s->err);
+	clock_gettime(CLOCK_MONOTONIC, &s->parsed);
+	s->parse_ns = time_ns(&t0, &s->parsed);
+	stats_add(STATS_PARSE, s->parse_ns);
+	trace_end("parse", tt, "words", s->cmd.argc);
+	if (rv == -1) {
+		fprintf(stderr, "Not enough memory!\n");
+		return -1;
+	}
+	if (rv == 1)
+		s->kind = CMDQ_SYNTAX;
+
+	return 0;
 }
 
-/* Input thread monitor: waits on exec thread to finish execution. */
-void monitor_args_wait_finished(void)
+/* Clears the global variables describing the executed command. */
+void clear_args(void)
 {
-	pthread_mutex_lock(&mtx);
-	while (exec_args != 0)
-		pthread_cond_wait(&cond, &mtx);
-	pthread_mutex_unlock(&mtx);
+	args = NULL;
+	argsc = 0;
+
+	redir_t = NULL;
+	redir_f = NULL;
 }
 
-/* Exec thread monitor: waits on input thread to fill in the args. */
-void monitor_args_wait_executable(void)
+/* Returns the built-in command name, or NULL if there is none. */
+const struct builtin *builtin_find(const char *name)
 {
-	pthread_mutex_lock(&mtx);
-	while (exec_args != 1)
-		pthread_cond_wait(&cond, &mtx);
-	pthread_mutex_unlock(&mtx);
+	const struct builtin *b;
+	size_t len = strlen(name);
+
+	if (len == 0)
+		return NULL;
+	b = &builtin_tab[BUILTIN_SLOT((unsigned char)name[0],
+	                              (unsigned char)name[1], len)];
+	if (b->name == NULL || strcmp(b->name, name) != 0)
+		return NULL;
+
+	return b;
 }
 
-/* Exec thread monitor: allows input thread to work with args. */
-void monitor_args_executed(void)
+/* Returns 1 if name is a shell built-in command, otherwise 0. */
+int is_builtin(const char *name)
 {
-	pthread_mutex_lock(&mtx);
-	exec_args = 0;
-	pthread_cond_signal(&cond);
-	pthread_mutex_unlock(&mtx);
+	return builtin_find(name) != NULL;
 }
 
-/* Processes shell input and fills the global variable args in format suitable
- * for execvp() function. Returns:
- *  0 - input processed and filled args
- *  1 - input processing error
- * -1 - memory allocation error
- */
-int create_args(char *buf)
+/* exit [N] - exits the shell with status N (the last one by default). */
+int exit_cmd(void)
 {
-	int i, j;
-	char *ptr, *bptr;
+	if (args[1] != NULL)
+		last_status = atoi(args[1]) & 0xff;
 
-	run_bg = 0;
+	return BUILTIN_EXIT;
+}
 
-	/* skip beginning whitespaces */
-	bptr = ptr = buf;
-	while (is_space(*ptr)) {
-		ptr++;
-		bptr = ptr;
-	}
-	/* preprocessing: count the number of arguments including
-	 * filename (argsc) */
-	argsc = 1;
-	i = 0;
-	while (*ptr != '\0') {
-		if (is_space(*ptr)) {
-			/* argument too long */
-			if (i >= MAXARG) {
-				fprintf(stderr, "Argument too long!\n");
-				return 1;
-			}
-			/* IO redirection */
-			if (*bptr == '>' || *bptr == '<') {
-				bptr++;
-				if (is_space(*bptr)) {
-					fprintf(stderr, "No whitespaces after "
-					        "'%c' operator!\n", *(--bptr));
-					return 1;
-				}
+/* cd DIR - changes the working directory, a fatal chdir error exits the
+ * shell. */
+int cd_cmd(void)
+{
+	int rv;
+
+	rv = change_cwd();
+	if (rv == 0) {
+		path_cwd_changed();
+		zygote_cwd_changed();
+	}
+
+	return (rv == -1) ? BUILTIN_EXIT : rv;
+}
+
+/* time - prefix timing the command which follows (see run_command()),
+ * alone there is nothing to time. */
+int time_cmd(void)
+{
+	fprintf(stderr, "time: usage: time COMMAND [ARG...]\n");
+
+	return 2;
+}
+
+/* hash [-r] [NAME...] - prints the remembered command locations, forgets
+ * them all (-r) or looks up and remembers NAMEs. Returns 0 on success,
+ * 1 if some NAME was not found. */
+int hash_cmd(void)
+{
+	char path[PATH_MAX];
+	int i = 1, rv = 0;
+
+	if (args[i] != NULL && strcmp(args[i], "-r") == 0) {
+		path_rehash();
+		i++;
+	} else if (args[i] == NULL) {
+		path_print(builtin_out);
+		return 0;
+	}
+
+	for (; args[i] != NULL; i++) {
+		if (strchr(args[i], '/') != NULL || is_builtin(args[i]))
+			continue;
+		if (path_lookup(args[i], path, sizeof(path), NULL) != 0) {
+			fprintf(stderr, "hash: %s: not found\n", args[i]);
+			rv = 1;
+		}
+	}
+
+	return rv;
+}
 
-			} else if (*bptr == '&') {
-				run_bg = 1;
-				bptr--;
-				while (is_space(*bptr))
-					bptr--;
-				bptr++;
-				*bptr = '\0';
-				argsc--;
+/* type NAME... - describes how each NAME would be interpreted as a command.
+ * Returns 0 on success, 1 if some NAME was not found. */
+int type_cmd(void)
+{
+	const struct builtin *b;
+	char path[PATH_MAX];
+	int i, rv = 0;
+
+	for (i = 1; args[i] != NULL; i++) {
+		if ((b = builtin_find(args[i])) != NULL) {
+			fprintf(builtin_out, "%s is a shell %s\n", args[i],
+			        (b->flags & BUILTIN_PREFIX) ? "keyword" :
+			                                      "builtin");
+		} else if (strchr(args[i], '/') != NULL) {
+			if (access(args[i], X_OK) == 0) {
+				fprintf(builtin_out, "%s is %s\n", args[i],
+				        args[i]);
 			} else {
-				argsc++;
+				fprintf(stderr, "type: %s: not found\n", args[i]);
+				rv = 1;
 			}
-			i = -1;
-			bptr = ptr + 1;
+		} else if (path_hashed(args[i], path, sizeof(path))) {
+			fprintf(builtin_out, "%s is hashed (%s)\n", args[i],
+			        path);
+		} else if (path_lookup(args[i], path, sizeof(path), NULL) == 0) {
+			fprintf(builtin_out, "%s is %s\n", args[i], path);
+		} else {
+			fprintf(stderr, "type: %s: not found\n", args[i]);
+			rv = 1;
+		}
+	}
+
+	return rv;
+}
+
+/* Prints the exit status of a finished background job. */
+void print_status(const struct job_done *d)
+{
+	int status = d->status;
+
+	if (WIFEXITED(status)) {
+		if (WEXITSTATUS(status) != 0)
+			printf("\n[%d]+ Exit %d\t%s\n", d->num,
+			       WEXITSTATUS(status), d->cmdline);
+		else
+			printf("\n[%d]+ Done\t%s\n", d->num, d->cmdline);
+	} else if (WIFSIGNALED(status)) {
+		printf("\n[%d]+ Killed\t%s\n", d->num, d->cmdline);
+	} else if (WIFSTOPPED(status)) {
+		printf("\n[%d]+ Stopped\t%s\n", d->num, d->cmdline);
+	} else {
+		printf("\n[%d]+ Terminated\t%s\n", d->num, d->cmdline);
+	}
+}
+
+/* Writes text s of the prompt (e.g. "\n$ " after ctrl+c) if the shell is
+ * interactive. The output buffered in stdout goes first, s itself is a
+ * single write(2), so the prompts printed by the exec, input and signal
+ * threads are never split by each other's output. */
+void prompt_write(const char *s)
+{
+	size_t len = strlen(s);
+	ssize_t n;
+
+	fflush(stdout);
+	if (!interactive || len == 0)
+		return;
+	do {
+		n = write(STDOUT_FILENO, s, len);
+	} while (n == -1 && errno == EINTR);
+}
 
-			/* skip whitespaces */
-			while (is_space(*ptr)) {
-				ptr++;
-				bptr = ptr;
+/* Prints the prompt if the shell is interactive. */
+void prompt(void)
+{
+	prompt_write("$ ");
+}
+
+/* Prints the continuation prompt, the command goes on on the next line. */
+void prompt_more(void)
+{
+	prompt_write("> ");
+}
+
+/* Reaps the finished background jobs and prints their notices. */
+void reap_jobs(void)
+{
+	struct job_done done[JOBS_EVENTS];
+	uint64_t t0 = trace_begin();
+	int i, n, total = 0;
+
+	/* coalesced signals: jobs_reap() drains all finished processes */
+	while ((n = jobs_reap(&jobs, done, JOBS_EVENTS)) > 0) {
+		total += n;
+		for (i = 0; i < n && interactive; i++)
+			print_status(&done[i]);
+		if (interactive)
+			prompt_write(cmdq_busy(&cmdq) || loop_busy ? "" : "$ ");
+	}
+	trace_end("reap", t0, "jobs", total);
+}
+
+/* Event loop: handles the signals queued on loop_sfd. Returns 1 if SIGINT
+ * was received, otherwise 0. */
+int loop_signals(void)
+{
+	struct signalfd_siginfo si[8];
+	uint64_t t0;
+	ssize_t n;
+	int i, intr = 0;
+
+	while ((n = read(loop_sfd, si, sizeof(si))) > 0) {
+		for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++) {
+			t0 = trace_begin();
+			switch (si[i].ssi_signo) {
+				case SIGINT:  /* ctrl+c */
+					if (!interactive)
+						exit(128 + SIGINT);
+					intr = 1;
+					/* fall through */
+				case SIGTSTP: /* ctrl+z */
+					if (!interactive)
+						break;
+					prompt_write(loop_busy ? "\n" : "\n$ ");
+					break;
+				case SIGCHLD: /* jobs without a pidfd */
+					reap_jobs();
+					break;
+				case SIGTERM:
+				case SIGHUP:
+					if (!interactive)
+						exit(128 + si[i].ssi_signo);
+					break;
+				default:
+					break;
 			}
-			ptr--;
+			trace_end("signal", t0, "signo", si[i].ssi_signo);
 		}
-		ptr++;
-		i++;
 	}
-	/* cases where we have only one argument and it is too long */
-	if (i >= MAXARG) {
-		fprintf(stderr, "Argument too long!\n");
-		return 1;
+
+	return intr;
+}
+
+/* Event loop: waits until job num (all jobs if num is 0) has finished,
+ * reaping the jobs in place of the signal thread. Returns 0, or -1 if the
+ * wait was interrupted by ctrl+c. */
+int loop_wait(int num)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = jobs.epfd;
+	pfd[1].fd = loop_sfd;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (jobs_running(&jobs, num)) {
+		/* jobs without a pidfd are looked at every 10 ms without
+		 * SIGCHLD (io_uring loop) */
+		if (poll(pfd, 2, jobs.nopidfd > 0 ? 10 : -1) == -1 &&
+		    errno != EINTR) {
+			perror("poll");
+			return -1;
+		}
+		if (loop_signals())
+			return -1;
+		reap_jobs();
 	}
-	/* cases when the last argument has redirection operator */
-	if ((argsc > 1) && (*bptr == '>' || *bptr == '<'))
-		argsc--;
-	/* background job, line ends with '&' so we remove it */
-	if (argsc > 1 && *bptr == '&') {
-		run_bg = 1;
-		bptr--;
-		while (is_space(*bptr))
-			bptr--;
-		bptr++;
-		*bptr = '\0';
-		argsc--;
-	} else { /* removes trailing whitespace */
-		ptr--;
-		while (is_space(*ptr))
-			ptr--;
-		ptr++;
-		*ptr = '\0';
-	}
-
-	/* args must be NULL terminated, we must count also NULL member */
-	argsc++;
-
-
-	/* allocate memory for arguments */
-	args = calloc(argsc, sizeof(char *));
-	if (args == NULL) {
-		fprintf(stderr, "Not enough memory!\n");
+
+	return 0;
+}
+
+/* jobs [%N|PID...] - prints all background jobs or the given ones.
+ * Returns 0 on success, 1 if some job was not found. */
+int jobs_cmd(void)
+{
+	char *end;
+	long num;
+	int i, rv = 0;
+
+	if (args[1] == NULL)
+		return jobs_print(&jobs, 0, builtin_out);
+
+	for (i = 1; args[i] != NULL; i++) {
+		if (args[i][0] == '%') {
+			num = strtol(args[i] + 1, &end, 10);
+		} else {
+			num = strtol(args[i], &end, 10);
+			if (*end == '\0' && num > 0 && num <= INT_MAX)
+				num = jobs_find(&jobs, num);
+		}
+		if (*end != '\0' || num <= 0 || num > INT_MAX ||
+		    jobs_print(&jobs, num, builtin_out) != 0) {
+			fflush(builtin_out);
+			fprintf(stderr, "jobs: %s: no such job\n", args[i]);
+			rv = 1;
+		}
+	}
+
+	return rv;
+}
+
+/* io_uring event loop: user_data of the requests whose completions are
+ * ignored and of the polls, other requests carry the address of the int
+ * receiving their result */
+enum {
+	URING_IGNORE = 0,
+	URING_SIG,    /* poll of loop_sfd */
+	URING_JOBS    /* poll of the epoll descriptor of the job table */
+};
+
+/* io_uring event loop: queues a one-shot poll of fd for input, tag is the
+ * user_data of its completion. Returns 0, or -1 on error. */
+int uring_poll(int fd, int tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(&ring);
+	if (sqe == NULL)
 		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll_events = POLLIN;
+	sqe->user_data = tag;
+
+	return 0;
+}
+
+/* io_uring event loop: returns a queued SQE whose result is stored in res
+ * on completion (see uring_settle()), or NULL on error. */
+struct io_uring_sqe *uring_req(int *res)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(&ring);
+	if (sqe == NULL)
+		return NULL;
+	sqe->user_data = (uintptr_t)res;
+	uring_inflight++;
+
+	return sqe;
+}
+
+/* io_uring event loop: consumes the available completions. Fired polls are
+ * only noted, they are handled by uring_events(). */
+void uring_reap(void)
+{
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_cqe(&ring)) != NULL) {
+		switch (cqe->user_data) {
+			case URING_IGNORE:
+				break;
+			case URING_SIG:
+				uring_sig = 1;
+				break;
+			case URING_JOBS:
+				uring_jobs = 1;
+				break;
+			default:
+				*(int *)(uintptr_t)cqe->user_data = cqe->res;
+				uring_inflight--;
+				break;
+		}
+		uring_seen(&ring);
 	}
-	for (i = 0; i < argsc-1; i++) {
-		args[i] = calloc(MAXARG, sizeof(char));
-		if (args[i] == NULL) {
-			fprintf(stderr, "Not enough memory!\n");
+}
+
+/* io_uring event loop: submits the queued requests and waits until all
+ * requests with results have completed. Returns 0, or -1 on error. */
+int uring_settle(void)
+{
+	uring_reap();
+	while (uring_inflight > 0) {
+		if (uring_submit(&ring, uring_inflight) == -1 &&
+		    errno != EINTR) {
+			perror("io_uring_enter");
 			return -1;
 		}
+		uring_reap();
 	}
 
-	/* fills in the args variable with shell input */
-	bptr = ptr = buf;
-	while (is_space(*ptr)) {
-		ptr++;
-		bptr = ptr;
-	}
-	i = j = 0;
-	while (*ptr != '\0') {
-		if (is_space(*ptr)) {
-			if (*bptr == '>') {
-				bptr++;
-				memcpy(redir_t, bptr, j);
-				redir_t[j-1] = '\0';
-			} else if (*bptr == '<') {
-				bptr++;
-				memcpy(redir_f, bptr, j);
-				redir_f[j-1] = '\0';
-			} else {
-				memcpy(args[i], bptr, j);
-				i++;
+	return 0;
+}
+
+/* io_uring event loop: handles the signals and finished jobs whose polls
+ * have fired and arms the polls again. Jobs without a pidfd (descriptor
+ * limit reached) are looked at too, SIGCHLD is not watched. */
+void uring_events(void)
+{
+	if (uring_sig) {
+		uring_sig = 0;
+		loop_signals();
+		uring_poll(loop_sfd, URING_SIG);
+	}
+	if (uring_jobs || jobs.nopidfd > 0) {
+		if (uring_jobs)
+			uring_poll(jobs.epfd, URING_JOBS);
+		uring_jobs = 0;
+		reap_jobs();
+	}
+}
+
+/* Waits until job num (all jobs if num is 0) has finished. Returns 0, or
+ * -1 if interrupted. */
+int wait_job(int num)
+{
+	if (loop_mode == LOOP_THREADS)
+		return jobs_wait(&jobs, num);
+	return loop_wait(num);
+}
+
+/* wait [%N|PID...] - waits until all background jobs or the given ones
+ * finish. Returns 0 on success, 127 if some job was not found or 130 if
+ * the wait was interrupted. */
+int wait_cmd(void)
+{
+	char *end;
+	long num;
+	int i, rv = 0;
+
+	if (args[1] == NULL)
+		return (wait_job(0) == -1) ? 130 : 0;
+
+	for (i = 1; args[i] != NULL; i++) {
+		if (args[i][0] == '%') {
+			num = strtol(args[i] + 1, &end, 10);
+		} else {
+			num = strtol(args[i], &end, 10);
+			if (*end == '\0' && num > 0 && num <= INT_MAX)
+				num = jobs_find(&jobs, num);
+		}
+		if (*end != '\0' || num <= 0 || num > INT_MAX) {
+			fprintf(stderr, "wait: %s: no such job\n", args[i]);
+			rv = 127;
+		} else if (wait_job(num) == -1) {
+			return 130;
+		}
+	}
+
+	return rv;
+}
+
+/* pipesize [BYTES] - sets the pipe buffer size of the following pipelines
+ * (0 keeps the kernel default) or prints the current one. Returns 0 on
+ * success, 1 on invalid size. */
+int pipesize_cmd(void)
+{
+	char *end;
+	long size;
+
+	if (args[1] == NULL) {
+		fprintf(builtin_out, "%d\n", pipe_size);
+		return 0;
+	}
+	size = strtol(args[1], &end, 10);
+	if (*end != '\0' || end == args[1] || size < 0 || size > INT_MAX) {
+		fprintf(stderr, "pipesize: %s: invalid size\n", args[1]);
+		return 1;
+	}
+	pipe_size = size;
+
+	return 0;
+}
+
+/* split [-j N] [-k KEEP] | off - splits the argument lists of the
+ * following foreground commands which are too long for exec over several
+ * invocations, N (at most SPLIT_JOBS_MAX) of them run at once (1, one
+ * after another, by default), the first KEEP words (the command name and
+ * its options by default) are repeated in every invocation (see
+ * argsplit.h); off stops splitting. Without arguments the setting is
+ * printed. Returns 0 on success, 2 on invalid option. */
+int split_cmd(void)
+{
+	int i, jobs = 1, keep = -1;
+	char *end;
+	long n;
+
+	if (args[1] == NULL) {
+		if (split_jobs == 0)
+			fprintf(builtin_out, "split off\n");
+		else if (split_keep == -1)
+			fprintf(builtin_out, "split -j %d\n", split_jobs);
+		else
+			fprintf(builtin_out, "split -j %d -k %d\n", split_jobs,
+			        split_keep);
+		return 0;
+	}
+	if (args[2] == NULL && strcmp(args[1], "off") == 0) {
+		split_jobs = 0;
+		return 0;
+	}
+
+	for (i = 1; args[i] != NULL; i += 2) {
+		if ((strcmp(args[i], "-j") != 0 && strcmp(args[i], "-k") != 0) ||
+		    args[i + 1] == NULL) {
+			fprintf(stderr, "Usage: split [-j N] [-k KEEP] | off\n");
+			return 2;
+		}
+		n = strtol(args[i + 1], &end, 10);
+		if (*end != '\0' || end == args[i + 1] || n < 0 ||
+		    n > INT_MAX || (args[i][1] == 'j' &&
+		                    (n == 0 || n > SPLIT_JOBS_MAX))) {
+			fprintf(stderr, "split: %s: invalid number\n",
+			        args[i + 1]);
+			return 2;
+		}
+		if (args[i][1] == 'j')
+			jobs = n;
+		else
+			keep = n;
+	}
+	split_jobs = jobs;
+	split_keep = keep;
+
+	return 0;
+}
+
+/* stats [-t] | -r - prints the latency percentiles of the phases of the
+ * commands run so far (see stats.h), merged or per thread (-t); -r starts
+ * counting again. Returns 0, 2 on invalid option. */
+int stats_cmd(void)
+{
+	int i, threads = 0, reset = 0;
+
+	for (i = 1; args[i] != NULL; i++) {
+		if (strcmp(args[i], "-r") == 0) {
+			reset = 1;
+		} else if (strcmp(args[i], "-t") == 0) {
+			threads = 1;
+		} else {
+			fprintf(stderr, "Usage: stats [-t] | -r\n");
+			return 2;
+		}
+	}
+	if (reset)
+		stats_reset();
+	else
+		stats_print(builtin_out, threads);
+
+	return 0;
+}
+
+/* Input thread: reads and parses the input and queues the commands for
+ * the exec thread. Non-interactive input is parsed ahead while the exec
+ * thread is running the earlier commands, the interactive shell waits for
+ * every command to finish before it prints the next prompt. */
+void *input_start(void *arg)
+{
+	struct cmdq_slot *s;
+	ssize_t n;
+	char *cmd_buf;
+	void *rv = 0;
+	/* lines of the read buffer do not survive the next reader_line(),
+	 * queued ones are copied (mapped scripts stay in place) */
+	int copy = !interactive && input.mapped == 0;
+
+	stats_register("input");
+	trace_register("input");
+	prompt();
+
+	/* read lines from stdin */
+	while ((n = reader_line(&input, &cmd_buf)) != READER_EOF) {
+		if (n == READER_ERROR) {
+			perror("read");
+			fflush(stderr);
+			rv = (void *)1;
+			break;
+		}
+
+		s = cmdq_reserve(&cmdq);
+		if (s == NULL)  /* exec thread has exited */
+			return 0;
+
+		if (n == READER_TOOLONG) {
+			s->kind = CMDQ_TOOLONG;
+		} else {
+			/* constructs args variable for execvp */
+			if (create_args(s, cmd_buf, n, copy) == -1) {
+				fflush(stderr);
+				break;
+			}
+			if (s->kind == CMDQ_RUN && s->cmd.argc == 0) {
+				/* empty line */
+				prompt_write("\r$ ");
+				continue;
 			}
-			j = -1;
-			bptr = ptr + 1;
+		}
+
+		/* signal the exec thread to execute the command */
+		cmdq_push(&cmdq);
+		/* wait until execution is finished, the exec thread prints
+		 * the next prompt */
+		if (interactive && cmdq_wait(&cmdq, 0) == -1)
+			return 0;
+	}
+
+	if (interactive)
+		printf("\n");
+	fflush(stdout);
+
+	/* signal exec thread to exit */
+	s = cmdq_reserve(&cmdq);
+	if (s != NULL) {
+		s->kind = CMDQ_END;
+		cmdq_push(&cmdq);
+	}
+
+	return rv;
+}
+
+/* If target argument is STDOUT_FILENO (STDIN_FILENO) the file specified
+ * in global variable redir_t (redir_f) is opened for the stdout (stdin) of
+ * the process to be spawned. On success, the file descriptor of redirection
+ * file is returned (close-on-exec, spawn_file() dups it into place),
+ * otherwise -1 indicating error. */
+int redir_file(int target)
+{
+	int fd;
+
+	if (target == STDOUT_FILENO)
+		fd = open(redir_t, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC,
+		          S_IRUSR|S_IWUSR);
+	else
+		fd = open(redir_f, O_CREAT|O_RDONLY|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if (fd == -1)
+		perror("open");
+
+	return fd;
+}
+
+/* Opens the redirection files of the command to be spawned (see
+ * redir_file()) and stores the descriptors in fd_out and fd_in, the ones
+ * without redirection are left alone. The io_uring loop opens both files
+ * with one submission. Returns 0 on success, -1 if some file could not be
+ * opened (the other one is closed). */
+int redir_files(int *fd_out, int *fd_in)
+{
+	struct io_uring_sqe *sqe;
+	int res[2] = { -1, -1 };
 
-			/* skip whitespaces */
-			while (is_space(*ptr)) {
-				ptr++;
-				bptr = ptr;
+	if (loop_mode != LOOP_URING) {
+		if (redir_t != NULL) {
+			*fd_out = redir_file(STDOUT_FILENO);
+			if (*fd_out == -1)
+				return -1;
+		}
+		if (redir_f != NULL) {
+			*fd_in = redir_file(STDIN_FILENO);
+			if (*fd_in == -1) {
+				if (redir_t != NULL)
+					close(*fd_out);
+				return -1;
 			}
-			ptr--;
-		}
-		ptr++;
-		j++;
-	}
-	/* last argument or only one argument */
-	if (*bptr == '>') {
-		bptr++;
-		memcpy(redir_t, bptr, j);
-		redir_t[j-1] = '\0';
-		args[i] = NULL;
-	} else if (*bptr == '<') {
-		bptr++;
-		memcpy(redir_f, bptr, j);
-		redir_f[j-1] = '\0';
-		args[i] = NULL;
+		}
+		return 0;
+	}
+
+	if (redir_t != NULL) {
+		sqe = uring_req(&res[0]);
+		if (sqe == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)redir_t;
+		sqe->open_flags = O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC;
+		sqe->len = S_IRUSR|S_IWUSR;
+	}
+	if (redir_f != NULL) {
+		sqe = uring_req(&res[1]);
+		if (sqe == NULL) {
+			/* the open of redir_t is queued with its result on
+			 * the stack, it has to complete first */
+			if (uring_settle() == 0 && res[0] >= 0)
+				close(res[0]);
+			return -1;
+		}
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)redir_f;
+		sqe->open_flags = O_CREAT|O_RDONLY|O_CLOEXEC;
+		sqe->len = S_IRUSR|S_IWUSR;
+	}
+	if (uring_settle() == -1)
+		return -1;
+	if ((redir_t != NULL && res[0] < 0) || (redir_f != NULL && res[1] < 0)) {
+		errno = -((redir_t != NULL && res[0] < 0) ? res[0] : res[1]);
+		perror("open");
+		if (res[0] >= 0)
+			close(res[0]);
+		if (res[1] >= 0)
+			close(res[1]);
+		return -1;
+	}
+	if (redir_t != NULL)
+		*fd_out = res[0];
+	if (redir_f != NULL)
+		*fd_in = res[1];
+
+	return 0;
+}
+
+/* Closes the redirection file descriptor fd after the spawn. The io_uring
+ * loop queues the close to be submitted with the wait for the command. */
+void redir_close(int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	if (loop_mode == LOOP_URING) {
+		sqe = uring_sqe(&ring);
+		if (sqe != NULL) {
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = fd;
+			sqe->user_data = URING_IGNORE;
+			/* no completion to wake up the wait (Linux 5.17) */
+			if (ring.features & IORING_FEAT_CQE_SKIP)
+				sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+			return;
+		}
+	}
+	close(fd);
+}
+
+/* Spawns file sa->path, which exec refused with ENOEXEC (no #! line), as
+ * a script of /bin/sh with the arguments in args, as execvp() does.
+ * Returns 0, or the error number of the spawn. */
+int spawn_sh(pid_t *cpid, struct spawn_attr *sa)
+{
+	char **argv;
+	int i, n, rc;
+
+	for (n = 0; args[n] != NULL; n++)
+		;
+	argv = malloc((n + 2) * sizeof(char *));
+	if (argv == NULL)
+		return ENOMEM;
+	argv[0] = "/bin/sh";
+	argv[1] = (char *)sa->path;
+	for (i = 1; i <= n; i++)
+		argv[i + 1] = args[i];
+	sa->path = argv[0];
+	rc = spawn_file(cpid, argv, sa);
+	free(argv);
+
+	return rc;
+}
+
+/* Spawns the file in args[0] with stdin fd_in and stdout fd_out (-1 to
+ * inherit, file redirection of the command takes precedence) in process
+ * group pgid (see struct spawn_attr). On success, 0 is returned and the
+ * pid is stored in cpid, otherwise -1 if a redirection file could not be
+ * opened (reported) or the error number of the spawn. */
+int spawn_args(int fd_in, int fd_out, pid_t pgid, pid_t *cpid)
+{
+	struct spawn_attr sa;
+	struct timespec t0;
+	uint64_t tt;
+	char path[PATH_MAX];
+	int rc, hashed = 0;
+
+	spawn_attr_init(&sa);
+	/* new process has all signals unblocked except SIGTSTP */
+	sigaddset(&sa.mask, SIGTSTP);
+	if (run_bg)
+		sigaddset(&sa.mask, SIGINT);
+	sa.pgid = pgid;
+	sa.fd_in = fd_in;
+	sa.fd_out = fd_out;
+
+	/* IO redirection */
+	if (redir_files(&sa.fd_out, &sa.fd_in) == -1)
+		return -1;
+	if (redir_f == NULL && fd_in == -1 && run_bg && !interactive) {
+		/* without job control background jobs read /dev/null */
+		if (devnull_fd == -1)
+			devnull_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+		sa.fd_in = devnull_fd;
+	}
+
+	/* PATH lookup goes through the hash table, names containing '/'
+	 * are executed as they are */
+	if (strchr(args[0], '/') == NULL) {
+		rc = path_lookup(args[0], path, sizeof(path), &hashed);
+		if (rc == 0)
+			sa.path = path;
 	} else {
-		memcpy(args[i], bptr, j);
-		args[i+1] = NULL;
+		rc = 0;
+	}
+
+	if (rc == 0) {
+		stats_now(&t0);
+		tt = trace_begin();
+		rc = spawn_file(cpid, args, &sa);
+		stats_lap(STATS_SPAWN, &t0);
+		trace_end("spawn", tt, "pid", rc == 0 ? *cpid : -rc);
+		/* the file vanished behind the back of the cache, retry */
+		if (rc == ENOENT && hashed) {
+			path_forget(args[0]);
+			rc = path_lookup(args[0], path, sizeof(path), NULL);
+			if (rc == 0)
+				rc = spawn_file(cpid, args, &sa);
+		}
+		if (rc == ENOEXEC && sa.path != NULL)
+			rc = spawn_sh(cpid, &sa);
 	}
+	if (redir_t != NULL)
+		redir_close(sa.fd_out);
+	if (redir_f != NULL)
+		redir_close(sa.fd_in);
+
+	return rc;
+}
+
+/* Reports error rc of spawn_args() for the command in args[0]. Returns the
+ * exit status of the command (1, 126 or 127). */
+int spawn_error(int rc)
+{
+	if (rc == -1)
+		return 1;
+	if (rc == ENOENT)
+		fprintf(stderr, "%s: command not found...\n", args[0]);
+	else
+		fprintf(stderr, "%s: %s\n", args[0], strerror(rc));
+	fflush(stderr);
+
+	return (rc == ENOENT) ? 127 : 126;
+}
+
+/* Like spawn_args(), the error is reported. Returns 0 on success,
+ * otherwise the exit status of the command (1, 126 or 127). */
+int spawn_stage(int fd_in, int fd_out, pid_t pgid, pid_t *cpid)
+{
+	int rc;
+
+	rc = spawn_args(fd_in, fd_out, pgid, cpid);
+	if (rc != 0)
+		return spawn_error(rc);
 
 	return 0;
 }
 
-/* Frees the memory occupied by args. */
-void clear_args(void)
+/* Returns the command line of the pipeline cmd rebuilt from the argument
+ * vectors in arena a, or NULL if there is not enough memory. */
+char *command_line(struct command *cmd, struct arena *a)
 {
+	struct command *st;
+	size_t len = 0;
+	char *line, *p;
 	int i;
 
-	for (i = 0; i < argsc; i++)
-		free(args[i]);
-	free(args);
+	for (st = cmd; st != NULL; st = st->pipe)
+		for (i = 0; i < st->argc; i++)
+			len += strlen(st->argv[i]) + 3;
+	line = arena_alloc(a, len + 1);
+	if (line == NULL)
+		return NULL;
+
+	for (p = line, st = cmd; st != NULL; st = st->pipe) {
+		for (i = 0; i < st->argc; i++)
+			p += sprintf(p, "%s%s", (p == line) ? "" : " ",
+			             st->argv[i]);
+		if (st->pipe != NULL)
+			p += sprintf(p, " |");
+	}
 
-	redir_t[0] = '\0';
-	redir_f[0] = '\0';
+	return line;
 }
 
-/* Flushes the rest of an input on stdin if maximum length of input
- * is reached. */
-void flush_input(void)
+/* Waits for the processes pids (-1 for stages which were not spawned) of a
+ * foreground pipeline of n stages. Stores the wait status of the last stage
+ * in status, -1 if it was not spawned. Returns 0, or -1 on error. */
+int wait_stages(pid_t *pids, int n, int *status)
 {
-	int rv, n;
-	char c;
+	pid_t w;
+	int i, st;
 
-	while ((n = read(STDIN_FILENO, &c, 1)) != 0) {
-		if (n < 0) {
-			if (errno == EINTR)
-				continue;
-			else {
-				perror("read");
-				fflush(stderr);
-				/* signal exec thread to exit */
-				set_exit_flag(1);
-				monitor_args_execute();
-				rv = 1;
-				pthread_exit(&rv);
+	*status = -1;
+	for (i = 0; i < n; i++) {
+		if (pids[i] == -1)
+			continue;
+		w = waitpid(pids[i], &st, 0);
+		if (w == -1 && errno != ECHILD) {
+			perror("waitpid");
+			return -1;
+		} else if (w > 0 && i == n - 1) {
+			*status = st;
+		}
+	}
+
+	return 0;
+}
+
+/* Like wait_stages(), the io_uring loop submits IORING_OP_WAITID for all
+ * the stages (and the queued closes) at once. The siginfo of the stages
+ * is kept in arena a. */
+int uring_wait_stages(pid_t *pids, int n, struct arena *a, int *status)
+{
+	struct io_uring_sqe *sqe;
+	siginfo_t *si;
+	int *res, i;
+
+	si = arena_alloc(a, n * sizeof(siginfo_t));
+	res = arena_alloc(a, n * sizeof(int));
+	if (si == NULL || res == NULL)
+		return wait_stages(pids, n, status);
+
+	for (i = 0; i < n; i++) {
+		if (pids[i] == -1)
+			continue;
+		memset(&si[i], 0, sizeof(siginfo_t));
+		sqe = uring_req(&res[i]);
+		if (sqe == NULL) {
+			perror("io_uring_enter");
+			return -1;
+		}
+		sqe->opcode = URING_OP_WAITID;
+		sqe->fd = pids[i];
+		sqe->len = P_PID;
+		sqe->file_index = WEXITED;
+		sqe->addr2 = (uintptr_t)&si[i];
+	}
+	if (uring_settle() == -1)
+		return -1;
+
+	*status = -1;
+	for (i = 0; i < n; i++) {
+		if (pids[i] == -1)
+			continue;
+		if (res[i] < 0 && res[i] != -ECHILD) {
+			errno = -res[i];
+			perror("waitid");
+			return -1;
+		}
+		if (res[i] == 0 && i == n - 1)
+			*status = jobs_wstatus(&si[i]);
+	}
+
+	return 0;
+}
+
+/* Spawns the stages of pipeline cmd (n of them): every stage is spawned
+ * with its stdout connected to stdin of the next one, pipe ends are closed
+ * as soon as the stages are spawned, so at most three descriptors are open
+ * at once whatever the length of the pipeline. A background pipeline is
+ * one job (process group), its id is stored in pgid. The pids of the
+ * stages (-1 for the ones which were not spawned) are stored in pids, the
+ * exit status of a stage which failed to spawn in status. Returns the
+ * number of processes spawned, n is lowered if a pipe could not be
+ * created. */
+int spawn_pipeline(struct command *cmd, pid_t *pids, int *n, pid_t *pgid,
+                   struct time_job *tj, int *status)
+{
+	struct command *st;
+	int fd_in = -1, next_in, fd_out, p[2];
+	int i, rc, nprocs = 0;
+
+	/* child make itself the process group leader of a background job
+	 * (of its own group - different from shell group) - this will lead
+	 * in SIGTTIN signal when trying to read from stdin which causes
+	 * stopping of child; other stages join the group */
+	*pgid = run_bg ? 0 : -1;
+	for (i = 0, st = cmd; st != NULL; i++, st = st->pipe) {
+		fd_out = next_in = -1;
+		if (st->pipe != NULL) {
+			if (pipe2(p, O_CLOEXEC) == -1) {
+				perror("pipe2");
+				*status = 1;
+				pids[i] = -1;
+				*n = i;
+				break;
+			}
+			/* the size is a hint, errors (EPERM above
+			 * /proc/sys/fs/pipe-max-size) are ignored */
+			if (pipe_size > 0)
+				fcntl(p[1], F_SETPIPE_SZ, pipe_size);
+			fd_out = p[1];
+			next_in = p[0];
+		}
+
+		args = st->argv;
+		argsc = st->argc + 1;
+		redir_t = st->redir_out;
+		redir_f = st->redir_in;
+		rc = spawn_stage(fd_in, fd_out, *pgid, &pids[i]);
+		if (rc == 0) {
+			nprocs++;
+			if (*pgid == 0)
+				*pgid = pids[i];
+			if (tj != NULL)
+				time_spawned(tj, i, pids[i]);
+		} else {
+			pids[i] = -1;
+			*status = rc;
+		}
+
+		if (fd_in != -1)
+			close(fd_in);
+		if (fd_out != -1)
+			close(fd_out);
+		fd_in = next_in;
+	}
+	if (fd_in != -1)
+		close(fd_in);
+
+	return nprocs;
+}
+
+/* Registers the spawned background pipeline cmd (process group pgid, the
+ * pids of its n stages) as a job, its command line and the room for the
+ * pidfds of its stages are taken from arena a.
+ * Returns 0 on success or -1 on error. */
+int add_job(struct command *cmd, struct arena *a, pid_t pgid, pid_t *pids,
+            int n)
+{
+	char *line;
+	int num, *fds;
+
+	line = command_line(cmd, a);
+	if (line == NULL)
+		line = cmd->argv[0];
+	fds = arena_alloc(a, n * sizeof(int));
+	if (fds == NULL) {
+		fprintf(stderr, "Could not allocate memory for job\n");
+		return -1;
+	}
+	num = jobs_insert(&jobs, line, pgid, pids, fds, n);
+	if (num == -1)
+		return -1;
+	if (interactive) {
+		printf("[%d] %d\n", num, pgid);
+		fflush(stdout);
+	}
+	/* the job might have finished before its pidfds were registered,
+	 * make the signal thread look */
+	kill(getpid(), SIGCHLD);
+
+	return 0;
+}
+
+/* Spawner thread: spawns the background pipeline cmd as a job, the pids
+ * are kept in arena a (see spawner.h). Returns 0 on success or -1 on
+ * error. */
+int spawn_job(struct command *cmd, struct arena *a)
+{
+	struct timespec t0;
+	struct command *st;
+	uint64_t tt = trace_begin();
+	pid_t *pids, pgid;
+	int n, nprocs, status;
+
+	stats_now(&t0);
+	for (n = 0, st = cmd; st != NULL; st = st->pipe)
+		n++;
+	pids = arena_alloc(a, n * sizeof(pid_t));
+	if (pids == NULL) {
+		fprintf(stderr, "Not enough memory!\n");
+		return -1;
+	}
+	run_bg = 1;
+	nprocs = spawn_pipeline(cmd, pids, &n, &pgid, NULL, &status);
+	clear_args();
+	if (nprocs == 0)
+		return 0;
+	stats_lap(STATS_EXEC, &t0);
+	trace_end("exec", tt, "stages", nprocs);
+
+	return add_job(cmd, a, pgid, pids, n);
+}
+
+/* Returns the exit status of a command which finished with wait status
+ * st. */
+int exit_status(int st)
+{
+	return WIFSIGNALED(st) ? 128 + WTERMSIG(st) : WEXITSTATUS(st);
+}
+
+/* Runs the foreground command cmd (not a pipeline) with its trailing
+ * arguments split over as many invocations as exec needs (see
+ * argsplit.h), split_jobs of them at once; the redirections are opened
+ * once for all of them. The argument vectors and pids are kept in arena
+ * a, last_status is set to the highest exit status of the invocations.
+ * Returns 0 on success or -1 on error. */
+int split_run(struct command *cmd, struct arena *a)
+{
+	struct timespec t0;
+	uint64_t tt = trace_begin();
+	char **argv;
+	pid_t *pids;
+	long limit = split_limit(), used = 0;
+	int fd_out = -1, fd_in = -1, keep, start, end, i, rc, st;
+	int head = 0, running = 0, n = 0, status = 0, stop = 0;
+
+	stats_now(&t0);
+	keep = split_prefix(cmd->argv, cmd->argc);
+	for (i = 0; i < keep; i++)
+		used += split_cost(cmd->argv[i]);
+	argv = arena_alloc(a, (cmd->argc + 1) * sizeof(char *));
+	pids = arena_alloc(a, split_jobs * sizeof(pid_t));
+	if (argv == NULL || pids == NULL) {
+		fprintf(stderr, "Not enough memory!\n");
+		last_status = 1;
+		return 0;
+	}
+	memcpy(argv, cmd->argv, keep * sizeof(char *));
+	if (redir_files(&fd_out, &fd_in) == -1) {
+		last_status = 1;
+		return 0;
+	}
+
+	for (start = keep; !stop && (start < cmd->argc || n == 0);
+	     start = end) {
+		end = split_next(cmd->argv, cmd->argc, start, used, limit);
+		memcpy(argv + keep, cmd->argv + start,
+		       (end - start) * sizeof(char *));
+		argv[keep + end - start] = NULL;
+
+		/* the oldest invocation makes room for the next one */
+		if (running == split_jobs) {
+			if (waitpid(pids[head], &st, 0) > 0) {
+				if (exit_status(st) > status)
+					status = exit_status(st);
+				stop = WIFSIGNALED(st);
 			}
+			head = (head + 1) % split_jobs;
+			running--;
+			if (stop)
+				break;
 		}
-		if (c == '\n')
+
+		args = argv;
+		redir_t = redir_f = NULL;
+		rc = spawn_args(fd_in, fd_out, -1,
+		                &pids[(head + running) % split_jobs]);
+		if (rc == E2BIG && end - start > 1) {
+			/* the limit is wrong, halve the room for the
+			 * trailing arguments and retry */
+			limit = used + (limit - used) / 2;
+			end = start;
+			continue;
+		}
+		if (rc != 0) {
+			rc = spawn_error(rc);
+			if (rc > status)
+				status = rc;
 			break;
+		}
+		running++;
+		n++;
+	}
+	for (; running > 0; running--) {
+		if (waitpid(pids[head], &st, 0) > 0 && exit_status(st) > status)
+			status = exit_status(st);
+		head = (head + 1) % split_jobs;
+	}
+	if (fd_out != -1)
+		redir_close(fd_out);
+	if (fd_in != -1)
+		redir_close(fd_in);
+	stats_lap(STATS_WAIT, &t0);
+	trace_end("split", tt, "invocations", n);
+	last_status = status;
+
+	return 0;
+}
+
+/* Executes the pipeline cmd (see spawn_pipeline()), the pids of the stages
+ * are kept in arena a. Returns 0 on success or -1 on error. */
+int execute_file(struct command *cmd, struct arena *a, struct time_job *tj)
+{
+	struct timespec t0;
+	struct command *st;
+	uint64_t tt = trace_begin();
+	pid_t *pids, pgid;
+	int n, nprocs, status, rv;
+
+	if (split_jobs > 0 && !run_bg && cmd->pipe == NULL && tj == NULL)
+		return split_run(cmd, a);
+
+	stats_now(&t0);
+	for (n = 0, st = cmd; st != NULL; st = st->pipe)
+		n++;
+	pids = arena_alloc(a, n * sizeof(pid_t));
+	if (pids == NULL) {
+		fprintf(stderr, "Not enough memory!\n");
+		return -1;
+	}
+
+	nprocs = spawn_pipeline(cmd, pids, &n, &pgid, tj, &last_status);
+	if (nprocs == 0)
+		return 0;
+	stats_lap(STATS_EXEC, &t0);
+	trace_end("exec", tt, "stages", nprocs);
+	if (run_bg) {
+		if (add_job(cmd, a, pgid, pids, n) == -1)
+			return -1;
+		last_status = 0;
+		return 0;
+	}
+
+	/* the status of the pipeline is the status of its last stage */
+	tt = trace_begin();
+	if (tj != NULL) {
+		/* the queued closes are not left for the next submission */
+		if (loop_mode == LOOP_URING && ring.queued > 0)
+			uring_submit(&ring, 0);
+		rv = time_wait(tj, &status);
+	} else if (loop_mode == LOOP_URING && uring_waitid)
+		rv = uring_wait_stages(pids, n, a, &status);
+	else
+		rv = wait_stages(pids, n, &status);
+	if (rv == -1)
+		return -1;
+	stats_lap(STATS_WAIT, &t0);
+	trace_end("wait pipeline", tt, "status", status);
+	if (status != -1) {
+		if (WIFSIGNALED(status)) {
+			if (interactive)
+				printf("\n");
+			last_status = 128 + WTERMSIG(status);
+		} else {
+			last_status = WEXITSTATUS(status);
+		}
+	}
+
+	return 0;
+}
+
+/* Returns the number of CPUs the shell may run on. */
+int cpus_available(void)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+
+	return 1;
+}
+
+/* Returns the time elapsed since t in milliseconds. */
+double elapsed_ms(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* latencies of the finished commands of parallel */
+struct parallel_stats {
+	double *lat;   /* milliseconds */
+	size_t n;
+	size_t cap;
+	size_t failed;
+};
+
+/* Records the command started at start which has finished with status. */
+void parallel_done(struct parallel_stats *ps, const struct timespec *start,
+                   int status)
+{
+	double *lat;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		ps->failed++;
+	if (ps->n == ps->cap) {
+		lat = realloc(ps->lat, 2 * (ps->cap + 512) * sizeof(double));
+		if (lat == NULL)
+			return;
+		ps->lat = lat;
+		ps->cap = 2 * (ps->cap + 512);
+	}
+	ps->lat[ps->n++] = elapsed_ms(start);
+}
+
+/* Builds the argument vector of command tmpl (tn words) for item in arena
+ * a: every {} in the words is replaced by the item, the item is appended
+ * if there is no {}. Returns NULL if there is not enough memory. */
+char **parallel_args(char **tmpl, int tn, const char *item, size_t len,
+                     struct arena *a)
+{
+	char **argv, *w, *p;
+	const char *t, *q;
+	int i, found = 0;
+	size_t k;
+
+	argv = arena_alloc(a, (tn + 2) * sizeof(char *));
+	if (argv == NULL)
+		return NULL;
+	for (i = 0; i < tn; i++) {
+		if (strstr(tmpl[i], "{}") == NULL) {
+			argv[i] = tmpl[i];
+			continue;
+		}
+		found = 1;
+		for (k = 0, t = tmpl[i]; (t = strstr(t, "{}")) != NULL; t += 2)
+			k++;
+		w = arena_alloc(a, strlen(tmpl[i]) + k * len + 1);
+		if (w == NULL)
+			return NULL;
+		for (p = w, t = tmpl[i]; (q = strstr(t, "{}")) != NULL;
+		     t = q + 2) {
+			memcpy(p, t, q - t);
+			p += q - t;
+			memcpy(p, item, len);
+			p += len;
+		}
+		strcpy(p, t);
+		argv[i] = w;
 	}
+	if (!found)
+		argv[i++] = (char *)item;
+	argv[i] = NULL;
+
+	return argv;
 }
 
-/* Input thread */
-void *input_start(void *arg)
+/* parallel [-j N] CMD [ARG...] - runs CMD once for every line (item) of
+ * stdin or <FILE with {} in ARGs replaced by the item (or the item added
+ * as the last argument), keeping N commands running; N defaults to the
+ * number of CPUs available to the shell. A finished command is noticed at
+ * once through its pidfd and its slot is refilled with the next item. The
+ * throughput and latency percentiles are printed on stderr. Returns 0 if
+ * all the commands succeeded, otherwise 1 (also if the items would come
+ * from stdin which the shell reads its commands from). */
+int parallel_cmd(void)
 {
-	int rv;
+	struct parallel_slot {
+		pid_t pid;
+		struct timespec start;
+	} *slots = NULL;
+	struct pollfd *pfd = NULL;
+	struct parallel_stats ps = { NULL, 0, 0, 0 };
+	struct reader rd;
+	struct arena pa;
+	struct timespec t0;
+	struct rlimit rl;
+	char **tmpl, **argv, *item, *end;
+	double total;
 	ssize_t n;
-	char cmd_buf[MAXLEN];
-
-	printf("$ ");
-	fflush(stdout);
-
-	/* read from stdin */
-	while ((n = read(STDIN_FILENO, &cmd_buf, MAXLEN)) != 0) {
-		if (n < 0) {
-			perror("read");
-			fflush(stderr);
-			/* signal exec thread to exit */
-			set_exit_flag(1);
-			monitor_args_execute();
-			return (void *)1;
+	int i, j = 0, tn, used = 0, running = 0, eof = 0, err = 0, status;
+	int fd = STDIN_FILENO, fd_out = -1, rv = 1;
+	pid_t pid;
+
+	i = 1;
+	if (args[i] != NULL && strncmp(args[i], "-j", 2) == 0) {
+		item = (args[i][2] != '\0') ? args[i] + 2 : args[++i];
+		j = (item != NULL) ? strtol(item, &end, 10) : 0;
+		if (item == NULL || *end != '\0' || j <= 0) {
+			fprintf(stderr, "parallel: invalid number of jobs\n");
+			return 1;
 		}
+		i++;
+	}
+	if (args[i] == NULL) {
+		fprintf(stderr, "Usage: parallel [-j N] CMD [ARG...]\n");
+		return 1;
+	}
+	tmpl = &args[i];
+	tn = argsc - 1 - i;
+	if (j == 0)
+		j = cpus_available();
+	/* a pidfd per running command, poll() takes at most the limit */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur != RLIM_INFINITY &&
+	    (rlim_t)j + PARALLEL_FD_RESERVE > rl.rlim_cur)
+		j = (rl.rlim_cur > 2 * PARALLEL_FD_RESERVE) ?
+		    (int)(rl.rlim_cur - PARALLEL_FD_RESERVE) : 1;
+
+	/* items come from <FILE, output of the commands goes to >FILE; the
+	 * commands of a non-interactive shell read from stdin are read
+	 * ahead, so the items would be split between the two readers */
+	if (redir_f == NULL && !interactive && input.fd == STDIN_FILENO &&
+	    input.mapped == 0) {
+		fprintf(stderr, "parallel: stdin is the input of the shell, "
+		        "use <FILE\n");
+		return 1;
+	} else if (redir_f != NULL) {
+		fd = open(redir_f, O_RDONLY|O_CLOEXEC);
+		if (fd == -1) {
+			perror(redir_f);
+			return 1;
+		}
+	}
+	if (redir_t != NULL) {
+		fd_out = redir_file(STDOUT_FILENO);
+		if (fd_out == -1)
+			goto out_fd;
+	}
+	if (devnull_fd == -1)
+		devnull_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+	if (reader_init(&rd, fd, input.max) == -1) {
+		fprintf(stderr, "Not enough memory!\n");
+		goto out_fd;
+	}
+	arena_init(&pa);
+	slots = malloc(j * sizeof(*slots));
+	pfd = malloc(j * sizeof(*pfd));
+	if (slots == NULL || pfd == NULL) {
+		fprintf(stderr, "Not enough memory!\n");
+		goto out;
+	}
+	for (i = 0; i < j; i++)
+		pfd[i].fd = -1;   /* free slot, ignored by poll() */
 
-		if (n == MAXLEN) {
-			if (cmd_buf[n-1] == '\n') {
-				fprintf(stderr, "Argument too long!\n");
-				printf("$ ");
-			} else {
-				flush_input();
-				fprintf(stderr, "Argument too long!\n");
-				printf("$ ");
+	/* the commands must not take the <FILE or >FILE redirection */
+	redir_t = redir_f = NULL;
+	run_bg = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (;;) {
+		/* fill the free slots */
+		for (i = 0; i < j && !eof; i++) {
+			if (pfd[i].fd != -1)
+				continue;
+			n = reader_line(&rd, &item);
+			if (n == READER_EOF || n == READER_ERROR) {
+				if (n == READER_ERROR)
+					perror("parallel: read");
+				eof = 1;
+				break;
 			}
-			fflush(stdout);
-			fflush(stderr);
-			continue;
+			if (n == READER_TOOLONG || n == 0) {
+				i--;   /* skip the item, fill the same slot */
+				continue;
+			}
+			arena_reset(&pa);
+			argv = parallel_args(tmpl, tn, item, n, &pa);
+			if (argv == NULL) {
+				fprintf(stderr, "Not enough memory!\n");
+				eof = 1;
+				break;
+			}
+			args = argv;
+			clock_gettime(CLOCK_MONOTONIC, &slots[i].start);
+			if (spawn_stage(devnull_fd, fd_out, -1, &pid) != 0) {
+				ps.failed++;
+				i--;
+				continue;
+			}
+			pfd[i].fd = syscall(SYS_pidfd_open, pid, 0);
+			if (pfd[i].fd == -1) {
+				/* no pidfd support, run the item to its end */
+				waitpid(pid, &status, 0);
+				parallel_done(&ps, &slots[i].start, status);
+				i--;
+				continue;
+			}
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+			slots[i].pid = pid;
+			running++;
+			if (i >= used)
+				used = i + 1;
 		}
-
-		cmd_buf[n-1] = '\0';
-
-		/* constructs args variable for execvp */
-		rv = create_args(cmd_buf);
-		if (rv == -1) {
-			fflush(stderr);
+		if (running == 0 && eof)
 			break;
-		}
-		if (rv == 1) {
-			fflush(stderr);
-			printf("$ ");
-			fflush(stdout);
-			continue;
-		}
 
-		if (strcmp(args[0], "exit") == 0) {
-			clear_args();
-			/* signal exec thread to exit */
-			set_exit_flag(1);
-			monitor_args_execute();
-			return 0;
-		}
-		if (strcmp(args[0], "jobs") == 0) {
-			clear_args();
-			jobs_print(&jobs);
-			printf("$ ");
-			fflush(stdout);
-			continue;
+		/* wait for a command to finish, pidfd becomes readable; only
+		 * the slots ever filled are polled (fewer items than N) */
+		if (running > 0 && poll(pfd, used, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			err = 1;
+			break;
 		}
-		if (strcmp(args[0], "cd") == 0) {
-			clear_args();
-			if (change_cwd() == -1) {
-				fflush(stderr);
-				/* signal exec thread to exit */
-				set_exit_flag(1);
-				monitor_args_execute();
-				return 0;
-			}
-			printf("$ ");
-			fflush(stdout);
-			fflush(stderr);
-			continue;
+		for (i = 0; i < used; i++) {
+			if (pfd[i].fd == -1 || pfd[i].revents == 0)
+				continue;
+			waitpid(slots[i].pid, &status, 0);
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			running--;
+			parallel_done(&ps, &slots[i].start, status);
 		}
-		if (strlen(args[0]) == 0) {
-			clear_args();
-			printf("\r$ ");
-			fflush(stdout);
+	}
+	/* after an error the running commands are waited for too */
+	for (i = 0; i < used; i++) {
+		if (pfd[i].fd == -1)
 			continue;
-		}
-
-		/* signal the exec thread to execute the args content */
-		monitor_args_execute();
-		/* wait until execution is finished */
-		monitor_args_wait_finished();
-
-		clear_args();
-		if (is_exit_flag())
-			return 0;
-
-		printf("$ ");
-		fflush(stdout);
+		waitpid(slots[i].pid, &status, 0);
+		close(pfd[i].fd);
+		pfd[i].fd = -1;
+		parallel_done(&ps, &slots[i].start, status);
+	}
+	total = elapsed_ms(&t0);
+
+	if (ps.n > 0) {
+		qsort(ps.lat, ps.n, sizeof(double), cmp_double);
+		fprintf(stderr, "parallel: %zu items in %.3f s, %.1f items/s, "
+		        "latency p50 %.2f p99 %.2f max %.2f ms, %zu failed\n",
+		        ps.n, total / 1e3, ps.n / (total / 1e3),
+		        ps.lat[ps.n / 2], ps.lat[ps.n * 99 / 100],
+		        ps.lat[ps.n - 1], ps.failed);
+	} else if (ps.failed > 0) {
+		fprintf(stderr, "parallel: %zu items failed\n", ps.failed);
 	}
+	rv = (ps.failed > 0 || err);
+
+out:
+	free(ps.lat);
+	free(pfd);
+	free(slots);
+	arena_free(&pa);
+	reader_free(&rd);
+out_fd:
+	if (fd_out != -1)
+		close(fd_out);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	return rv;
+}
 
-	printf("\n");
-	fflush(stdout);
+/* Applies the redirections of a built-in command in the shell process:
+ * >FILE replaces the descriptor of builtin_out (stdout of the shell stays
+ * in place for the signal thread) until redir_restore(); <FILE is only
+ * opened (and created) as for a spawned command, stdin of the shell is its
+ * input. Returns 0 on success, -1 if a file could not be opened
+ * (reported). */
+int redir_builtin(void)
+{
+	int fd_out = -1, fd_in = -1, rv = 0;
 
-	/* signal exec thread to exit */
-	set_exit_flag(1);
-	monitor_args_execute();
+	if (redir_t == NULL && redir_f == NULL)
+		return 0;
+	if (redir_files(&fd_out, &fd_in) == -1)
+		return -1;
+	if (fd_in != -1)
+		redir_close(fd_in);
+	if (fd_out == -1)
+		return 0;
+
+	if (builtin_fd == -1 || dup3(fd_out, builtin_fd, O_CLOEXEC) == -1) {
+		fprintf(stderr, "%s: built-in output can't be redirected\n",
+		        redir_t);
+		rv = -1;
+	}
+	redir_close(fd_out);
 
-	return 0;
+	return rv;
 }
 
-/* If target argument is STDOUT_FILENO (STDIN_FILENO) the stdout (stdin)
- * descriptor is redirected into the file specified in global variable
- * redir_t (redir_f). On success, the file descriptor of redirection file
- * is returned, otherwise -1 indicating error. */
-int redir_file(int target)
+/* Writes out builtin_out and puts stdout back behind it if redir_builtin()
+ * has replaced it. Returns 0, or 1 if the output could not be written
+ * (reported). */
+int redir_restore(void)
 {
-	int fd;
+	int rv = 0;
 
-	if (target == STDOUT_FILENO) {
-		fd = open(redir_t, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR);
-		if (fd == -1) {
-			perror("open");
-			return -1;
-		}
+	if (fflush(builtin_out) != 0) {
+		fprintf(stderr, "%s: %s\n", redir_t ? redir_t : "stdout",
+		        strerror(errno));
+		clearerr(builtin_out);
+		rv = 1;
+	}
+	if (redir_t != NULL && builtin_fd != -1 &&
+	    dup3(STDOUT_FILENO, builtin_fd, O_CLOEXEC) == -1)
+		perror("dup3");
 
-		/* make stdout go to fd */
-		if (dup2(fd, STDOUT_FILENO) == -1) {
-			perror("dup2");
-			return -1;
-		}
-	} else {
-		fd = open(redir_f, O_CREAT|O_RDONLY, S_IRUSR|S_IWUSR);
-		if (fd == -1) {
-			perror("open");
-			return -1;
-		}
+	return rv;
+}
 
-		/* make stdin go to fd */
-		if (dup2(fd, STDIN_FILENO) == -1) {
-			perror("dup2");
-			return -1;
-		}
+/* Runs built-in command b with its redirections applied in the shell
+ * process, measured as the only stage of tj if it is not NULL. Returns 0,
+ * or 1 if the shell should exit. */
+int run_builtin(const struct builtin *b, struct time_job *tj)
+{
+	struct timespec t0;
+	uint64_t tt;
+	int status;
+
+	if (!(b->flags & BUILTIN_OWN_REDIR) && redir_builtin() == -1) {
+		last_status = 1;
+		return 0;
 	}
+	if (tj != NULL)
+		time_self(&tj->st[0], 0);
+	stats_now(&t0);
+	tt = trace_begin();
+	status = b->run();
+	stats_lap(STATS_BUILTIN, &t0);
+	trace_end(b->name, tt, "status", status);
+	if (tj != NULL)
+		time_self(&tj->st[0], 1);
+	if (redir_restore() != 0 && status == 0)
+		status = 1;
+	if (status == BUILTIN_EXIT)
+		return 1;
+	last_status = status;
 
-	return fd;
+	return 0;
 }
 
-/* Executes the file in args[0] and also handles file redirection
- * and backgrounding of processes. Returns 0 on success or -1 on error. */
-int execute_file(void)
+/* Executes the parsed line s, a built-in command or a pipeline of files
+ * (built-in commands are not recognized inside pipelines, utilities
+ * started in background are spawned as jobs, by the spawner threads if
+ * there are any). A foreground command
+ * prefixed with time is followed by the report of its resource usage.
+ * Arena of s holds temporary data. Returns 0 on success, 1 if the shell
+ * should exit or -1 on error. */
+int run_command(struct cmdq_slot *s)
 {
-	pid_t cpid, w;
-	sigset_t signal_set;
-	int status, fd;
-	
-	cpid = fork();
-	if (cpid == -1) {
-		perror("fork");
-		return -1;
+	struct command *cmd = &s->cmd;
+	const struct builtin *b;
+	struct time_job tj, *timed = NULL;
+	struct timespec t0;
+	int rv;
+
+	stats_now(&t0);
+	stats_add(STATS_QUEUE, time_ns(&s->parsed, &t0));
+	b = builtin_find(cmd->argv[0]);
+	while (b != NULL && (b->flags & BUILTIN_PREFIX) && cmd->argc > 1) {
+		cmd->argv++;
+		cmd->argc--;
+		b = builtin_find(cmd->argv[0]);
+		if (!cmd->bg)
+			timed = &tj;
+	}
+	if (timed != NULL &&
+	    time_init(&tj, cmd, &s->arena, s->parse_ns, &s->parsed) == -1) {
+		fprintf(stderr, "Not enough memory!\n");
+		timed = NULL;
 	}
-	if (cpid == 0) {  /* child */
-		/* unblock all signals for new process except SIGTSTP */
-		sigfillset(&signal_set);
-		sigdelset(&signal_set, SIGTSTP);
-		if (run_bg)
-			sigdelset(&signal_set, SIGINT);
-		pthread_sigmask(SIG_UNBLOCK, &signal_set, NULL);
-
-		/* IO redirection */
-		if (redir_t[0] != '\0') {
-			fd = redir_file(STDOUT_FILENO);
-			if (fd == -1)
-				return -1;
-		}
-		if (redir_f[0] != '\0') {
-			fd = redir_file(STDIN_FILENO);
-			if (fd == -1)
-				return -1;
-		}
 
-		if (run_bg) {
-			/* child make itself the process group leader (of its
-			 * own group - different from shell group) - this
-			 * will lead in SIGTTIN signal when trying to read
-			 * from stdin which causes stopping of child */
-			if (setpgid(0, 0) == -1) {
-				perror("setpgid");
-				exit(1);
-			}
-		}
+	args = cmd->argv;
+	argsc = cmd->argc + 1;
+	redir_t = cmd->redir_out;
+	redir_f = cmd->redir_in;
+	run_bg = cmd->bg;
+
+	if (cmd->pipe != NULL || (b != NULL && run_bg &&
+	                          (b->flags & BUILTIN_UTIL)))
+		b = NULL;
+	if (b != NULL && (b->flags & BUILTIN_SYNC))
+		spawner_drain();
+	if (b != NULL) {
+		rv = run_builtin(b, timed);
+	} else if (run_bg && spawner_submit(cmd) == 0) {
+		/* spawned by a spawner thread, see spawner.h */
+		last_status = 0;
+		rv = 0;
+	} else {
+		rv = execute_file(cmd, &s->arena, timed);
+	}
+	fflush(stdout);
+	if (timed != NULL && rv != -1)
+		time_print(timed, cmd);
+	fflush(stderr);
 
-		/* PATH variable is searched automatically */
-		execvp(args[0], args);
-		if (errno == ENOENT)
-			fprintf(stderr, "%s: command not found...\n", args[0]);
-		else
-			perror("");
-		exit(1);
-	} else {  /* parent */
-		/* restore all signals blocking */
-		sigfillset(&signal_set);
-		pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+	clear_args();
+	return rv;
+}
 
-		if (run_bg) {
-			if (jobs_insert(&jobs, args[0], cpid) == -1)
-				return -1;
-			printf("[%d] %s\n", cpid, args[0]);
-			fflush(stdout);
-		} else {
-			w = waitpid(cpid, &status, 0);
-			if (w == -1 && errno != ECHILD) {
-				perror("waitpid");
-				return -1;
-			} else if (w > 0) {
-				if (WIFSIGNALED(status))
-					printf("\n");
-			}
-		}
+/* Executes the parsed line s or reports its error. Returns 0 on success,
+ * 1 if the shell should exit or -1 on error. */
+int exec_slot(struct cmdq_slot *s)
+{
+	if (s->kind == CMDQ_SYNTAX) {
+		fprintf(stderr, "Syntax error: %s\n", s->err);
+		fflush(stderr);
+		last_status = 2;
+	} else if (s->kind == CMDQ_TOOLONG) {
+		fprintf(stderr, "Argument too long!\n");
+		fflush(stderr);
+		last_status = 1;
+	} else {
+		return run_command(s);
 	}
 
 	return 0;
@@ -532,87 +1863,73 @@ int execute_file(void)
 /* Exec thread */
 void *cmd_exec_start(void *arg)
 {
-	for(;;) {
-		/* wait until input thread fills in the args */
-		monitor_args_wait_executable();
-		if (is_exit_flag())
+	struct cmdq_slot *s;
+	int rv = 0;
+
+	stats_register("exec");
+	trace_register("exec");
+	for (;;) {
+		/* wait until input thread queues a command */
+		s = cmdq_pop(&cmdq);
+		if (s->kind == CMDQ_END)
 			break;
 
-		if (execute_file() == -1) {
-			set_exit_flag(1);
-			fflush(stderr);
-			monitor_args_executed();
-			return (void *)1;
+		rv = exec_slot(s);
+		stats_now(&cmd_done);
+		if (rv != 0)
+			break;
+		/* the prompt is printed here, not by the input thread once
+		 * woken up, which would add a wakeup (a scheduling delay on a
+		 * loaded machine) to the latency the user sees */
+		if (interactive) {
+			prompt();
+			stats_lap(STATS_PROMPT, &cmd_done);
 		}
 
-		/* allow input thread to work with the args */
-		monitor_args_executed();
+		/* allow input thread to reuse the slot */
+		cmdq_release(&cmdq);
 	}
 
-	return 0;
-}
+	set_exit_flag(1);
+	cmdq_close(&cmdq);
 
-/* Prints the exit status of a background process. */
-void print_status(int w, int status)
-{
-	if (WIFEXITED(status)) {
-		if (WEXITSTATUS(status) != 0)
-			printf("\n[%d]+ Exit %d\n", w, WEXITSTATUS(status));
-		else
-			printf("\n[%d]+ Done\n", w);
-	} else if (WIFSIGNALED(status)) {
-		printf("\n[%d]+ Killed\n", w);
-	} else if (WIFSTOPPED(status)) {
-		printf("\n[%d]+ Stopped\n", w);
-	} else {
-		printf("\n[%d]+ Terminated\n", w);
-	}
+	return (rv == -1) ? (void *)1 : 0;
 }
 
 /* Signal handling thread */
 void *sig_handler(void *arg)
 {
 	sigset_t signal_set;
-	pid_t w;
-	int sig, status;
+	uint64_t t0;
+	int sig;
 
+	trace_register("signal");
 	for (;;) {
 		/* wait for any signal */
 		sigfillset(&signal_set);
 		sigwait(&signal_set, &sig);
+		t0 = trace_begin();
 
 		/* signal caught */
 		switch (sig) {
 			case SIGINT:  /* ctrl+c */
-				pthread_mutex_lock(&mtx);
-				if (exec_args)
-					printf("\n");
-				else
-					printf("\n$ ");
-				pthread_mutex_unlock(&mtx);
-				fflush(stdout);
+				if (!interactive)
+					exit(128 + sig);
+				jobs_interrupt(&jobs);
+				prompt_write(cmdq_busy(&cmdq) ? "\n" : "\n$ ");
 				break;
 			case SIGTSTP: /* ctrl+z */
-				pthread_mutex_lock(&mtx);
-				if (exec_args)
-					printf("\n");
-				else
-					printf("\n$ ");
-				pthread_mutex_unlock(&mtx);
-				fflush(stdout);
+				if (!interactive)
+					break;
+				prompt_write(cmdq_busy(&cmdq) ? "\n" : "\n$ ");
 				break;
 			case SIGCHLD: /* child exit */
-				w = waitpid(-1, &status, WNOHANG);
-				if (w > 0) {
-					if (jobs_find_remove(&jobs, w)) {
-						print_status(w, status);
-						pthread_mutex_lock(&mtx);
-						if (!exec_args)
-							printf("$ ");
-						pthread_mutex_unlock(&mtx);
-						fflush(stdout);
-					}
-				}
+				reap_jobs();
+				break;
+			case SIGTERM:
+			case SIGHUP:
+				if (!interactive)
+					exit(128 + sig);
 				break;
 			case SIGUSR1:
 				if (is_exit_flag())
@@ -621,18 +1938,359 @@ void *sig_handler(void *arg)
 			default:
 				break;
 		}
+		trace_end("signal", t0, "signo", sig);
 	}
 
 	return 0;
 }
 
+/* Event loops: returns a signalfd of the signals the shell handles (they
+ * are blocked since main()), SIGCHLD only if chld is set. Returns -1 on
+ * error. */
+int loop_signalfd(int chld)
+{
+	sigset_t set;
+	int fd;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTSTP);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	if (chld)
+		sigaddset(&set, SIGCHLD);
+	fd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (fd == -1)
+		perror("signalfd");
+
+	return fd;
+}
+
+/* Event loops: parses and executes line of length n returned by
+ * reader_next() in slot (the line is executed before the next read, no
+ * copy is needed). Returns 0 to go on, 1 if the shell should exit or -1 on
+ * error. */
+int loop_line(struct cmdq_slot *slot, char *line, ssize_t n)
+{
+	int rv;
+
+	arena_reset(&slot->arena);
+	slot->kind = CMDQ_RUN;
+	slot->err = NULL;
+	if (n == READER_TOOLONG) {
+		slot->kind = CMDQ_TOOLONG;
+	} else {
+		if (create_args(slot, line, n, 0) == -1) {
+			fflush(stderr);
+			return -1;
+		}
+		if (slot->kind == CMDQ_RUN && slot->cmd.argc == 0) {
+			/* empty line */
+			prompt_write("\r$ ");
+			return 0;
+		}
+	}
+
+	loop_busy = 1;
+	rv = exec_slot(slot);
+	stats_now(&cmd_done);
+	/* ctrl+c and ctrl+z meant for the finished command */
+	if (loop_mode == LOOP_URING) {
+		uring_reap();
+		uring_events();
+	} else if (interactive) {
+		loop_signals();
+	}
+	loop_busy = 0;
+	if (rv == 0) {
+		prompt();
+		if (interactive)
+			stats_lap(STATS_PROMPT, &cmd_done);
+	}
+
+	return rv;
+}
+
+/* Event loop (-e epoll): a single thread in place of the input, exec and
+ * signal threads. stdin, a signalfd of the handled signals and the epoll
+ * descriptor of the job table (readable when a pidfd of some job is) are
+ * multiplexed with epoll, every command runs as soon as its line is read.
+ * Returns 0 on success, 1 on error. */
+int loop_start(void)
+{
+	struct epoll_event ev, evs[4];
+	struct cmdq_slot slot;
+	uint64_t t0;
+	ssize_t n = 0;
+	char *line;
+	int ep, i, k, rv = 0, reads = -1, more = 1;
+
+	loop_sfd = loop_signalfd(1);
+	if (loop_sfd == -1)
+		return 1;
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep == -1) {
+		perror("epoll_create1");
+		close(loop_sfd);
+		return 1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = loop_sfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, loop_sfd, &ev);
+	ev.data.fd = jobs.epfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, jobs.epfd, &ev);
+	/* a pipe or terminal is read once per readiness; a mapped script or
+	 * a regular file (refused by epoll with EPERM) is always ready */
+	if (input.mapped == 0) {
+		ev.data.fd = input.fd;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, input.fd, &ev) == 0) {
+			reads = 0;
+		} else if (errno != EPERM) {
+			perror("epoll_ctl");
+			rv = 1;
+			goto out;
+		}
+	}
+	arena_init(&slot.arena);
+
+	prompt();
+	for (;;) {
+		/* buffered lines are executed without waiting */
+		t0 = more ? 0 : trace_begin();
+		k = epoll_wait(ep, evs, 4, more ? 0 : -1);
+		trace_end("wait for events", t0, "events", k);
+		if (k == -1 && errno != EINTR) {
+			perror("epoll_wait");
+			rv = 1;
+			break;
+		}
+		for (i = 0; i < k; i++) {
+			if (evs[i].data.fd == loop_sfd) {
+				loop_signals();
+			} else if (evs[i].data.fd == jobs.epfd) {
+				reap_jobs();
+			} else {
+				more = 1;
+				reads = 1;
+			}
+		}
+		if (!more)
+			continue;
+
+		n = reader_next(&input, &line, reads);
+		if (reads > 0)
+			reads = 0;
+		if (n == READER_AGAIN) {
+			more = 0;
+			continue;
+		}
+		if (n == READER_EOF)
+			break;
+		if (n == READER_ERROR) {
+			perror("read");
+			fflush(stderr);
+			rv = 1;
+			break;
+		}
+		k = loop_line(&slot, line, n);
+		if (k != 0) {
+			rv = (k == -1);
+			break;
+		}
+	}
+
+	if (interactive && (n == READER_EOF || n == READER_ERROR))
+		printf("\n");
+	fflush(stdout);
+	arena_free(&slot.arena);
+out:
+	close(ep);
+	close(loop_sfd);
+	loop_sfd = -1;
+
+	return rv;
+}
+
+/* Event loop (-e uring): like loop_start(), but stdin is read, the
+ * redirection files opened and closed and the foreground commands waited
+ * for with io_uring requests, signals and jobs are watched with polls on
+ * the ring, see uring.h. The requests of a command are submitted together
+ * (redir_files(), uring_wait_stages()) and finished polls are noticed
+ * without a system call. Falls back to loop_start() if the kernel does not
+ * support the needed opcodes; without IORING_OP_WAITID (before Linux 6.7)
+ * the commands are waited for with waitpid(). Returns 0 on success, 1 on
+ * error. */
+int loop_uring_start(void)
+{
+	static const int ops[] = { IORING_OP_READ, IORING_OP_OPENAT,
+	                           IORING_OP_CLOSE, IORING_OP_POLL_ADD };
+	static const int waitid_op[] = { URING_OP_WAITID };
+	struct io_uring_sqe *sqe;
+	struct cmdq_slot slot;
+	uint64_t t0;
+	ssize_t n = 0, room;
+	char *line, *buf;
+	int k, rv = 0, rres = 0, reading = 0;
+
+	if (uring_init(&ring, 64) == -1) {
+		loop_mode = LOOP_EPOLL;
+		return loop_start();
+	}
+	if (!uring_probe(&ring, ops, sizeof(ops) / sizeof(ops[0]))) {
+		uring_free(&ring);
+		loop_mode = LOOP_EPOLL;
+		return loop_start();
+	}
+	uring_waitid = uring_probe(&ring, waitid_op, 1);
+
+	/* the jobs are watched through their pidfds, no SIGCHLD needed */
+	loop_sfd = loop_signalfd(0);
+	if (loop_sfd == -1) {
+		uring_free(&ring);
+		return 1;
+	}
+	uring_poll(loop_sfd, URING_SIG);
+	uring_poll(jobs.epfd, URING_JOBS);
+	arena_init(&slot.arena);
+
+	prompt();
+	for (;;) {
+		n = reader_next(&input, &line, 0);
+		if (n == READER_AGAIN) {
+			/* nothing buffered: read into the reader's buffer,
+			 * handle signals and jobs meanwhile */
+			if (!reading) {
+				room = reader_space(&input, &buf);
+				if (room == -1) {
+					fprintf(stderr, "Not enough memory!\n");
+					rv = 1;
+					break;
+				}
+				sqe = uring_req(&rres);
+				if (sqe == NULL) {
+					perror("io_uring_enter");
+					rv = 1;
+					break;
+				}
+				sqe->opcode = IORING_OP_READ;
+				sqe->fd = input.fd;
+				sqe->addr = (uintptr_t)buf;
+				sqe->len = room;
+				sqe->off = (__u64)-1;   /* current position */
+				reading = 1;
+			}
+			t0 = trace_begin();
+			k = uring_submit(&ring, 1);
+			trace_end("wait for events", t0, NULL, 0);
+			if (k == -1 && errno != EINTR) {
+				perror("io_uring_enter");
+				rv = 1;
+				break;
+			}
+			uring_reap();
+			/* the read is the only request in flight now */
+			if (reading && uring_inflight == 0) {
+				reading = 0;
+				if (rres >= 0) {
+					reader_commit(&input, rres);
+				} else if (rres != -EINTR && rres != -EAGAIN) {
+					errno = -rres;
+					perror("read");
+					fflush(stderr);
+					n = READER_ERROR;
+					rv = 1;
+					break;
+				}
+			}
+			uring_events();
+			continue;
+		}
+		if (n == READER_EOF)
+			break;
+		k = loop_line(&slot, line, n);
+		if (k != 0) {
+			rv = (k == -1);
+			break;
+		}
+	}
+
+	if (interactive && (n == READER_EOF || n == READER_ERROR))
+		printf("\n");
+	fflush(stdout);
+	arena_free(&slot.arena);
+	close(loop_sfd);
+	loop_sfd = -1;
+	uring_free(&ring);
+
+	return rv;
+}
+
+/* Prints the usage of the shell on stderr. */
+void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s fork|vfork|posix_spawn|clone3|zygote] "
+	        "[-e threads|epoll|uring] [-j SPAWNERS] [--trace FILE] "
+	        "[SCRIPT]\n", name);
+}
+
 int main(int argc, char *argv[])
 {
-	int stat, i;
+	static const struct option longopts[] = {
+		{ "trace", required_argument, NULL, 't' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *trace_path = NULL;
+	char *end;
+	int stat, opt, fd, rv = 0, spawners = -1;
+	long arg_max;
+	struct rlimit rl;
 	pthread_t threads[3];
 	pthread_attr_t attr;
 	sigset_t signal_set;
 
+	while ((opt = getopt_long(argc, argv, "s:e:j:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 't':
+				trace_path = optarg;
+				break;
+			case 'e':
+				if (strcmp(optarg, "threads") == 0) {
+					loop_mode = LOOP_THREADS;
+				} else if (strcmp(optarg, "epoll") == 0) {
+					loop_mode = LOOP_EPOLL;
+				} else if (strcmp(optarg, "uring") == 0) {
+					loop_mode = LOOP_URING;
+				} else {
+					fprintf(stderr, "Unknown event loop "
+					        "'%s'\n", optarg);
+					usage(argv[0]);
+					exit(1);
+				}
+				break;
+			case 'j':
+				spawners = strtol(optarg, &end, 10);
+				if (*end != '\0' || end == optarg ||
+				    spawners < 0 || spawners > SPAWNER_MAX) {
+					fprintf(stderr, "Invalid number of "
+					        "spawners '%s'\n", optarg);
+					usage(argv[0]);
+					exit(1);
+				}
+				break;
+			case 's':
+				if (spawn_set_backend(optarg) == -1) {
+					fprintf(stderr, "Unknown spawn backend "
+					        "'%s'\n", optarg);
+					usage(argv[0]);
+					exit(1);
+				}
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+
 	stat = pthread_attr_init(&attr);
 	if (stat != 0)
 		handle_error_en(stat, "pthread_attr_init");
@@ -644,20 +2302,68 @@ int main(int argc, char *argv[])
 	 * list for storing backgrounded jobs */
 	stat = jobs_init(&jobs);
 	if (stat != 0)
-		handle_error_en(stat, "jobs_init: pthread_mutex_init");
+		handle_error_en(stat, "jobs_init");
+	/* every background process holds a pidfd, allow as many descriptors
+	 * as the hard limit does (inherited by the commands) */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	/* forked while the shell is small and has a single thread, the
+	 * parked children inherit the limits set above */
+	if (spawn_backend == SPAWN_ZYGOTE && zygote_start(ZYGOTE_POOL) == -1)
+		fprintf(stderr, "zygote not started, using clone3\n");
+
+	cmdq_init(&cmdq);
+	/* a command line can be as long as the kernel accepts for exec */
+	arg_max = sysconf(_SC_ARG_MAX);
+	if (arg_max <= 0)
+		arg_max = ARG_MAX_DEFAULT;
+	if (optind < argc) {
+		/* script mode: commands are read from the mapped file */
+		fd = open(argv[optind], O_RDONLY|O_CLOEXEC);
+		if (fd == -1 || reader_init_mmap(&input, fd, arg_max) == -1) {
+			perror(argv[optind]);
+			exit(127);
+		}
+		close(fd);
+		interactive = 0;
+	} else {
+		if (reader_init(&input, STDIN_FILENO, arg_max) == -1) {
+			fprintf(stderr, "Not enough memory!\n");
+			exit(1);
+		}
+		interactive = isatty(STDIN_FILENO);
+	}
+	/* commands end at a newline outside quotes and not escaped */
+	reader_commands(&input, prompt_more);
 
-	/* make shell process group leader */
-	if (setpgid(getpid(), getpid()) == -1) {
-		perror("setpgid");
+	/* built-in commands write to a copy of stdout */
+	builtin_init();
+
+	/* hash table of command locations found in PATH */
+	if (path_init() == -1) {
+		fprintf(stderr, "Could not initialize PATH cache\n");
 		exit(1);
 	}
-	/* set the terminal prcess group to the shell process group - causes
-	 * that only processes in shell group can read stdin, if process
-	 * of other process group tries to read from stdin, it will be
-	 * sent the SIGTTIN signal which stops that process */
-	if (tcsetpgrp(STDIN_FILENO, getpgid(0)) == -1) {
-		perror("tcsetpgrp");
-		exit(1);
+
+	/* job control is set up only for an interactive shell */
+	if (interactive) {
+		/* make shell process group leader (a session leader started
+		 * by a terminal emulator already is one, setpgid() fails) */
+		if (getpgid(0) != getpid() &&
+		    setpgid(getpid(), getpid()) == -1) {
+			perror("setpgid");
+			exit(1);
+		}
+		/* set the terminal prcess group to the shell process group -
+		 * causes that only processes in shell group can read stdin,
+		 * if process of other process group tries to read from stdin,
+		 * it will be sent the SIGTTIN signal which stops that process */
+		if (tcsetpgrp(STDIN_FILENO, getpgid(0)) == -1) {
+			perror("tcsetpgrp");
+			exit(1);
+		}
 	}
 
 	/* block all signals */
@@ -665,6 +2371,38 @@ int main(int argc, char *argv[])
 	stat = pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
 	if (stat != 0)
 		handle_error_en(stat, "pthread_sigmask");
+	/* the writer thread starts with all signals blocked */
+	if (trace_path != NULL && trace_start(trace_path) == -1)
+		exit(1);
+	if (loop_mode != LOOP_THREADS) {
+		pthread_attr_destroy(&attr);
+		stats_register("main");
+		trace_register("main");
+		if (loop_mode == LOOP_URING)
+			rv = loop_uring_start();
+		else
+			rv = loop_start();
+		goto out;
+	}
+
+	/* background jobs of a script are spawned by the spawner threads,
+	 * which share the stdin of background jobs (opened before they
+	 * start) */
+	if (!interactive) {
+		/* on a single CPU the handoff only adds to the spawn */
+		if (spawners == -1) {
+			spawners = cpus_available();
+			if (spawners == 1)
+				spawners = 0;
+			else if (spawners > SPAWNER_DEFAULT)
+				spawners = SPAWNER_DEFAULT;
+		}
+		if (spawners > 0)
+			devnull_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+		if (devnull_fd != -1)
+			spawner_start(spawners, spawn_job);
+	}
+
 	/* create the signal handling thread */
 	stat = pthread_create(&threads[0], &attr, sig_handler, NULL);
 	if (stat != 0)
@@ -684,11 +2422,17 @@ int main(int argc, char *argv[])
 	stat = pthread_attr_destroy(&attr);
 	if (stat != 0)
 		handle_error_en(stat, "pthread_attr_destroy");
-	for (i = 1; i < 3; i++) {
-		stat = pthread_join(threads[i], NULL);
-		if (stat != 0)
-			handle_error_en(stat, "pthread_join");
-	}
+	stat = pthread_join(threads[2], NULL);
+	if (stat != 0)
+		handle_error_en(stat, "pthread_join");
+	/* the jobs queued last are spawned before the shell exits */
+	spawner_stop();
+	/* the exec thread may exit (exit command) while the input thread is
+	 * still blocked in read() */
+	pthread_cancel(threads[1]);
+	stat = pthread_join(threads[1], NULL);
+	if (stat != 0)
+		handle_error_en(stat, "pthread_join");
 
 	/* finally kill and join our signal handling thread */
 	stat = pthread_kill(threads[0], SIGUSR1);
@@ -698,6 +2442,14 @@ int main(int argc, char *argv[])
 	if (stat != 0)
 		handle_error_en(stat, "pthread_join");
 
+out:
 	jobs_free(&jobs);
-	exit(0);
+	path_free();
+	cmdq_free(&cmdq);
+	reader_free(&input);
+	if (devnull_fd != -1)
+		close(devnull_fd);
+	if (rv != 0)
+		exit(1);
+	exit(interactive ? 0 : last_status);
 }
@@ -3,58 +3,96 @@
  * Author: Matus Marhefka
  * Date:   2015-04-23
  *
- * Global variables declarations/definitions, jobs and cd commands
- * implementation.
+ * Global variables declarations/definitions, cd command implementation.
  *
  */
 
-#ifndef JOBS_H
-#define JOBS_H
+#ifndef SHELL_H
+#define SHELL_H
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
-
-#define MAXLEN 513
-#define MAXARG 256
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "arena.h"
+#include "reader.h"
+#include "queue.h"
+#include "jobs.h"
+#include "uring.h"
+
+/* longest command line if sysconf(_SC_ARG_MAX) is not available */
+#define ARG_MAX_DEFAULT 131072
+/* descriptors left to the shell when parallel -j N is capped at the open
+ * file limit (every running command holds a pidfd) */
+#define PARALLEL_FD_RESERVE 32
+/* most invocations split -j N runs at once */
+#define SPLIT_JOBS_MAX 1024
 
 #define handle_error_en(en, msg) \
 	do { errno = en; perror(msg); exit(1); } while (0)
 
-struct job_item {
-	int pid;
-	char name[MAXARG];
-	struct job_item *next;
-};
+/* The command being executed is described by thread local variables, the
+ * spawner threads (see spawner.h) spawn background jobs while the exec
+ * thread runs the next command. */
 
-struct job_list {
-	struct job_item *first;
-	pthread_mutex_t jmtx;
-};
-
-/* count of arguments on command line */
-int argsc;
+/* count of arguments of the command being executed (see run_command()) */
+_Thread_local int argsc;
 /* array of argument strings ending with NULL element (for execvp) */
-char **args;
-/* variables exec_args, mtx and cond are forming our monitor for sync.
- * between input and execution threads */
-volatile int exec_args;
-pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-
-/* used for storing filenames for IO redirection */
-char redir_t[MAXARG];
-char redir_f[MAXARG];
+_Thread_local char **args;
+/* buffered reader of the shell input (stdin) */
+struct reader input;
+/* parsed commands passed from the input thread to the exec thread */
+struct cmd_queue cmdq;
+
+/* filenames for IO redirection (NULL if none), point into the command line */
+_Thread_local char *redir_t;
+_Thread_local char *redir_f;
+
+/* main loop of the shell selected with -e, see loop_start() in shell.c */
+enum {
+	LOOP_THREADS = 0,   /* input, exec and signal threads */
+	LOOP_EPOLL,         /* single-threaded epoll loop */
+	LOOP_URING          /* single-threaded io_uring loop */
+};
+int loop_mode;
+/* event loop: signalfd of the handled signals */
+int loop_sfd = -1;
+/* event loop: set while a command is running */
+int loop_busy;
+
+/* io_uring event loop: the ring, requests in flight whose results are
+ * awaited (see uring_settle()), polls which have fired and whether the
+ * kernel supports IORING_OP_WAITID */
+struct uring ring;
+int uring_inflight;
+int uring_sig;
+int uring_jobs;
+int uring_waitid;
 
 /* indicates exit if set, protected by mtx_exit mutex */
 volatile int exit_flag;
 pthread_mutex_t mtx_exit = PTHREAD_MUTEX_INITIALIZER;
 
+/* set if stdin is a terminal and no script was given */
+int interactive;
+/* exit status of the last command, the shell exits with it in scripts */
+int last_status;
+
+/* when the exec thread finished the last command, for STATS_PROMPT */
+struct timespec cmd_done;
+/* /dev/null, stdin of background jobs of a non-interactive shell */
+int devnull_fd = -1;
+
 /* stores jobs running in background */
 struct job_list jobs;
 /* background flag: if set process is launched in background */
-volatile int run_bg;
+_Thread_local int run_bg;
+/* pipe buffer size set with F_SETPIPE_SZ for new pipelines, 0 to keep the
+ * kernel default (see the pipesize built-in command) */
+int pipe_size;
 
 
 /* Changes the current working directory. */
@@ -78,101 +116,4 @@ int change_cwd(void)
 	return 0;
 }
 
-/* Initializes job_list structure and mutexe variable. Returns 0 on success,
- * error code (of pthread_mutex_init) on error. */
-int jobs_init(struct job_list *list)
-{
-	int rc;
-
-	rc = pthread_mutex_init(&(list->jmtx), NULL);
-	list->first = NULL;
-
-	return rc;
-}
-
-/* Frees the memory occupied by the job_list structure. */
-void jobs_free(struct job_list *list)
-{
-	struct job_item *it;
-
-	pthread_mutex_lock(&(list->jmtx));
-	if (list->first != NULL) {
-		it = list->first;
-		while (it != NULL) {
-			list->first = list->first->next;
-			free(it);
-			it = list->first;
-		}
-		list->first = NULL;
-	}
-	pthread_mutex_unlock(&(list->jmtx));
-
-	pthread_mutex_destroy(&(list->jmtx));
-}
-
-/* Inserts job with name and pid into the job_list. */
-int jobs_insert(struct job_list *list, char *name, int pid)
-{
-	struct job_item *it;
-
-	pthread_mutex_lock(&(list->jmtx));
-	it = malloc(sizeof(struct job_item));
-	if (it == NULL) {
-		fprintf(stderr, "Could not allocate memory for job\n");
-		pthread_mutex_unlock(&(list->jmtx));
-		return -1;
-	}
-	it->pid = pid;
-	strcpy(it->name, name);
-	it->next = list->first;
-	list->first = it;
-	pthread_mutex_unlock(&(list->jmtx));
-
-	return 0;
-}
-
-/* Finds and removes job from the job_list. Returns 1 if job is found
- * and removed, 0 otherwise. */
-int jobs_find_remove(struct job_list *list, int pid)
-{
-	struct job_item *it, *prev;
-
-	pthread_mutex_lock(&(list->jmtx));
-	if (list->first != NULL) {
-		it = prev = list->first;
-		while (it != NULL) {
-			if (it->pid == pid) {
-				if (it == list->first)
-					list->first = it->next;
-				/* remove job_item from list */
-				prev->next = it->next;
-				free(it);
-				pthread_mutex_unlock(&(list->jmtx));
-				return 1;
-			}
-			prev = it;
-			it = it->next;
-		}
-	}
-	pthread_mutex_unlock(&(list->jmtx));
-
-	return 0;
-}
-
-/* Prints all background jobs on the stdout. */
-void jobs_print(struct job_list *list)
-{
-	struct job_item *it;
-
-	pthread_mutex_lock(&(list->jmtx));
-	if (list->first != NULL) {
-		it = list->first;
-		while (it != NULL) {
-			printf("[%d] %s\n", it->pid, it->name);
-			it = it->next;
-		}
-	}
-	pthread_mutex_unlock(&(list->jmtx));
-}
-
 #endif /* SHELL_H */
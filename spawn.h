@@ -0,0 +1,400 @@
+/* spawn.h - Mini POSIX Shell
+ *
+ * Process spawning backends used by execute_file(). The backend is picked
+ * once at startup (shell -s BACKEND):
+ * -- fork        - classic fork() + exec, copies the page tables
+ * -- vfork       - vfork() + exec, the child borrows the parent's memory
+ * -- posix_spawn - posix_spawnp(), all child setup is done by the libc
+ * -- clone3      - clone3(CLONE_VM|CLONE_VFORK) on a small private stack
+ * -- zygote      - a child pre-forked by the zygote process takes over the
+ *                  command (see zygote.h), clone3 for what it cannot run
+ *
+ * Redirections are opened by the parent and handed over as descriptors,
+ * so the only work left for the child is the signal mask, dup2(), setpgid()
+ * and exec - with posix_spawn there is no shell code in the child at all.
+ *
+ */
+
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) && defined(SYS_clone3)
+#  include <linux/sched.h>
+#  define HAVE_CLONE3 1
+#endif
+#include "zygote.h"
+
+/* size of the child stack used by the clone3 backend, the child only needs
+ * enough for execvp() walking the PATH */
+#define SPAWN_STACK 32768
+
+enum spawn_backend {
+	SPAWN_FORK,
+	SPAWN_VFORK,
+	SPAWN_POSIX,
+	SPAWN_CLONE3,
+	SPAWN_ZYGOTE,
+	SPAWN_NBACKENDS
+};
+
+const char *spawn_names[SPAWN_NBACKENDS] = {
+	"fork", "vfork", "posix_spawn", "clone3", "zygote"
+};
+
+/* backend used by spawn_file(), selected at startup */
+enum spawn_backend spawn_backend = SPAWN_POSIX;
+
+/* describes the environment of the process to be spawned */
+struct spawn_attr {
+	int fd_in;       /* becomes stdin of the child, -1 to inherit */
+	int fd_out;      /* becomes stdout of the child, -1 to inherit */
+	pid_t pgid;      /* -1 stays in shell group, 0 new group, >0 joins */
+	const char *path;  /* file to execute, NULL searches PATH for argv[0] */
+	sigset_t mask;   /* signal mask the child starts with */
+};
+
+/* shared between spawn_file() and the child of fork/vfork/clone3 */
+struct spawn_req {
+	char *const *argv;
+	const struct spawn_attr *sa;
+	int errfd;          /* fork only: pipe reporting the exec errno */
+	volatile int err;   /* vfork/clone3: errno written by the child */
+};
+
+
+/* Selects the spawn backend by name. Returns 0 on success, -1 if there
+ * is no backend of that name. */
+int spawn_set_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SPAWN_NBACKENDS; i++) {
+		if (strcmp(name, spawn_names[i]) == 0) {
+			spawn_backend = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Initializes spawn_attr to inherit stdin/stdout, stay in the shell
+ * process group and start with an empty signal mask. */
+void spawn_attr_init(struct spawn_attr *sa)
+{
+	sa->fd_in = -1;
+	sa->fd_out = -1;
+	sa->pgid = -1;
+	sa->path = NULL;
+	sigemptyset(&sa->mask);
+}
+
+/* Child side of the fork, vfork and clone3 backends. Only async-signal-safe
+ * calls are made here since the memory may still be shared with the shell. */
+static int spawn_child(void *arg)
+{
+	struct spawn_req *req = arg;
+	const struct spawn_attr *sa = req->sa;
+	int err;
+
+	if (sigprocmask(SIG_SETMASK, &sa->mask, NULL) == -1)
+		goto fail;
+	if (sa->fd_in != -1 && dup2(sa->fd_in, STDIN_FILENO) == -1)
+		goto fail;
+	if (sa->fd_out != -1 && dup2(sa->fd_out, STDOUT_FILENO) == -1)
+		goto fail;
+	if (sa->pgid != -1 && setpgid(0, sa->pgid) == -1)
+		goto fail;
+
+	if (sa->path != NULL)
+		execve(sa->path, req->argv, environ);
+	else  /* PATH variable is searched automatically */
+		execvp(req->argv[0], req->argv);
+fail:
+	err = errno;
+	req->err = err;
+	if (req->errfd != -1)
+		while (write(req->errfd, &err, sizeof(err)) == -1 &&
+		       errno == EINTR)
+			;
+	_exit(127);
+}
+
+#ifdef HAVE_CLONE3
+/* Raw clone3() which runs fn(arg) on the new stack in the child. The child
+ * shares the memory of the parent, so it must never return into C code
+ * of the parent - it exits with the value returned by fn instead. */
+static long clone3_run(struct clone_args *ca, int (*fn)(void *), void *arg)
+{
+	register long rax __asm__("rax") = SYS_clone3;
+	register void *rdi __asm__("rdi") = ca;
+	register long rsi __asm__("rsi") = sizeof(*ca);
+	register int (*r12)(void *) __asm__("r12") = fn;
+	register void *r13 __asm__("r13") = arg;
+
+	__asm__ volatile (
+		"syscall\n\t"
+		"testq %%rax, %%rax\n\t"
+		"jnz 1f\n\t"
+		"xorl %%ebp, %%ebp\n\t"
+		"movq %%r13, %%rdi\n\t"
+		"callq *%%r12\n\t"
+		"movl %%eax, %%edi\n\t"
+		"movl %[nr_exit], %%eax\n\t"
+		"syscall\n\t"
+		"hlt\n"
+		"1:"
+		: "+r"(rax)
+		: "r"(rdi), "r"(rsi), "r"(r12), "r"(r13),
+		  [nr_exit] "i"(SYS_exit)
+		: "rcx", "r11", "memory");
+
+	return rax;
+}
+#endif
+
+/* Waits for the child which failed to exec so it does not become zombie. */
+static void spawn_reap(pid_t pid)
+{
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+		;
+}
+
+/* File actions allocate memory, so the posix_spawn backend builds them
+ * once per thread for two descriptors of its own: a redirection is
+ * dup3()ed to its descriptor for the spawn, then /dev/null takes its place
+ * again, which keeps the number reserved without holding the file open.
+ * The actions do not depend on which descriptors a command gets (running
+ * jobs hold pidfds, so the numbers vary). */
+static _Thread_local posix_spawn_file_actions_t spawn_fa[4];  /* by which
+                                                   of stdin and stdout */
+static _Thread_local int spawn_fa_fd[2] = { -1, -1 };  /* their sources */
+static _Thread_local int spawn_null = -1;
+
+/* Builds the file actions of the thread. Returns 0, or an error number. */
+static int spawn_actions_init(void)
+{
+	int i;
+
+	if (spawn_null == -1 &&
+	    (spawn_null = open("/dev/null", O_RDONLY|O_CLOEXEC)) == -1)
+		return errno;
+	for (i = 0; i < 2; i++)
+		if (spawn_fa_fd[i] == -1 &&
+		    (spawn_fa_fd[i] = fcntl(spawn_null, F_DUPFD_CLOEXEC,
+		                            3)) == -1)
+			return errno;
+	for (i = 0; i < 4; i++) {
+		posix_spawn_file_actions_init(&spawn_fa[i]);
+		if (i & 1)
+			posix_spawn_file_actions_adddup2(&spawn_fa[i],
+			        spawn_fa_fd[0], STDIN_FILENO);
+		if (i & 2)
+			posix_spawn_file_actions_adddup2(&spawn_fa[i],
+			        spawn_fa_fd[1], STDOUT_FILENO);
+	}
+
+	return 0;
+}
+
+/* Returns the file actions of the redirections of sa with their
+ * descriptors in place, NULL on error (errno is set). */
+static posix_spawn_file_actions_t *spawn_actions(const struct spawn_attr *sa)
+{
+	int rc;
+
+	if (spawn_fa_fd[1] == -1 && (rc = spawn_actions_init()) != 0) {
+		errno = rc;
+		return NULL;
+	}
+	if (sa->fd_in != -1 &&
+	    dup3(sa->fd_in, spawn_fa_fd[0], O_CLOEXEC) == -1)
+		return NULL;
+	if (sa->fd_out != -1 &&
+	    dup3(sa->fd_out, spawn_fa_fd[1], O_CLOEXEC) == -1)
+		return NULL;
+
+	return &spawn_fa[(sa->fd_in != -1) | (sa->fd_out != -1) << 1];
+}
+
+/* Puts /dev/null back in place of the redirections of sa. */
+static void spawn_actions_done(const struct spawn_attr *sa)
+{
+	if (sa->fd_in != -1)
+		dup3(spawn_null, spawn_fa_fd[0], O_CLOEXEC);
+	if (sa->fd_out != -1)
+		dup3(spawn_null, spawn_fa_fd[1], O_CLOEXEC);
+}
+
+static int spawn_posix(pid_t *pid, char *const argv[],
+                       const struct spawn_attr *sa)
+{
+	posix_spawn_file_actions_t *fa;
+	posix_spawnattr_t attr;
+	short flags = POSIX_SPAWN_SETSIGMASK;
+	int rc;
+
+	fa = spawn_actions(sa);
+	if (fa == NULL) {
+		rc = errno;
+		spawn_actions_done(sa);
+		return rc;
+	}
+	posix_spawnattr_init(&attr);
+	if (sa->pgid != -1) {
+		flags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup(&attr, sa->pgid);
+	}
+	posix_spawnattr_setsigmask(&attr, &sa->mask);
+	posix_spawnattr_setflags(&attr, flags);
+
+	if (sa->path != NULL)
+		rc = posix_spawn(pid, sa->path, fa, &attr, argv, environ);
+	else
+		rc = posix_spawnp(pid, argv[0], fa, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	spawn_actions_done(sa);
+
+	return rc;
+}
+
+static int spawn_fork(pid_t *pid, struct spawn_req *req)
+{
+	int pfd[2], err;
+	ssize_t n;
+
+	if (pipe2(pfd, O_CLOEXEC) == -1)
+		return errno;
+
+	*pid = fork();
+	if (*pid == -1) {
+		err = errno;
+		close(pfd[0]);
+		close(pfd[1]);
+		return err;
+	}
+	if (*pid == 0) {  /* child */
+		close(pfd[0]);
+		req->errfd = pfd[1];
+		spawn_child(req);
+	}
+
+	/* parent: the pipe is closed by a successful exec */
+	close(pfd[1]);
+	while ((n = read(pfd[0], &err, sizeof(err))) == -1 && errno == EINTR)
+		;
+	close(pfd[0]);
+	if (n == sizeof(err)) {
+		spawn_reap(*pid);
+		return err;
+	}
+
+	return 0;
+}
+
+static int spawn_vfork(pid_t *pid, struct spawn_req *req)
+{
+	*pid = vfork();
+	if (*pid == -1)
+		return errno;
+	if (*pid == 0)  /* child, parent is suspended until exec or exit */
+		spawn_child(req);
+
+	if (req->err != 0) {
+		spawn_reap(*pid);
+		return req->err;
+	}
+
+	return 0;
+}
+
+static int spawn_clone3(pid_t *pid, struct spawn_req *req)
+{
+#ifdef HAVE_CLONE3
+	/* the parent is suspended until exec (CLONE_VFORK), so the child
+	 * can safely run on a part of our own stack */
+	char stack[SPAWN_STACK] __attribute__((aligned(16)));
+	struct clone_args ca;
+	long rv;
+
+	memset(&ca, 0, sizeof(ca));
+	ca.flags = CLONE_VM | CLONE_VFORK;
+	ca.exit_signal = SIGCHLD;
+	ca.stack = (unsigned long)stack;
+	ca.stack_size = sizeof(stack);
+
+	rv = clone3_run(&ca, spawn_child, req);
+	if (rv == -ENOSYS)  /* kernel older than 5.3 */
+		return spawn_vfork(pid, req);
+	if (rv < 0)
+		return -rv;
+	*pid = rv;
+
+	if (req->err != 0) {
+		spawn_reap(*pid);
+		return req->err;
+	}
+
+	return 0;
+#else
+	return spawn_vfork(pid, req);
+#endif
+}
+
+static int spawn_zygote(pid_t *pid, char *const argv[],
+                        struct spawn_req *req)
+{
+	const struct spawn_attr *sa = req->sa;
+	int rc;
+
+	rc = zygote_spawn(pid, sa->path, argv, sa->fd_in, sa->fd_out, sa->pgid,
+	                  &sa->mask);
+	if (rc == -1)  /* no zygote or too large */
+		return spawn_clone3(pid, req);
+	if (rc != 0)
+		spawn_reap(*pid);
+
+	return rc;
+}
+
+/* Spawns sa->path (or argv[0] searched in PATH) described by sa using
+ * the selected backend. On success 0 is returned and pid of the child stored in pid.
+ * Otherwise an error number is returned: either the process could not be
+ * created or exec failed (the child is already reaped in that case). */
+int spawn_file(pid_t *pid, char *const argv[], const struct spawn_attr *sa)
+{
+	struct spawn_req req;
+
+	if (spawn_backend == SPAWN_POSIX)
+		return spawn_posix(pid, argv, sa);
+
+	req.argv = argv;
+	req.sa = sa;
+	req.errfd = -1;
+	req.err = 0;
+
+	switch (spawn_backend) {
+		case SPAWN_FORK:
+			return spawn_fork(pid, &req);
+		case SPAWN_VFORK:
+			return spawn_vfork(pid, &req);
+		case SPAWN_ZYGOTE:
+			return spawn_zygote(pid, argv, &req);
+		default:
+			return spawn_clone3(pid, &req);
+	}
+}
+
+#endif /* SPAWN_H */
@@ -0,0 +1,234 @@
+/* spawner.h - Mini POSIX Shell
+ *
+ * Spawner threads (shell -j N): a non-interactive shell hands its
+ * background jobs to a small pool of threads which spawn them and register
+ * them in the job table, while the exec thread goes on with the next
+ * command. A burst of "cmd &" lines is spawned on as many CPUs as there
+ * are spawners instead of one job at a time.
+ *
+ * The queue slot of a line is reused as soon as the exec thread is done
+ * with it, so a job is copied (argument vectors, redirections) into an
+ * arena of its own. Jobs wait in a list under a mutex; one condition
+ * variable wakes the spawners, another one wakes spawner_drain(), which
+ * returns once every queued job has been spawned. The exec thread drains
+ * the spawners before a built-in command which depends on the jobs or on
+ * the state they are spawned with (wait, jobs, kill, cd, pipesize, exit,
+ * see BUILTIN_SYNC). An interactive shell spawns in the exec thread, so
+ * the "[N] PID" line of a job comes before the next prompt.
+ *
+ */
+
+#ifndef SPAWNER_H
+#define SPAWNER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+#include "parse.h"
+#include "stats.h"
+#include "trace.h"
+
+/* most spawner threads */
+#define SPAWNER_MAX 64
+/* spawner threads by default (fewer if there are fewer CPUs, none on a
+ * single CPU) */
+#define SPAWNER_DEFAULT 4
+
+/* background job waiting for a spawner */
+struct spawner_job {
+	struct command *cmd;
+	struct arena arena;        /* holds the copy of the command */
+	struct spawner_job *next;
+};
+
+/* spawns background pipeline cmd (in arena a) as a job */
+typedef int (*spawner_fn)(struct command *cmd, struct arena *a);
+
+static int spawner_n;            /* running threads, 0 if none */
+static int spawner_pending;      /* queued or being spawned */
+static int spawner_stopping;
+static spawner_fn spawner_run;
+static struct spawner_job *spawner_head;
+static struct spawner_job **spawner_tail = &spawner_head;
+static struct spawner_job *spawner_free;   /* recycled with their arenas */
+static pthread_t spawner_threads[SPAWNER_MAX];
+static pthread_mutex_t spawner_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spawner_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spawner_idle = PTHREAD_COND_INITIALIZER;
+
+
+/* Spawner thread: spawns the queued jobs until spawner_stop(). */
+static void *spawner_thread(void *arg)
+{
+	struct spawner_job *j;
+
+	stats_register("spawner");
+	trace_register("spawner");
+	pthread_mutex_lock(&spawner_mtx);
+	for (;;) {
+		while (spawner_head == NULL && !spawner_stopping)
+			pthread_cond_wait(&spawner_work, &spawner_mtx);
+		if (spawner_head == NULL)
+			break;
+		j = spawner_head;
+		spawner_head = j->next;
+		if (spawner_head == NULL)
+			spawner_tail = &spawner_head;
+		pthread_mutex_unlock(&spawner_mtx);
+
+		spawner_run(j->cmd, &j->arena);
+		arena_reset(&j->arena);
+
+		pthread_mutex_lock(&spawner_mtx);
+		j->next = spawner_free;
+		spawner_free = j;
+		if (--spawner_pending == 0)
+			pthread_cond_broadcast(&spawner_idle);
+	}
+	pthread_mutex_unlock(&spawner_mtx);
+
+	return NULL;
+}
+
+/* Returns a copy of pipeline cmd in arena a, or NULL if there is not
+ * enough memory. */
+static struct command *spawner_copy(const struct command *cmd,
+                                    struct arena *a)
+{
+	struct command *head = NULL, **p = &head, *c;
+	int i;
+
+	for (; cmd != NULL; cmd = cmd->pipe) {
+		c = arena_alloc(a, sizeof(*c));
+		if (c == NULL)
+			return NULL;
+		*c = *cmd;
+		c->argv = arena_alloc(a, (cmd->argc + 1) * sizeof(char *));
+		if (c->argv == NULL)
+			return NULL;
+		for (i = 0; i < cmd->argc; i++) {
+			c->argv[i] = arena_strndup(a, cmd->argv[i],
+			                           strlen(cmd->argv[i]));
+			if (c->argv[i] == NULL)
+				return NULL;
+		}
+		c->argv[i] = NULL;
+		if (cmd->redir_out != NULL &&
+		    (c->redir_out = arena_strndup(a, cmd->redir_out,
+		                                  strlen(cmd->redir_out))) == NULL)
+			return NULL;
+		if (cmd->redir_in != NULL &&
+		    (c->redir_in = arena_strndup(a, cmd->redir_in,
+		                                 strlen(cmd->redir_in))) == NULL)
+			return NULL;
+		c->pipe = NULL;
+		*p = c;
+		p = &c->pipe;
+	}
+
+	return head;
+}
+
+/* Queues background pipeline cmd for the spawners. Returns 0 on success,
+ * -1 if there are no spawners or not enough memory (the caller spawns the
+ * job itself). */
+int spawner_submit(const struct command *cmd)
+{
+	struct spawner_job *j;
+
+	if (spawner_n == 0)
+		return -1;
+	pthread_mutex_lock(&spawner_mtx);
+	j = spawner_free;
+	if (j != NULL)
+		spawner_free = j->next;
+	pthread_mutex_unlock(&spawner_mtx);
+	if (j == NULL) {
+		j = malloc(sizeof(*j));
+		if (j == NULL)
+			return -1;
+		arena_init(&j->arena);
+	}
+
+	j->cmd = spawner_copy(cmd, &j->arena);
+	pthread_mutex_lock(&spawner_mtx);
+	if (j->cmd == NULL) {
+		arena_reset(&j->arena);
+		j->next = spawner_free;
+		spawner_free = j;
+		pthread_mutex_unlock(&spawner_mtx);
+		return -1;
+	}
+	j->next = NULL;
+	*spawner_tail = j;
+	spawner_tail = &j->next;
+	spawner_pending++;
+	pthread_cond_signal(&spawner_work);
+	pthread_mutex_unlock(&spawner_mtx);
+
+	return 0;
+}
+
+/* Waits until all the queued jobs are spawned and registered. */
+void spawner_drain(void)
+{
+	uint64_t tt;
+
+	if (spawner_n == 0)
+		return;
+	tt = trace_begin();
+	pthread_mutex_lock(&spawner_mtx);
+	while (spawner_pending > 0)
+		pthread_cond_wait(&spawner_idle, &spawner_mtx);
+	pthread_mutex_unlock(&spawner_mtx);
+	trace_end("spawner drain", tt, NULL, 0);
+}
+
+/* Starts n spawner threads running fn, they inherit the signal mask of
+ * the caller. Returns the number of threads started (reported if fewer,
+ * the jobs are then spawned by the caller if there are none). */
+int spawner_start(int n, spawner_fn fn)
+{
+	int rc;
+
+	spawner_run = fn;
+	if (n > SPAWNER_MAX)
+		n = SPAWNER_MAX;
+	for (spawner_n = 0; spawner_n < n; spawner_n++) {
+		rc = pthread_create(&spawner_threads[spawner_n], NULL,
+		                    spawner_thread, NULL);
+		if (rc != 0) {
+			fprintf(stderr, "spawner: %s\n", strerror(rc));
+			break;
+		}
+	}
+
+	return spawner_n;
+}
+
+/* Spawns the queued jobs and stops the spawner threads. */
+void spawner_stop(void)
+{
+	struct spawner_job *j;
+	int i;
+
+	if (spawner_n == 0)
+		return;
+	pthread_mutex_lock(&spawner_mtx);
+	spawner_stopping = 1;
+	pthread_cond_broadcast(&spawner_work);
+	pthread_mutex_unlock(&spawner_mtx);
+	for (i = 0; i < spawner_n; i++)
+		pthread_join(spawner_threads[i], NULL);
+	spawner_n = 0;
+
+	while ((j = spawner_free) != NULL) {
+		spawner_free = j->next;
+		arena_free(&j->arena);
+		free(j);
+	}
+}
+
+#endif /* SPAWNER_H */
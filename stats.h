@@ -0,0 +1,250 @@
+/* stats.h - Mini POSIX Shell
+ *
+ * Always-on latency histograms of the phases of a command: reading the
+ * input, parsing, the handoff to the exec thread, spawning, time to exec,
+ * waiting and the return to the prompt (see enum stats_phase). Printed and
+ * reset by the stats built-in command.
+ *
+ * Every thread records into histograms of its own (stats_register()), so
+ * recording is a clock_gettime() (vDSO, no system call) and a relaxed
+ * store, without locks or atomic read-modify-write. The histograms are
+ * log-linear: STATS_SUB linear buckets for every power of two nanoseconds,
+ * which bounds the error of a percentile to 1/STATS_SUB (6.25 %). A reset
+ * only takes a snapshot which is subtracted from the counts, the owning
+ * thread's histograms are never written by another one.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/* linear buckets per power of two */
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1 << STATS_SUB_BITS)
+/* longer times (over 18 minutes) land in the last bucket */
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB)
+
+enum stats_phase {
+	STATS_READ = 0,   /* read() of the input (a blocking read includes
+	                     the wait for input) */
+	STATS_PARSE,      /* tokenizing a line */
+	STATS_QUEUE,      /* from parsed until executed */
+	STATS_SPAWN,      /* one spawn, until the parent resumes */
+	STATS_EXEC,       /* from executing until all stages are spawned */
+	STATS_WAIT,       /* waiting for the foreground stages */
+	STATS_BUILTIN,    /* running a built-in command */
+	STATS_PROMPT,     /* from finished until the next prompt */
+	STATS_PHASES
+};
+
+static const char *const stats_names[STATS_PHASES] = {
+	"read", "parse", "queue", "spawn", "exec", "wait", "builtin", "prompt"
+};
+
+struct stats_hist {
+	uint64_t count[STATS_BUCKETS];
+	uint64_t n;   /* sum of the counts, only in sums */
+};
+
+struct stats_thread {
+	const char *name;
+	struct stats_hist live[STATS_PHASES];   /* written by the owner only */
+	struct stats_hist base[STATS_PHASES];   /* counts at the last reset */
+	struct stats_thread *next;
+};
+
+static struct stats_thread *stats_list;
+static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct stats_thread *stats_self;
+
+
+/* Makes the calling thread record its phases under name. Returns 0 on
+ * success, -1 if there is not enough memory (nothing is recorded). */
+int stats_register(const char *name)
+{
+	struct stats_thread *t, **p;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return -1;
+	t->name = name;
+
+	pthread_mutex_lock(&stats_mtx);
+	for (p = &stats_list; *p != NULL; p = &(*p)->next)
+		;
+	*p = t;
+	pthread_mutex_unlock(&stats_mtx);
+	stats_self = t;
+
+	return 0;
+}
+
+/* Returns the bucket of ns nanoseconds. */
+static inline int stats_bucket(uint64_t ns)
+{
+	int e;
+
+	if (ns < STATS_SUB)
+		return ns;
+	e = 63 - __builtin_clzll(ns);
+	if (e >= STATS_MAX_BITS)
+		return STATS_BUCKETS - 1;
+
+	return (e - STATS_SUB_BITS + 1) * STATS_SUB +
+	       ((ns >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/* Returns the middle of bucket b in nanoseconds. */
+static double stats_value(int b)
+{
+	int e, m;
+
+	if (b < STATS_SUB)
+		return b;
+	e = b / STATS_SUB + STATS_SUB_BITS - 1;
+	m = b % STATS_SUB;
+
+	return (double)((uint64_t)(STATS_SUB + m) << (e - STATS_SUB_BITS)) +
+	       (double)((uint64_t)1 << (e - STATS_SUB_BITS)) / 2;
+}
+
+/* Stores the current time in t. */
+static inline void stats_now(struct timespec *t)
+{
+	clock_gettime(CLOCK_MONOTONIC, t);
+}
+
+/* Records ns nanoseconds spent in phase by the calling thread. */
+static inline void stats_add(int phase, long ns)
+{
+	struct stats_hist *h;
+	int b;
+
+	if (stats_self == NULL)
+		return;
+	h = &stats_self->live[phase];
+	b = stats_bucket(ns > 0 ? ns : 0);
+	/* the only writer, the stores are atomic for the readers */
+	__atomic_store_n(&h->count[b], h->count[b] + 1, __ATOMIC_RELAXED);
+}
+
+/* Records the time since t0 spent in phase, t0 is set to now. */
+static inline void stats_lap(int phase, struct timespec *t0)
+{
+	struct timespec t;
+
+	stats_now(&t);
+	stats_add(phase, (t.tv_sec - t0->tv_sec) * 1000000000L +
+	                 (t.tv_nsec - t0->tv_nsec));
+	*t0 = t;
+}
+
+/* Adds the counts of phase of thread t since the last reset to h. */
+static void stats_sum(struct stats_hist *h, struct stats_thread *t, int phase)
+{
+	uint64_t c;
+	int b;
+
+	for (b = 0; b < STATS_BUCKETS; b++) {
+		c = __atomic_load_n(&t->live[phase].count[b], __ATOMIC_RELAXED) -
+		    t->base[phase].count[b];
+		h->count[b] += c;
+		h->n += c;
+	}
+}
+
+/* Returns the q quantile of h in microseconds. */
+static double stats_quantile(const struct stats_hist *h, double q)
+{
+	uint64_t rank, seen = 0;
+	int b;
+
+	rank = (uint64_t)(q * h->n);
+	if (rank >= h->n)
+		rank = h->n - 1;
+	for (b = 0; b < STATS_BUCKETS; b++) {
+		seen += h->count[b];
+		if (seen > rank)
+			break;
+	}
+
+	return stats_value(b) / 1e3;
+}
+
+/* Prints one row of the table for h. */
+static void stats_row(FILE *f, const char *phase, const char *thread,
+                      const struct stats_hist *h)
+{
+	int b;
+
+	for (b = STATS_BUCKETS - 1; b > 0 && h->count[b] == 0; b--)
+		;
+	fprintf(f, "%-8s %-7s %10llu %10.1f %10.1f %10.1f %10.1f\n", phase,
+	        thread, (unsigned long long)h->n, stats_quantile(h, 0.5),
+	        stats_quantile(h, 0.99), stats_quantile(h, 0.999),
+	        stats_value(b) / 1e3);
+}
+
+/* Prints p50, p99, p999 and the maximum of every phase recorded since the
+ * last reset into f, with a row per thread if threads is set. */
+void stats_print(FILE *f, int threads)
+{
+	struct stats_hist *h;
+	struct stats_thread *t;
+	int p;
+
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		fprintf(stderr, "Not enough memory!\n");
+		return;
+	}
+	fprintf(f, "%-8s %-7s %10s %10s %10s %10s %10s\n", "phase", "thread",
+	        "count", "p50_us", "p99_us", "p999_us", "max_us");
+
+	pthread_mutex_lock(&stats_mtx);
+	for (p = 0; p < STATS_PHASES; p++) {
+		if (threads) {
+			for (t = stats_list; t != NULL; t = t->next) {
+				memset(h, 0, sizeof(*h));
+				stats_sum(h, t, p);
+				if (h->n > 0)
+					stats_row(f, stats_names[p], t->name, h);
+			}
+			continue;
+		}
+		memset(h, 0, sizeof(*h));
+		for (t = stats_list; t != NULL; t = t->next)
+			stats_sum(h, t, p);
+		if (h->n > 0)
+			stats_row(f, stats_names[p], "all", h);
+	}
+	pthread_mutex_unlock(&stats_mtx);
+	free(h);
+}
+
+/* Starts counting from zero again. */
+void stats_reset(void)
+{
+	struct stats_thread *t;
+	int p, b;
+
+	pthread_mutex_lock(&stats_mtx);
+	for (t = stats_list; t != NULL; t = t->next) {
+		for (p = 0; p < STATS_PHASES; p++) {
+			for (b = 0; b < STATS_BUCKETS; b++)
+				t->base[p].count[b] = __atomic_load_n(
+				    &t->live[p].count[b], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stats_mtx);
+}
+
+#endif /* STATS_H */
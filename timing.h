@@ -0,0 +1,274 @@
+/* timing.h - Mini POSIX Shell
+ *
+ * Resource usage of a foreground command prefixed with time. Every stage
+ * of the pipeline is reaped with wait4(2), which returns its rusage: user
+ * and system time, maximum resident set size, page faults and context
+ * switches. The stages are waited for through pidfds in the order they
+ * exit, so the real time of a stage ends when that stage exits, not when
+ * the stage before it is reaped. A built-in command is measured with
+ * RUSAGE_THREAD around its run in the shell.
+ *
+ * The report also shows the shell's own share of the latency: parsing
+ * the line, the queue between the input and exec threads and spawning
+ * the stages (pipes, redirections and the spawn backend).
+ *
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "arena.h"
+#include "parse.h"
+
+/* bytes of a stage's command line printed in the report */
+#define TIME_CMDLINE 40
+
+struct time_stage {
+	pid_t pid;               /* -1 not spawned, 0 built-in command */
+	int done;                /* reaped */
+	int status;              /* wait status, -1 if lost */
+	struct timespec start;   /* spawned */
+	struct timespec end;     /* exited */
+	struct rusage ru;
+};
+
+struct time_job {
+	struct time_stage *st;
+	struct pollfd *pfd;
+	int n;                     /* stages */
+	int spawned;               /* stages spawned */
+	long parse_ns;             /* tokenizing the line */
+	long queue_ns;             /* from parsed until run */
+	struct timespec start;     /* run began */
+	struct timespec last;      /* last stage spawned */
+	struct timespec end;       /* all stages done */
+};
+
+
+/* Returns the nanoseconds from a to b. */
+static long time_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000L +
+	       (b->tv_nsec - a->tv_nsec);
+}
+
+/* Returns the milliseconds of tv. */
+static double time_tv_ms(const struct timeval *tv)
+{
+	return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+/* Starts timing the pipeline cmd, parsed parse_ns long until parsed. The
+ * stages are kept in arena a. Returns 0 on success, -1 if there is not
+ * enough memory. */
+int time_init(struct time_job *tj, const struct command *cmd,
+              struct arena *a, long parse_ns, const struct timespec *parsed)
+{
+	const struct command *c;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &tj->start);
+	for (tj->n = 0, c = cmd; c != NULL; c = c->pipe)
+		tj->n++;
+	tj->st = arena_alloc(a, tj->n * sizeof(struct time_stage));
+	tj->pfd = arena_alloc(a, tj->n * sizeof(struct pollfd));
+	if (tj->st == NULL || tj->pfd == NULL)
+		return -1;
+	for (i = 0; i < tj->n; i++) {
+		tj->st[i].pid = -1;
+		tj->st[i].done = 0;
+		tj->st[i].status = -1;
+	}
+	tj->spawned = 0;
+	tj->parse_ns = parse_ns;
+	tj->queue_ns = time_ns(parsed, &tj->start);
+	tj->last = tj->start;
+
+	return 0;
+}
+
+/* Records stage i spawned as process pid. */
+void time_spawned(struct time_job *tj, int i, pid_t pid)
+{
+	clock_gettime(CLOCK_MONOTONIC, &tj->st[i].start);
+	tj->st[i].pid = pid;
+	tj->last = tj->st[i].start;
+	tj->spawned++;
+}
+
+/* Starts (end is 0) or ends (end is 1) measuring the built-in command run
+ * by the calling thread as stage st. */
+void time_self(struct time_stage *st, int end)
+{
+	struct rusage ru;
+
+	if (!end) {
+		st->pid = 0;
+		getrusage(RUSAGE_THREAD, &st->ru);
+		clock_gettime(CLOCK_MONOTONIC, &st->start);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &st->end);
+	getrusage(RUSAGE_THREAD, &ru);
+	timersub(&ru.ru_utime, &st->ru.ru_utime, &st->ru.ru_utime);
+	timersub(&ru.ru_stime, &st->ru.ru_stime, &st->ru.ru_stime);
+	st->ru.ru_maxrss = ru.ru_maxrss;
+	st->ru.ru_minflt = ru.ru_minflt - st->ru.ru_minflt;
+	st->ru.ru_majflt = ru.ru_majflt - st->ru.ru_majflt;
+	st->ru.ru_nvcsw = ru.ru_nvcsw - st->ru.ru_nvcsw;
+	st->ru.ru_nivcsw = ru.ru_nivcsw - st->ru.ru_nivcsw;
+	st->done = 1;
+	st->status = 0;
+}
+
+/* Reaps stage st with its resource usage. */
+static void time_reap(struct time_stage *st)
+{
+	pid_t w;
+
+	do {
+		w = wait4(st->pid, &st->status, 0, &st->ru);
+	} while (w == -1 && errno == EINTR);
+	clock_gettime(CLOCK_MONOTONIC, &st->end);
+	if (w == -1) {
+		if (errno != ECHILD)
+			perror("wait4");
+		st->status = -1;
+		memset(&st->ru, 0, sizeof(st->ru));
+	}
+	st->done = 1;
+}
+
+/* Waits for the spawned stages, each is reaped as soon as its pidfd
+ * reports the exit (in order, without pidfds). Stores the wait status of
+ * the last stage in status, -1 if it was not spawned. Returns 0. */
+int time_wait(struct time_job *tj, int *status)
+{
+	struct pollfd *pfd = tj->pfd;
+	int i, polled = 0;
+
+	for (i = 0; i < tj->n; i++) {
+		pfd[i].fd = -1;
+		pfd[i].events = POLLIN;
+		if (tj->st[i].pid <= 0 || tj->st[i].done)
+			continue;
+		pfd[i].fd = syscall(SYS_pidfd_open, tj->st[i].pid, 0);
+		if (pfd[i].fd != -1)
+			polled++;
+	}
+	while (polled > 0) {
+		if (poll(pfd, tj->n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		for (i = 0; i < tj->n; i++) {
+			if (pfd[i].fd == -1 || pfd[i].revents == 0)
+				continue;
+			time_reap(&tj->st[i]);
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			polled--;
+		}
+	}
+	for (i = 0; i < tj->n; i++) {
+		if (pfd[i].fd != -1)
+			close(pfd[i].fd);
+		if (tj->st[i].pid > 0 && !tj->st[i].done)
+			time_reap(&tj->st[i]);
+	}
+	*status = (tj->st[tj->n - 1].pid > 0) ? tj->st[tj->n - 1].status : -1;
+
+	return 0;
+}
+
+/* Prints the arguments of command c, at most TIME_CMDLINE bytes. */
+static void time_cmdline(const struct command *c)
+{
+	char buf[TIME_CMDLINE + 1];
+	size_t len = 0;
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; i < c->argc && len < TIME_CMDLINE; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%s",
+		                i ? " " : "", c->argv[i]);
+	fprintf(stderr, "%s%s", buf,
+	        (i < c->argc || len > TIME_CMDLINE) ? "..." : "");
+}
+
+/* Prints one row of the report. */
+static void time_row(const char *label, double real_ms,
+                     const struct rusage *ru)
+{
+	fprintf(stderr, "%-6s %10.3f %9.3f %9.3f %9ld %7ld %6ld %6ld %6ld",
+	        label, real_ms, time_tv_ms(&ru->ru_utime),
+	        time_tv_ms(&ru->ru_stime), ru->ru_maxrss, ru->ru_minflt,
+	        ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/* Prints the report of the timed pipeline cmd on stderr: a row for every
+ * stage, the total (user and system time, faults and context switches
+ * summed, the largest RSS) and the shell's own overhead. */
+void time_print(struct time_job *tj, const struct command *cmd)
+{
+	struct rusage sum;
+	struct time_stage *st;
+	char label[16];
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &tj->end);
+	memset(&sum, 0, sizeof(sum));
+
+	fprintf(stderr, "%-6s %10s %9s %9s %9s %7s %6s %6s %6s  %s\n", "stage",
+	        "real_ms", "user_ms", "sys_ms", "maxrss_kb", "minflt",
+	        "majflt", "nvcsw", "nivcsw", "command");
+	for (i = 0; i < tj->n; i++, cmd = cmd->pipe) {
+		st = &tj->st[i];
+		snprintf(label, sizeof(label), "%d", i + 1);
+		if (st->pid == -1) {
+			fprintf(stderr, "%-6s %10s  not spawned: ", label, "-");
+			time_cmdline(cmd);
+			fprintf(stderr, "\n");
+			continue;
+		}
+		time_row(label, time_ns(&st->start, &st->end) / 1e6, &st->ru);
+		fprintf(stderr, "  ");
+		time_cmdline(cmd);
+		fprintf(stderr, "%s\n", st->pid == 0 ? " (built-in)" : "");
+
+		timeradd(&sum.ru_utime, &st->ru.ru_utime, &sum.ru_utime);
+		timeradd(&sum.ru_stime, &st->ru.ru_stime, &sum.ru_stime);
+		if (st->ru.ru_maxrss > sum.ru_maxrss)
+			sum.ru_maxrss = st->ru.ru_maxrss;
+		sum.ru_minflt += st->ru.ru_minflt;
+		sum.ru_majflt += st->ru.ru_majflt;
+		sum.ru_nvcsw += st->ru.ru_nvcsw;
+		sum.ru_nivcsw += st->ru.ru_nivcsw;
+	}
+	time_row("total", time_ns(&tj->start, &tj->end) / 1e6, &sum);
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "shell: parse %.1f us, queue %.1f us", tj->parse_ns / 1e3,
+	        tj->queue_ns / 1e3);
+	if (tj->spawned > 0)
+		fprintf(stderr, ", spawn %.1f us (%d stage%s)",
+		        time_ns(&tj->start, &tj->last) / 1e3, tj->spawned,
+		        tj->spawned > 1 ? "s" : "");
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+#endif /* TIMING_H */
@@ -0,0 +1,224 @@
+/* trace.h - Mini POSIX Shell
+ *
+ * Event tracing (shell --trace FILE) in the Chrome JSON trace format, for
+ * chrome://tracing or Perfetto. The shell threads record spans (parsing,
+ * spawning, waiting, reaping, signal handling) and the places where they
+ * block one another (the command queue, the job table lock) into rings of
+ * their own; a writer thread drains the rings every TRACE_FLUSH_MS and
+ * formats the events, so the traced threads never do I/O nor take a lock.
+ *
+ * A ring has a single producer (its thread) and a single consumer (the
+ * writer), the indexes are free running counters published with release
+ * stores. A full ring drops the event and counts it, tracing never blocks
+ * the shell. Without --trace every call returns at the first test.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/* events per thread ring, a power of two */
+#define TRACE_RING 16384
+/* interval of the writer */
+#define TRACE_FLUSH_MS 10
+
+struct trace_event {
+	const char *name;   /* static strings only, not copied */
+	const char *key;    /* name of arg, NULL for none */
+	long arg;
+	uint64_t ts;        /* ns since the start of the trace */
+	uint64_t dur;       /* ns, a complete span */
+};
+
+struct trace_ring {
+	unsigned int head;   /* written by the thread */
+	unsigned int tail;   /* written by the writer */
+	unsigned long dropped;
+	int tid;
+	const char *name;
+	struct trace_ring *next;
+	struct trace_event ev[TRACE_RING];
+};
+
+static int trace_on;
+static FILE *trace_file;
+static uint64_t trace_t0;
+static int trace_stop_flag;
+static unsigned long trace_written;
+static pthread_t trace_thread;
+static struct trace_ring *trace_rings;
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct trace_ring *trace_self;
+
+
+/* Returns the monotonic time in ns. */
+static inline uint64_t trace_clock(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* Returns the start of a span for trace_end(), 0 if the calling thread is
+ * not traced. */
+static inline uint64_t trace_begin(void)
+{
+	return (trace_self != NULL) ? trace_clock() : 0;
+}
+
+/* Records span name started at t0 (trace_begin()) with argument key=arg
+ * (key may be NULL). */
+static inline void trace_end(const char *name, uint64_t t0, const char *key,
+                             long arg)
+{
+	struct trace_ring *r = trace_self;
+	struct trace_event *e;
+	unsigned int head;
+
+	if (r == NULL || t0 == 0)
+		return;
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_RING) {
+		r->dropped++;
+		return;
+	}
+	e = &r->ev[head & (TRACE_RING - 1)];
+	e->name = name;
+	e->key = key;
+	e->arg = arg;
+	e->ts = t0 - trace_t0;
+	e->dur = trace_clock() - t0;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes the events of ring r queued so far. */
+static void trace_drain(struct trace_ring *r)
+{
+	struct trace_event *e;
+	unsigned int tail, head;
+	pid_t pid = getpid();
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	for (tail = r->tail; tail != head; tail++) {
+		e = &r->ev[tail & (TRACE_RING - 1)];
+		fprintf(trace_file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+		        "\"dur\":%.3f,\"pid\":%d,\"tid\":%d", e->name, e->ts / 1e3,
+		        e->dur / 1e3, pid, r->tid);
+		if (e->key != NULL)
+			fprintf(trace_file, ",\"args\":{\"%s\":%ld}", e->key,
+			        e->arg);
+		fputc('}', trace_file);
+		trace_written++;
+	}
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Writer thread: drains the rings until trace_stop(). */
+static void *trace_writer(void *arg)
+{
+	struct timespec ts = { 0, TRACE_FLUSH_MS * 1000000L };
+	struct trace_ring *r;
+	int stop;
+
+	do {
+		nanosleep(&ts, NULL);
+		stop = __atomic_load_n(&trace_stop_flag, __ATOMIC_ACQUIRE);
+		pthread_mutex_lock(&trace_mtx);
+		for (r = trace_rings; r != NULL; r = r->next)
+			trace_drain(r);
+		pthread_mutex_unlock(&trace_mtx);
+	} while (!stop);
+
+	return NULL;
+}
+
+/* Makes the calling thread record its events under name. Does nothing
+ * without tracing. Returns 0 on success, -1 if there is not enough memory
+ * (the thread is not traced). */
+int trace_register(const char *name)
+{
+	struct trace_ring *r;
+
+	if (!trace_on)
+		return 0;
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return -1;
+	r->tid = syscall(SYS_gettid);
+	r->name = name;
+
+	pthread_mutex_lock(&trace_mtx);
+	fprintf(trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+	        "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", getpid(),
+	        r->tid, name);
+	r->next = trace_rings;
+	trace_rings = r;
+	pthread_mutex_unlock(&trace_mtx);
+	trace_self = r;
+
+	return 0;
+}
+
+/* Ends the trace: the writer drains the rings for the last time and the
+ * file is completed. Registered with atexit(), so it also runs when the
+ * shell exits on a signal. */
+void trace_stop(void)
+{
+	struct trace_ring *r;
+	unsigned long dropped = 0;
+
+	if (!trace_on)
+		return;
+	trace_on = 0;
+	__atomic_store_n(&trace_stop_flag, 1, __ATOMIC_RELEASE);
+	pthread_join(trace_thread, NULL);
+
+	for (r = trace_rings; r != NULL; r = r->next)
+		dropped += r->dropped;
+	fprintf(trace_file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	if (fclose(trace_file) == EOF)
+		perror("trace");
+	if (dropped > 0)
+		fprintf(stderr, "trace: %lu events written, %lu dropped (rings "
+		        "full)\n", trace_written, dropped);
+}
+
+/* Starts tracing into file path: opens it and starts the writer thread,
+ * which inherits the signal mask of the caller. Returns 0 on success, -1
+ * on error (reported). */
+int trace_start(const char *path)
+{
+	int rc;
+
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		perror(path);
+		return -1;
+	}
+	trace_t0 = trace_clock();
+	fprintf(trace_file, "{\"traceEvents\":[\n{\"name\":\"process_name\","
+	        "\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"shell\"}}",
+	        getpid());
+	rc = pthread_create(&trace_thread, NULL, trace_writer, NULL);
+	if (rc != 0) {
+		fprintf(stderr, "trace: %s\n", strerror(rc));
+		fclose(trace_file);
+		return -1;
+	}
+	trace_on = 1;
+	atexit(trace_stop);
+
+	return 0;
+}
+
+#endif /* TRACE_H */
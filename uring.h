@@ -0,0 +1,204 @@
+/* uring.h - Mini POSIX Shell
+ *
+ * Minimal io_uring interface on top of the raw system calls (no liburing):
+ * setting up and tearing down a ring, probing the supported opcodes, getting
+ * submission queue entries and consuming completions. The shell uses it for
+ * its io_uring event loop (-e uring), see loop_uring_start() in shell.c.
+ *
+ * A ring is used by one thread only. SQEs are only queued by uring_sqe(),
+ * they reach the kernel with the next uring_submit(), so the requests of a
+ * command are submitted together with the wait for its completion.
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* opcodes newer than some installed kernel headers */
+#define URING_OP_WAITID 50   /* IORING_OP_WAITID, Linux 6.7 */
+
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int queued;    /* SQEs filled, not submitted yet */
+	unsigned int features;  /* IORING_FEAT_* */
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_len;
+	size_t cq_len;
+};
+
+
+/* Sets up ring r with entries submission queue entries. Returns 0 on
+ * success, -1 on error (errno is set, ENOSYS without io_uring). */
+int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (r->fd == -1)
+		return -1;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	/* one mapping for both rings since Linux 5.4 */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+	r->sq_map = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE,
+	                 MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto err_close;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE,
+		                 MAP_SHARED|MAP_POPULATE, r->fd,
+		                 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto err_sq;
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	               PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+	               IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_cq;
+
+	r->sq_head = (unsigned int *)((char *)r->sq_map + p.sq_off.head);
+	r->sq_tail = (unsigned int *)((char *)r->sq_map + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)((char *)r->sq_map + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)((char *)r->sq_map + p.sq_off.array);
+	r->cq_head = (unsigned int *)((char *)r->cq_map + p.cq_off.head);
+	r->cq_tail = (unsigned int *)((char *)r->cq_map + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)((char *)r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+	r->queued = 0;
+	r->features = p.features;
+
+	return 0;
+
+	/* the cleanup calls succeed, errno of the failed mmap() is kept */
+err_cq:
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_len);
+err_sq:
+	munmap(r->sq_map, r->sq_len);
+err_close:
+	close(r->fd);
+	return -1;
+}
+
+/* Tears down ring r, requests in flight are cancelled. */
+void uring_free(struct uring *r)
+{
+	munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_len);
+	munmap(r->sq_map, r->sq_len);
+	close(r->fd);
+}
+
+/* Returns 1 if the kernel supports all n opcodes ops on ring r, otherwise
+ * 0 (also on kernels without IORING_REGISTER_PROBE, before Linux 5.6). */
+int uring_probe(struct uring *r, const int *ops, int n)
+{
+	struct io_uring_probe *p;
+	int i, rv = 0;
+
+	p = calloc(1, sizeof(*p) + 256 * sizeof(struct io_uring_probe_op));
+	if (p == NULL)
+		return 0;
+	if (syscall(SYS_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+	            p, 256) == 0) {
+		for (i = 0; i < n; i++)
+			if (ops[i] > p->last_op ||
+			    !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+				break;
+		rv = (i == n);
+	}
+	free(p);
+
+	return rv;
+}
+
+/* Submits the queued SQEs of ring r and waits for at least wait
+ * completions. Returns the number of SQEs consumed, or -1 on error (errno
+ * is set, EINTR if interrupted by a signal). */
+int uring_submit(struct uring *r, unsigned int wait)
+{
+	int n;
+
+	n = syscall(SYS_io_uring_enter, r->fd, r->queued, wait,
+	            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (n > 0)
+		r->queued -= n;
+
+	return n;
+}
+
+/* Returns a zeroed SQE of ring r to be filled in, queued for the next
+ * uring_submit(). A full submission queue is submitted first. Returns NULL
+ * if that fails. */
+struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, i;
+
+	tail = *r->sq_tail;
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+	    r->sq_entries) {
+		if (uring_submit(r, 0) == -1)
+			return NULL;
+	}
+	i = tail & *r->sq_mask;
+	sqe = &r->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[i] = i;
+	/* the kernel sees the entry once the tail is stored, which happens
+	 * before the entry is filled in - it is only read on submission */
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+
+	return sqe;
+}
+
+/* Returns the next completion of ring r or NULL if there is none yet.
+ * It stays valid until uring_seen(). */
+struct io_uring_cqe *uring_cqe(struct uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &r->cqes[head & *r->cq_mask];
+}
+
+/* Gives the completion returned by uring_cqe() back to the kernel. */
+void uring_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* URING_H */
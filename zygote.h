@@ -0,0 +1,406 @@
+/* zygote.h - Mini POSIX Shell
+ *
+ * Spawn backend with pre-forked processes (shell -s zygote). A zygote
+ * process is forked from main() before the shell starts its threads and
+ * grows its heap, and keeps ZYGOTE_POOL children parked on a socket. The
+ * children are created with clone(CLONE_PARENT), so they are children of
+ * the shell: it waits for them, gets their SIGCHLD and pidfds as for any
+ * other command. To run a command the shell sends a request with the path,
+ * argv, process group and signal mask and passes the redirections, the
+ * working directory and a pipe for the result as descriptors (SCM_RIGHTS).
+ * The first parked child to receive it replies its pid, asks the zygote to
+ * fork a replacement and sets up and execs the command, the pipe reports
+ * the exec errno like with the fork backend. No page tables are copied and
+ * no process is created on the critical path.
+ *
+ * The zygote and the parked children live in a process group of their own,
+ * so the signals of the terminal do not reach them, and exit when the
+ * shell's end of the socket is closed. The environment is inherited from
+ * the zygote: the shell never changes its own. Requests larger than
+ * ZYGOTE_MSG or with more than ZYGOTE_IOV arguments are left to the
+ * caller (zygote_spawn() returns -1), which uses another backend.
+ *
+ * Several threads may spawn at once (the exec thread and the spawner
+ * threads, see spawner.h): requests are sent under the read side of
+ * zygote_lock, the socket and the working directory are replaced or
+ * closed under its write side.
+ *
+ */
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* children kept parked */
+#define ZYGOTE_POOL 2
+/* largest request (header, path and arguments) */
+#define ZYGOTE_MSG 65536
+/* most arguments sent */
+#define ZYGOTE_IOV 256
+/* retry interval of a failed fork */
+#define ZYGOTE_RETRY_MS 100
+
+/* fixed part of a request, followed by the path (if has_path) and argv,
+ * all '\0' terminated */
+struct zygote_req {
+	pid_t pgid;     /* process group to join, 0 new */
+	int argc;
+	int has_path;   /* else argv[0] is searched in PATH */
+	int fd_in;      /* stdin passed */
+	int fd_out;     /* stdout passed */
+	sigset_t mask;
+};
+
+/* descriptors passed with a request, in this order: result pipe, working
+ * directory, stdin and stdout if passed */
+#define ZYGOTE_FDS 4
+
+/* shell's end of the socket, -1 without the zygote */
+static int zygote_fd = -1;
+/* a byte written here makes the zygote fork a child */
+static int zygote_refill = -1;
+/* working directory passed to the children, reopened after cd */
+static int zygote_cwd = -1;
+/* read locked while zygote_fd and zygote_cwd are used */
+static pthread_rwlock_t zygote_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+/* Parked child: tells the zygote it is ready on ready, waits for a
+ * request on sock, then runs it. Never returns. */
+static void zygote_child(int sock, int ready)
+{
+	static char buf[ZYGOTE_MSG];
+	static char *argv[ZYGOTE_IOV + 1];
+	union {
+		char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct iovec iov = { buf, sizeof(buf) };
+	struct msghdr msg;
+	struct cmsghdr *c;
+	struct zygote_req *req = (struct zygote_req *)buf;
+	int fds[ZYGOTE_FDS], nfds = 0, i, err;
+	char *p, *end, *path = NULL;
+	pid_t pid;
+	ssize_t n;
+
+	/* the pages written before the exec are faulted in now, not when
+	 * the command is waited for */
+	memset(buf, 0, sizeof(buf));
+	memset(argv, 0, sizeof(argv));
+	while (write(ready, "", 1) == -1 && errno == EINTR)
+		;
+
+	do {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = sizeof(ctl.buf);
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n == -1 && errno == EINTR);
+	if (n <= 0)  /* the shell is gone */
+		_exit(0);
+
+	c = CMSG_FIRSTHDR(&msg);
+	if (c != NULL && c->cmsg_type == SCM_RIGHTS) {
+		nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+	}
+	/* without the result pipe nobody waits for us */
+	if (nfds < 2 || n < (ssize_t)sizeof(*req) ||
+	    nfds != 2 + req->fd_in + req->fd_out || req->argc > ZYGOTE_IOV)
+		_exit(127);
+	pid = getpid();
+	while (write(fds[0], &pid, sizeof(pid)) == -1 && errno == EINTR)
+		;
+
+	/* unpack the strings, the last one ends the message */
+	p = buf + sizeof(*req);
+	end = buf + n;
+	if (req->has_path) {
+		path = p;
+		p = memchr(p, '\0', end - p);
+		p = (p != NULL) ? p + 1 : end;
+	}
+	for (i = 0; i < req->argc && p < end; i++) {
+		argv[i] = p;
+		p = memchr(p, '\0', end - p);
+		p = (p != NULL) ? p + 1 : end;
+	}
+	argv[i] = NULL;
+	if (i == 0 || end[-1] != '\0') {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	i = 2;
+	if (sigprocmask(SIG_SETMASK, &req->mask, NULL) == -1)
+		goto fail;
+	if (req->fd_in && dup2(fds[i++], STDIN_FILENO) == -1)
+		goto fail;
+	if (req->fd_out && dup2(fds[i++], STDOUT_FILENO) == -1)
+		goto fail;
+	if (setpgid(0, req->pgid) == -1 || fchdir(fds[1]) == -1)
+		goto fail;
+
+	if (path != NULL)
+		execv(path, argv);
+	else
+		execvp(argv[0], argv);
+fail:
+	err = errno;
+	while (write(fds[0], &err, sizeof(err)) == -1 && errno == EINTR)
+		;
+	_exit(127);
+}
+
+/* Forks a parked child, a child of the zygote's parent, and waits until
+ * it is ready. A child only forked would first be scheduled when the
+ * request comes. Returns 0 on success, -1 on error. */
+static int zygote_fork(int sock, int ready[2])
+{
+	char c;
+	long pid;
+
+	pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL,
+	              NULL);
+	if (pid == -1)
+		return -1;
+	if (pid == 0)
+		zygote_child(sock, ready[1]);
+	while (read(ready[0], &c, 1) == -1 && errno == EINTR)
+		;
+
+	return 0;
+}
+
+/* Zygote: keeps pool children parked on sock, forks a new one for every
+ * byte read from refill. Never returns. */
+static void zygote_main(int sock, int refill, int pool)
+{
+	struct pollfd pfd[2];
+	char buf[64];
+	int missing = pool, ready[2];
+	ssize_t n;
+
+	prctl(PR_SET_NAME, "zygote");
+	if (pipe2(ready, O_CLOEXEC) == -1)
+		_exit(1);
+	pfd[0].fd = refill;
+	pfd[0].events = POLLIN;
+	/* no events, only the hang up of the shell's end */
+	pfd[1].fd = sock;
+	pfd[1].events = 0;
+
+	for (;;) {
+		while (missing > 0 && zygote_fork(sock, ready) == 0)
+			missing--;
+		if (poll(pfd, 2, missing > 0 ? ZYGOTE_RETRY_MS : -1) == -1 &&
+		    errno != EINTR)
+			_exit(1);
+		if (pfd[1].revents & (POLLHUP|POLLERR))
+			_exit(0);
+		if (pfd[0].revents & POLLIN) {
+			n = read(refill, buf, sizeof(buf));
+			if (n > 0)
+				missing += n;
+		}
+	}
+}
+
+/* Starts the zygote with pool parked children. Called while the process
+ * is single threaded. Returns 0 on success, -1 on error (reported). */
+int zygote_start(int pool)
+{
+	sigset_t all, old;
+	int sv[2], pfd[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("zygote: socketpair");
+		return -1;
+	}
+	/* never blocks the shell, a full pipe is enough refills */
+	if (pipe2(pfd, O_CLOEXEC) == -1 ||
+	    fcntl(pfd[1], F_SETFL, O_NONBLOCK) == -1) {
+		perror("zygote: pipe");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	/* the zygote and its children start with all signals blocked, a
+	 * request sets the mask of the command */
+	sigfillset(&all);
+	sigprocmask(SIG_BLOCK, &all, &old);
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		close(pfd[1]);
+		setpgid(0, 0);
+		zygote_main(sv[1], pfd[0], pool);
+	}
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	close(sv[1]);
+	close(pfd[0]);
+	if (pid == -1) {
+		perror("zygote: fork");
+		close(sv[0]);
+		close(pfd[1]);
+		return -1;
+	}
+	zygote_fd = sv[0];
+	zygote_refill = pfd[1];
+	zygote_cwd = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+
+	return 0;
+}
+
+/* Tells the zygote the working directory changed. The directory is opened
+ * here, by the thread which changed it, not by the threads spawning. */
+void zygote_cwd_changed(void)
+{
+	pthread_rwlock_wrlock(&zygote_lock);
+	if (zygote_cwd != -1)
+		close(zygote_cwd);
+	zygote_cwd = -1;
+	if (zygote_fd != -1)
+		zygote_cwd = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+	pthread_rwlock_unlock(&zygote_lock);
+}
+
+/* Runs path (NULL searches PATH for argv[0]) with argv in a parked child:
+ * stdin fd_in and stdout fd_out (-1 inherits the shell's), in process
+ * group pgid (-1 the shell's, 0 new) with signal mask. Returns 0 with the
+ * pid of the child stored in pid, an error number if exec failed (the
+ * child in pid is to be reaped) or -1 if the zygote cannot run it. */
+int zygote_spawn(pid_t *pid, const char *path, char *const argv[], int fd_in,
+                 int fd_out, pid_t pgid, const sigset_t *mask)
+{
+	struct zygote_req req;
+	struct iovec iov[ZYGOTE_IOV + 2];
+	union {
+		char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr msg;
+	struct cmsghdr *c;
+	int fds[ZYGOTE_FDS], nfds = 0, pfd[2], err, rc, i, niov = 0, sock;
+	size_t size = sizeof(req);
+	pid_t cpid;
+	ssize_t n;
+
+	if (pgid == -1)
+		pgid = getpgrp();
+
+	memset(&req, 0, sizeof(req));
+	req.pgid = pgid;
+	req.has_path = (path != NULL);
+	req.fd_in = (fd_in != -1);
+	req.fd_out = (fd_out != -1);
+	req.mask = *mask;
+	iov[niov].iov_base = &req;
+	iov[niov++].iov_len = sizeof(req);
+	if (path != NULL) {
+		iov[niov].iov_base = (void *)path;
+		iov[niov].iov_len = strlen(path) + 1;
+		size += iov[niov++].iov_len;
+	}
+	for (i = 0; argv[i] != NULL; i++) {
+		if (i == ZYGOTE_IOV)
+			return -1;
+		iov[niov].iov_base = argv[i];
+		iov[niov].iov_len = strlen(argv[i]) + 1;
+		size += iov[niov++].iov_len;
+	}
+	req.argc = i;
+	if (size > ZYGOTE_MSG)
+		return -1;
+
+	if (pipe2(pfd, O_CLOEXEC) == -1)
+		return -1;
+	fds[nfds++] = pfd[1];
+	fds[nfds++] = -1;   /* zygote_cwd, taken under the lock */
+	if (fd_in != -1)
+		fds[nfds++] = fd_in;
+	if (fd_out != -1)
+		fds[nfds++] = fd_out;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+
+	pthread_rwlock_rdlock(&zygote_lock);
+	sock = zygote_fd;
+	fds[1] = zygote_cwd;
+	if (sock == -1 || fds[1] == -1) {
+		pthread_rwlock_unlock(&zygote_lock);
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+	}
+	memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+	while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 &&
+	       errno == EINTR)
+		;
+	err = errno;
+	pthread_rwlock_unlock(&zygote_lock);
+	close(pfd[1]);
+	if (n == -1) {
+		if (err != EMSGSIZE) {
+			/* the zygote is gone, the first thread to notice
+			 * closes the socket */
+			fprintf(stderr, "zygote: %s\n", strerror(err));
+			pthread_rwlock_wrlock(&zygote_lock);
+			if (zygote_fd == sock) {
+				close(zygote_fd);
+				zygote_fd = -1;
+			}
+			pthread_rwlock_unlock(&zygote_lock);
+		}
+		close(pfd[0]);
+		return -1;
+	}
+
+	/* the pid, then the errno of a failed exec or EOF */
+	while ((n = read(pfd[0], &cpid, sizeof(cpid))) == -1 && errno == EINTR)
+		;
+	rc = -1;   /* the child died before it took over the command */
+	if (n == sizeof(cpid)) {
+		*pid = cpid;
+		while ((n = read(pfd[0], &err, sizeof(err))) == -1 &&
+		       errno == EINTR)
+			;
+		rc = (n == sizeof(err)) ? err : 0;
+	}
+	close(pfd[0]);
+	/* the child is replaced once the command runs, so the fork of the
+	 * zygote does not compete with the exec on a busy CPU */
+	if (write(zygote_refill, "", 1) == -1 && errno != EAGAIN)
+		perror("zygote");
+
+	return rc;
+}
+
+#endif /* ZYGOTE_H */